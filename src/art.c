@@ -7,8 +7,247 @@
 */
 
 #include "art.h"
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <unistd.h>
 // #include "../tests/art_tests.c" // TEMPORARY, TO DELETE
 
+/*** ALLOCATORS ***/
+
+// Trees without an allocator, including the stack trees of the legacy
+// API, use malloc directly
+static inline void *treeAlloc(const ART *tree, size_t size) {
+    ArtAllocator *allocator = tree ? tree->allocator : NULL;
+    return allocator ? allocator->alloc(allocator, size) : malloc(size);
+}
+
+static inline void *treeRealloc(const ART *tree, void *ptr, size_t oldSize, size_t newSize) {
+    ArtAllocator *allocator = tree ? tree->allocator : NULL;
+    return allocator ? allocator->realloc(allocator, ptr, oldSize, newSize) : realloc(ptr, newSize);
+}
+
+static inline void treeFree(const ART *tree, void *ptr, size_t size) {
+    ArtAllocator *allocator = tree ? tree->allocator : NULL;
+    if (allocator) {
+        allocator->free(allocator, ptr, size);
+    } else {
+        free(ptr);
+    }
+}
+
+static void *mallocAlloc(ArtAllocator *allocator, size_t size) {
+    (void)allocator;
+    return malloc(size);
+}
+
+static void *mallocRealloc(ArtAllocator *allocator, void *ptr, size_t oldSize, size_t newSize) {
+    (void)allocator;
+    (void)oldSize;
+    return realloc(ptr, newSize);
+}
+
+static void mallocFree(ArtAllocator *allocator, void *ptr, size_t size) {
+    (void)allocator;
+    (void)size;
+    free(ptr);
+}
+
+static ArtAllocator mallocAllocator = { mallocAlloc, mallocRealloc, mallocFree, NULL, false };
+
+ArtAllocator *artMallocAllocator(void) {
+    return &mallocAllocator;
+}
+
+// Bump allocator over a list of chunks. Only the latest block can be freed
+// or resized in place; everything else is released with the whole arena.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t capacity;
+    _Alignas(16) uint8_t data[];
+} ArenaChunk;
+
+typedef struct {
+    ArtAllocator allocator;
+    ArenaChunk *chunks; // The head chunk is the one being filled
+    size_t chunkSize;
+    uint8_t *last; // Latest block of the head chunk
+} ArenaAllocator;
+
+static inline size_t arenaAlign(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+static void *arenaAlloc(ArtAllocator *allocator, size_t size) {
+    ArenaAllocator *arena = (ArenaAllocator *)allocator;
+    ArenaChunk *head = arena->chunks;
+    size = arenaAlign(size ? size : 1);
+
+    if (head && head->capacity - head->used >= size) {
+        arena->last = head->data + head->used;
+        head->used += size;
+        return arena->last;
+    }
+
+    // Large blocks get a chunk of their own behind the head, so that the
+    // head keeps serving small ones
+    bool large = size > arena->chunkSize / 4;
+    size_t capacity = large ? size : arena->chunkSize;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->used = size;
+    chunk->capacity = capacity;
+
+    if (large && head) {
+        chunk->next = head->next;
+        head->next = chunk;
+    } else {
+        chunk->next = head;
+        arena->chunks = chunk;
+        arena->last = chunk->data;
+    }
+    return chunk->data;
+}
+
+static void *arenaRealloc(ArtAllocator *allocator, void *ptr, size_t oldSize, size_t newSize) {
+    ArenaAllocator *arena = (ArenaAllocator *)allocator;
+    ArenaChunk *head = arena->chunks;
+
+    if (ptr != NULL && ptr == arena->last) {
+        size_t start = arena->last - head->data;
+        if (head->capacity - start >= arenaAlign(newSize)) {
+            head->used = start + arenaAlign(newSize);
+            return ptr;
+        }
+    } else if (ptr != NULL && newSize <= oldSize) {
+        return ptr;
+    }
+
+    void *moved = arenaAlloc(allocator, newSize);
+    if (moved && ptr) {
+        memcpy(moved, ptr, MIN(oldSize, newSize));
+    }
+    return moved;
+}
+
+static void arenaFree(ArtAllocator *allocator, void *ptr, size_t size) {
+    ArenaAllocator *arena = (ArenaAllocator *)allocator;
+    (void)size;
+    if (ptr != NULL && ptr == arena->last) {
+        arena->chunks->used = arena->last - arena->chunks->data;
+        arena->last = NULL;
+    }
+}
+
+static void arenaDestroy(ArtAllocator *allocator) {
+    ArenaAllocator *arena = (ArenaAllocator *)allocator;
+    while (arena->chunks) {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    free(arena);
+}
+
+// A new arena for one tree, which frees it together with all its blocks
+ArtAllocator *artArenaAllocator(size_t chunkSize) {
+    ArenaAllocator *arena = malloc(sizeof(ArenaAllocator));
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->allocator = (ArtAllocator){ arenaAlloc, arenaRealloc, arenaFree, arenaDestroy, true };
+    arena->chunks = NULL;
+    arena->chunkSize = chunkSize ? chunkSize : ART_ARENA_CHUNK_SIZE;
+    arena->last = NULL;
+    return &arena->allocator;
+}
+
+// Per-thread free lists of small blocks in front of malloc. Every block is
+// a malloc block of its rounded size, so any thread may take it over, and
+// blocks of unknown size can always go back to free().
+typedef struct CachedBlock {
+    struct CachedBlock *next;
+} CachedBlock;
+
+typedef struct {
+    CachedBlock *lists[THREAD_CACHE_CLASSES];
+    uint32_t lengths[THREAD_CACHE_CLASSES];
+} ThreadCache;
+
+static _Thread_local ThreadCache threadCache;
+
+static inline int cacheClass(size_t size) {
+    return size ? (int)((size - 1) / THREAD_CACHE_GRANULE) : THREAD_CACHE_CLASSES;
+}
+
+static void *cacheAlloc(ArtAllocator *allocator, size_t size) {
+    (void)allocator;
+    int sizeClass = cacheClass(size);
+    if (sizeClass >= THREAD_CACHE_CLASSES) {
+        return malloc(size);
+    }
+
+    CachedBlock *block = threadCache.lists[sizeClass];
+    if (block) {
+        threadCache.lists[sizeClass] = block->next;
+        threadCache.lengths[sizeClass]--;
+        return block;
+    }
+    return malloc((sizeClass + 1) * THREAD_CACHE_GRANULE);
+}
+
+static void cacheFree(ArtAllocator *allocator, void *ptr, size_t size) {
+    (void)allocator;
+    int sizeClass = cacheClass(size);
+    if (ptr == NULL || sizeClass >= THREAD_CACHE_CLASSES || threadCache.lengths[sizeClass] >= THREAD_CACHE_DEPTH) {
+        free(ptr);
+        return;
+    }
+
+    CachedBlock *block = ptr;
+    block->next = threadCache.lists[sizeClass];
+    threadCache.lists[sizeClass] = block;
+    threadCache.lengths[sizeClass]++;
+}
+
+static void *cacheRealloc(ArtAllocator *allocator, void *ptr, size_t oldSize, size_t newSize) {
+    int sizeClass = cacheClass(newSize);
+    if (ptr == NULL) {
+        return cacheAlloc(allocator, newSize);
+    }
+    if (sizeClass < THREAD_CACHE_CLASSES && oldSize && cacheClass(oldSize) == sizeClass) {
+        return ptr;
+    }
+
+    // malloc can resize any block, cached sizes stay rounded to their class
+    return realloc(ptr, sizeClass < THREAD_CACHE_CLASSES ? (size_t)(sizeClass + 1) * THREAD_CACHE_GRANULE : newSize);
+}
+
+static ArtAllocator threadCacheAllocator = { cacheAlloc, cacheRealloc, cacheFree, NULL, false };
+
+// Shared by any number of trees and threads
+ArtAllocator *artThreadCacheAllocator(void) {
+    return &threadCacheAllocator;
+}
+
+// Returns the blocks cached by the calling thread to malloc, for threads
+// about to exit
+void artThreadCacheFlush(void) {
+    for (int i = 0; i < THREAD_CACHE_CLASSES; i++) {
+        while (threadCache.lists[i]) {
+            CachedBlock *next = threadCache.lists[i]->next;
+            free(threadCache.lists[i]);
+            threadCache.lists[i] = next;
+        }
+        threadCache.lengths[i] = 0;
+    }
+}
+
 Node *createRootNode() {
     Node4 *root = calloc(1, sizeof(Node4));
     if (!root) {
@@ -26,6 +265,12 @@ Node *createRootNode() {
 }
 
 ART *initializeAdaptiveRadixTree() {
+    return initializeAdaptiveRadixTreeWithAllocator(NULL);
+}
+
+// Nodes, leaves and copied values of the tree come from allocator, NULL
+// meaning malloc. The tree destroys the allocator when it is freed.
+ART *initializeAdaptiveRadixTreeWithAllocator(ArtAllocator *allocator) {
     ART *tree = malloc(sizeof(ART));
     if (!tree) {
         return NULL;
@@ -33,6 +278,25 @@ ART *initializeAdaptiveRadixTree() {
 
     tree->root = NULL;
     tree->size = 0;
+    tree->bucketCapacity = 0;
+    tree->flags = 0;
+    tree->valueLog = NULL;
+    tree->timers = NULL;
+    tree->hashIndex = NULL;
+    tree->filters = NULL;
+    tree->frontCache = NULL;
+    tree->jumpTable = NULL;
+    tree->promotion = NULL;
+    tree->versions = NULL;
+    tree->history = NULL;
+    tree->watches = NULL;
+    tree->appendPath = NULL;
+    tree->clock = NULL;
+    tree->valuePolicy = ART_VALUE_COPY;
+    tree->freeValue = NULL;
+    tree->bulkFree = NULL;
+    tree->bulkFreeData = NULL;
+    tree->allocator = allocator;
 
     return tree;
 }
@@ -41,12 +305,15 @@ ART *initializeAdaptiveRadixTree() {
 Node *findChildSSE(Node *genericNode, char byte){
     switch (genericNode->type){
     case NODE4:
+    case LEAF:
+        // Node4 keys are too short for a 16 byte compare
+        return findChildBinary(genericNode, byte);
     case NODE16:{
         Node16 *node = (Node16 *)genericNode;
         __m128i key = _mm_set1_epi8(byte);
         __m128i keys = _mm_loadu_si128((__m128i *)(node->keys));
         __m128i cmp = _mm_cmpeq_epi8(key, keys);
-        int mask = (1 << (node->count - 1));
+        int mask = (1 << node->node.count) - 1;
         int bitfield = _mm_movemask_epi8(cmp) & mask;
         if (bitfield){
             int index = __builtin_ctz(bitfield);
@@ -54,16 +321,17 @@ Node *findChildSSE(Node *genericNode, char byte){
         }
         break;
     }
-    case NODE48:
+    case NODE48:{
         Node48 *node = (Node48 *)genericNode;
         unsigned char childIndex = node->keys[(unsigned char)byte];
         if (childIndex != EMPTY_KEY) {
-            return node->children[childIndex];
+            return node->children[childIndex - 1];
         }
         break;
+    }
     case NODE256:{
         Node256 *node = (Node256 *)genericNode;
-        return node->children[byte];
+        return node->children[(unsigned char)byte];
         break;
     }
     default:
@@ -77,8 +345,8 @@ Node *findChildBinary(Node *genericNode, char byte) {
     switch (genericNode->type) {
         case NODE4: {
             Node4 *node = (Node4 *)genericNode;
-            for (int i = 0; i < 4; i++) {
-                if (node->keys[i] == byte) {
+            for (int i = 0; i < node->node.count; i++) {
+                if (node->keys[i] == (uint8_t)byte) {
                     return node->children[i];
                 }
             }
@@ -86,8 +354,8 @@ Node *findChildBinary(Node *genericNode, char byte) {
         }
         case NODE16: {
             Node16 *node = (Node16 *)genericNode;
-            for (int i = 0; i < 16; i++) {
-                if (node->keys[i] == byte) {
+            for (int i = 0; i < node->node.count; i++) {
+                if (node->keys[i] == (uint8_t)byte) {
                     return node->children[i];
                 }
             }
@@ -97,7 +365,7 @@ Node *findChildBinary(Node *genericNode, char byte) {
             Node48 *node = (Node48 *)genericNode;
             unsigned char childIndex = node->keys[(unsigned char)byte];
             if (childIndex != EMPTY_KEY) {
-                return node->children[childIndex];
+                return node->children[childIndex - 1];
             }
             break;
         }
@@ -123,6 +391,104 @@ Node *findChild(Node *node, char byte){
     #endif
 }
 
+// Same dispatch as findChild, but returns the slot holding the child so
+// that insertions can replace it in place.
+static Node **findChildRef(Node *genericNode, uint8_t byte) {
+    switch (genericNode->type) {
+        case NODE4: {
+            Node4 *node = (Node4 *)genericNode;
+            for (int i = 0; i < node->node.count; i++) {
+                if (node->keys[i] == byte) {
+                    return &node->children[i];
+                }
+            }
+            return NULL;
+        }
+        case NODE16: {
+            Node16 *node = (Node16 *)genericNode;
+#ifdef __SSE2__
+            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128((__m128i *)(node->keys)));
+            int bitfield = _mm_movemask_epi8(cmp) & ((1 << node->node.count) - 1);
+            return bitfield ? &node->children[__builtin_ctz(bitfield)] : NULL;
+#else
+            for (int i = 0; i < node->node.count; i++) {
+                if (node->keys[i] == byte) {
+                    return &node->children[i];
+                }
+            }
+            return NULL;
+#endif
+        }
+        case NODE48: {
+            Node48 *node = (Node48 *)genericNode;
+            unsigned char childIndex = node->keys[byte];
+            return childIndex != EMPTY_KEY ? &node->children[childIndex - 1] : NULL;
+        }
+        case NODE256: {
+            Node256 *node = (Node256 *)genericNode;
+            return node->children[byte] ? &node->children[byte] : NULL;
+        }
+        default:
+            return NULL;
+    }
+}
+
+// Keys are compared as if padded with zero bytes, so a key that ended
+// above the current depth still selects a child.
+static inline uint8_t keyByteAt(const uint8_t *key, size_t keyLength, size_t depth) {
+    return depth < keyLength ? key[depth] : 0;
+}
+
+static int compareKeys(const uint8_t *a, size_t aLength, const uint8_t *b, size_t bLength) {
+    int result = memcmp(a, b, MIN(aLength, bLength));
+    if (result != 0) {
+        return result;
+    }
+    return (aLength > bLength) - (aLength < bLength);
+}
+
+// Keys stored below node
+static inline size_t keysBelow(const Node *node) {
+    if (node->type == LEAF) {
+        return 1;
+    }
+    return node->type == BUCKET ? node->count : node->subtreeSize;
+}
+
+// Position in the full key of the first byte a leaf reached at depth stores
+static inline size_t leafBase(const ART *tree, size_t depth) {
+    return (tree->flags & ART_LEAF_SUFFIX) ? depth : 0;
+}
+
+static bool leafMatches(const ART *tree, const LeafNode *leaf, const uint8_t *key, size_t keyLength, size_t depth) {
+    size_t base = leafBase(tree, depth);
+    return base + leaf->keyLength == keyLength && memcmp(leaf->key, key + base, leaf->keyLength) == 0;
+}
+
+// Re-hangs leaf shift levels deeper. Suffix leaves drop the bytes the new
+// path now implies, which may move the leaf.
+static LeafNode *moveLeafDown(const ART *tree, LeafNode *leaf, size_t shift) {
+    if (!(tree->flags & ART_LEAF_SUFFIX) || shift == 0) {
+        return leaf;
+    }
+
+    leaf->keyLength -= shift;
+    memmove(leaf->key, leaf->key + shift, leaf->keyLength);
+
+    LeafNode *shrunk = treeRealloc(tree, leaf, sizeof(LeafNode) + leaf->keyLength + shift, sizeof(LeafNode) + leaf->keyLength);
+    return shrunk ? shrunk : leaf;
+}
+
+// Number of prefix bytes of node matching key from depth on. Prefixes are
+// stored in full (see insertRecursive), so no leaf check is needed after.
+static uint32_t prefixMismatch(const Node *node, const uint8_t *key, size_t keyLength, size_t depth) {
+    uint32_t i = 0;
+    while (i < node->prefixLen && node->prefix[i] == keyByteAt(key, keyLength, depth + i)) {
+        i++;
+    }
+    return i;
+}
+
 
 int getPrefixLength(Node *node) {
     if (node == NULL) {
@@ -146,77 +512,103 @@ int checkPrefix(Node *node, const char *key, int depth) {
     return count;
 }
 
-Node4 *makeNode4(){
-    Node4 *node4 = malloc(sizeof(Node4));
-    if(!node4){
-        return NULL;
+static size_t innerNodeSize(NodeType type) {
+    switch (type) {
+        case NODE4:
+            return sizeof(Node4);
+        case NODE16:
+            return sizeof(Node16);
+        case NODE48:
+            return sizeof(Node48);
+        default:
+            return sizeof(Node256);
     }
-
-    node4->node.type = NODE4;
-    node4->node.prefixLen = 0;
-    memset(node4->children, 0, sizeof(node4->children));
-    memset(node4->keys, EMPTY_KEY, 4);
-
-    return node4;
 }
 
-Node16 *makeNode16(){
-    Node16 *node16 = malloc(sizeof(Node16));
-    if(!node16){
+// Empty inner node of the given type
+static Node *makeInnerNode(const ART *tree, NodeType type) {
+    Node *node = treeAlloc(tree, innerNodeSize(type));
+    if (!node) {
         return NULL;
     }
 
-    node16->node.type = NODE16;
-    node16->node.prefixLen = 0;
-    memset(node16->node.prefix, 0, MAX_PREFIX_LENGTH);
-    memset(node16->children, 0, sizeof(node16->children));
-    memset(node16->keys, EMPTY_KEY, 16);
+    node->type = type;
+    node->count = 0;
+    node->prefixLen = 0;
+    node->subtreeSize = 0;
+    node->heat = 0;
+    node->promoted = false;
+    memset(node->prefix, 0, MAX_PREFIX_LENGTH);
+
+    switch (type) {
+        case NODE4:
+            memset(((Node4 *)node)->keys, EMPTY_KEY, 4);
+            memset(((Node4 *)node)->children, 0, sizeof(((Node4 *)node)->children));
+            break;
+        case NODE16:
+            memset(((Node16 *)node)->keys, EMPTY_KEY, 16);
+            memset(((Node16 *)node)->children, 0, sizeof(((Node16 *)node)->children));
+            break;
+        case NODE48:
+            memset(((Node48 *)node)->keys, EMPTY_KEY, 256);
+            memset(((Node48 *)node)->children, 0, sizeof(((Node48 *)node)->children));
+            break;
+        default:
+            memset(((Node256 *)node)->children, 0, sizeof(((Node256 *)node)->children));
+            break;
+    }
+    return node;
+}
 
-    return node16;
+Node4 *makeNode4(){
+    return (Node4 *)makeInnerNode(NULL, NODE4);
 }
 
-Node48 *makeNode48() {
-    Node48 *node48 = malloc(sizeof(Node48));
-    if (!node48) {
-        return NULL;
-    }
-    node48->node.type = NODE48;
-    node48->node.prefixLen = 0;
-    memset(node48->node.prefix, 0, MAX_PREFIX_LENGTH);
-    memset(node48->keys, EMPTY_KEY, 256);
-    memset(node48->children, 0, sizeof(node48->children));
+Node16 *makeNode16(){
+    return (Node16 *)makeInnerNode(NULL, NODE16);
+}
 
-    return node48;
+Node48 *makeNode48() {
+    return (Node48 *)makeInnerNode(NULL, NODE48);
 }
 
 Node256 *makeNode256(){
-    Node256 *node256 = malloc(sizeof(Node256));
-    if(!node256){
+    return (Node256 *)makeInnerNode(NULL, NODE256);
+}
+
+// Leaf holding a copy of key and no value yet
+static LeafNode *makeEmptyLeaf(const ART *tree, const uint8_t *key, size_t keyLength) {
+    LeafNode *leafNode = treeAlloc(tree, sizeof(LeafNode) + keyLength);
+    if (!leafNode) {
         return NULL;
     }
 
-    node256->node.type = NODE256;
-    node256->node.prefixLen = 0;
-    memset(node256->node.prefix, 0, MAX_PREFIX_LENGTH);
-    memset(node256->children, 0, sizeof(node256->children));
-
-    return node256;
+    leafNode->node.type = LEAF;
+    leafNode->node.count = 0;
+    leafNode->node.prefixLen = 0;
+    leafNode->node.subtreeSize = 0;
+    leafNode->node.heat = 0;
+    leafNode->node.promoted = false;
+    memset(leafNode->node.prefix, 0, MAX_PREFIX_LENGTH);
+    leafNode->keyLength = keyLength;
+    leafNode->valueLength = 0;
+    leafNode->flags = 0;
+    leafNode->expiresAt = 0;
+    leafNode->value = NULL;
+    memcpy(leafNode->key, key, keyLength);
+    return leafNode;
 }
 
 LeafNode *makeLeafNode(const char *key, const void *value, size_t keyLength, size_t valueLength){
-    
-    // Allocazione della memoria per LeafNode con spazio aggiuntivo per la chiave
-    LeafNode *leafNode = malloc(sizeof(LeafNode) + keyLength);
+    LeafNode *leafNode = makeEmptyLeaf(NULL, (const uint8_t *)key, keyLength);
     if(!leafNode){
         return NULL;
     }
 
-    leafNode->node.type = LEAF;
-    leafNode->node.prefixLen = 0;
-    memset(leafNode->node.prefix, 0, MAX_PREFIX_LENGTH);
-    
-    // Copia della chiave
-    memcpy(leafNode->key, key, keyLength);
+    // Without a value the caller stores one itself
+    if(!value){
+        return leafNode;
+    }
 
     // Allocazione della memoria per il valore
     leafNode->value = malloc(valueLength);
@@ -227,10 +619,66 @@ LeafNode *makeLeafNode(const char *key, const void *value, size_t keyLength, siz
 
     // Copia del valore
     memcpy(leafNode->value, value, valueLength);    
+    leafNode->valueLength = valueLength;
 
     return leafNode;
 }
 
+static inline size_t bucketSize(int capacity) {
+    return sizeof(LeafBucket) + capacity * sizeof(LeafNode *);
+}
+
+static LeafBucket *makeBucket(const ART *tree, int capacity){
+    if (capacity < MIN_BUCKET_CAPACITY || capacity > MAX_BUCKET_CAPACITY){
+        return NULL;
+    }
+
+    LeafBucket *bucket = treeAlloc(tree, bucketSize(capacity));
+    if(!bucket){
+        return NULL;
+    }
+
+    bucket->node.type = BUCKET;
+    bucket->node.count = 0;
+    bucket->node.prefixLen = 0;
+    bucket->node.subtreeSize = 0;
+    bucket->node.heat = 0;
+    bucket->node.promoted = false;
+    memset(bucket->node.prefix, 0, MAX_PREFIX_LENGTH);
+    bucket->capacity = capacity;
+    memset(bucket->fingerprints, 0, sizeof(bucket->fingerprints));
+
+    return bucket;
+}
+
+LeafBucket *makeLeafBucket(int capacity){
+    return makeBucket(NULL, capacity);
+}
+
+// Bytes taken by node, for the size hints of the tree's allocator
+static size_t nodeSize(const Node *node) {
+    switch (node->type) {
+        case LEAF:
+            return sizeof(LeafNode) + ((const LeafNode *)node)->keyLength;
+        case BUCKET:
+            return bucketSize(((const LeafBucket *)node)->capacity);
+        default:
+            return innerNodeSize(node->type);
+    }
+}
+
+static void jumpTableForget(JumpTable *table, const Node *node);
+
+static inline void freeNodeMemory(const ART *tree, Node *node) {
+    if (node->type == NODE256 && tree && tree->jumpTable) {
+        jumpTableForget(tree->jumpTable, node);
+    }
+    if (node->type == NODE256 && node->promoted && tree && tree->promotion) {
+        tree->promotion->promoted--;
+    }
+    treeFree(tree, node, nodeSize(node));
+}
+
 
 int findEmptyIndexForChildren(Node48 *node48){
     for (int i = 0; i < 48; i++){
@@ -242,13 +690,13 @@ int findEmptyIndexForChildren(Node48 *node48){
     return INVALID;
 }
 
-Node *growFromNode4toNode16(Node **nodePtr) {
+static Node *growNode4(const ART *tree, Node **nodePtr) {
     if (nodePtr == NULL || *nodePtr == NULL) {
         return NULL;
     }
 
     Node4 *oldNode = (Node4 *)*nodePtr;
-    Node16 *newNode = makeNode16();
+    Node16 *newNode = (Node16 *)makeInnerNode(tree, NODE16);
 
     if (newNode == NULL) {
         return NULL;
@@ -256,20 +704,26 @@ Node *growFromNode4toNode16(Node **nodePtr) {
 
     memcpy(newNode->node.prefix, oldNode->node.prefix, oldNode->node.prefixLen);
     newNode->node.prefixLen = oldNode->node.prefixLen;
+    newNode->node.count = oldNode->node.count;
+    newNode->node.subtreeSize = oldNode->node.subtreeSize;
 
     // Copy each child and key from oldNode to newNode
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < oldNode->node.count; i++) {
         newNode->keys[i] = oldNode->keys[i];
         newNode->children[i] = oldNode->children[i];
     }
 
-    free(oldNode);
+    treeFree(tree, oldNode, sizeof(Node4));
 
     *nodePtr = (Node *)newNode;
 
     return (Node *)newNode;
 }
 
+Node *growFromNode4toNode16(Node **nodePtr) {
+    return growNode4(NULL, nodePtr);
+}
+
 int findNextAvailableChild(Node **children) {
     for (int i = 0; i < 48; i++) {
         if (children[i] == NULL) {
@@ -289,13 +743,13 @@ int findUnusedKey(uint8_t *keys) {
 }
 
 
-Node *growFromNode16toNode48(Node **nodePtr) {
+static Node *growNode16(const ART *tree, Node **nodePtr) {
     if (nodePtr == NULL || *nodePtr == NULL) {
         return NULL;
     }
 
     Node16 *oldNode = (Node16 *)*nodePtr;
-    Node48 *newNode = makeNode48();
+    Node48 *newNode = (Node48 *)makeInnerNode(tree, NODE48);
 
     if (newNode == NULL) {
         return NULL;
@@ -303,37 +757,41 @@ Node *growFromNode16toNode48(Node **nodePtr) {
 
     memcpy(newNode->node.prefix, oldNode->node.prefix, oldNode->node.prefixLen);
     newNode->node.prefixLen = oldNode->node.prefixLen;
+    newNode->node.count = oldNode->node.count;
+    newNode->node.subtreeSize = oldNode->node.subtreeSize;
     memset(newNode->keys, EMPTY_KEY, sizeof(newNode->keys));
 
-    for (int i = 0; i < 16; i++){
-        if (oldNode->children[i] != NULL){
-            uint8_t keyChar = oldNode->keys[i]; // Questo dovrebbe essere un valore intero da 0 a 255
-            int childIndex = findNextAvailableChild(newNode->children);
+    for (int i = 0; i < oldNode->node.count; i++){
+        uint8_t keyChar = oldNode->keys[i]; // Questo dovrebbe essere un valore intero da 0 a 255
+        int childIndex = findNextAvailableChild(newNode->children);
 
-            if (childIndex == INVALID){
-                freeNode((Node *)newNode);
-                return NULL;
-            }
-
-            printf("Before assignment, newNode->keys[%d] = %d\n", (int)keyChar, newNode->keys[(int)keyChar]);
-            newNode->keys[(int)keyChar] = childIndex;
-            printf("After assignment, newNode->keys[%d] = %d\n", (int)keyChar, newNode->keys[(int)keyChar]);
-            newNode->children[childIndex] = oldNode->children[i];
+        if (childIndex == INVALID){
+            treeFree(tree, newNode, sizeof(Node48));
+            return NULL;
         }
+
+        // Slots are stored off by one so that EMPTY_KEY marks a free byte
+        newNode->keys[(int)keyChar] = childIndex + 1;
+        newNode->children[childIndex] = oldNode->children[i];
     }
 
-    freeNode((Node *) oldNode);
+    // The children now belong to newNode, only the old shell is released
+    treeFree(tree, oldNode, sizeof(Node16));
     *nodePtr = (Node *)newNode;
     return (Node *)newNode;
 }
 
-Node *growFromNode48toNode256(Node **nodePtr){
+Node *growFromNode16toNode48(Node **nodePtr) {
+    return growNode16(NULL, nodePtr);
+}
+
+static Node *growNode48(const ART *tree, Node **nodePtr){
     if (nodePtr == NULL || *nodePtr == NULL) {
         return NULL;
     }
 
     Node48 *oldNode = (Node48 *)*nodePtr;
-    Node256 *newNode = makeNode256();
+    Node256 *newNode = (Node256 *)makeInnerNode(tree, NODE256);
 
     if (newNode == NULL) {
         return NULL;
@@ -341,35 +799,42 @@ Node *growFromNode48toNode256(Node **nodePtr){
 
     memcpy(newNode->node.prefix, oldNode->node.prefix, oldNode->node.prefixLen);
     newNode->node.prefixLen = oldNode->node.prefixLen;
+    newNode->node.count = oldNode->node.count;
+    newNode->node.subtreeSize = oldNode->node.subtreeSize;
 
     for (int i = 0; i < 256; i++) {
         unsigned char childIndex = oldNode->keys[i];
         if (childIndex != EMPTY_KEY) {
-            newNode->children[i] = oldNode->children[childIndex];
+            newNode->children[i] = oldNode->children[childIndex - 1];
         }
     }
 
-    free(oldNode);
+    treeFree(tree, oldNode, sizeof(Node48));
 
+    *nodePtr = (Node *)newNode;
     return (Node *)newNode;
 }
 
-Node *grow(Node **node){
+Node *growFromNode48toNode256(Node **nodePtr){
+    return growNode48(NULL, nodePtr);
+}
+
+static Node *growNode(const ART *tree, Node **node){
     if(node == NULL || *node == NULL){
         return NULL;
     }
 
     switch((*node)->type){
         case NODE4: {
-            return growFromNode4toNode16(node);
+            return growNode4(tree, node);
         }
 
         case NODE16: {
-            return growFromNode16toNode48(node);
+            return growNode16(tree, node);
         }
             
         case NODE48: {
-            return growFromNode48toNode256(node);
+            return growNode48(tree, node);
         }
 
         case NODE256: {
@@ -377,8 +842,9 @@ Node *grow(Node **node){
             return NULL;
         }
 
-        case LEAF:{
-            // A LeafNode cannot grow in this context
+        case LEAF:
+        case BUCKET:{
+            // A LeafNode cannot grow in this context, buckets are split instead
             return NULL;
         }
 
@@ -389,18 +855,17 @@ Node *grow(Node **node){
     }
 }
 
+Node *grow(Node **node){
+    return growNode(NULL, node);
+}
+
 Node *addChildToNode4(Node *parentNode, const void *keyPart, Node *childNode){
     if (parentNode == NULL || childNode == NULL){
         return NULL;
     }
 
     Node4 *node = (Node4 *)parentNode;
-    int count = 0;
-    for (int i = 0; i < 4; i++){
-        if (node->keys[i] != EMPTY_KEY){
-            count++;
-        }
-    }
+    int count = node->node.count;
 
     if (count >= 4){
         parentNode = grow(&parentNode);
@@ -422,6 +887,7 @@ Node *addChildToNode4(Node *parentNode, const void *keyPart, Node *childNode){
     // Insert the new key and child
     node->keys[position] = *(const uint8_t *)keyPart;
     node->children[position] = childNode;
+    node->node.count++;
 
     return parentNode;
 }
@@ -432,14 +898,7 @@ Node *addChildToNode16(Node *parentNode, const void *keyPart, Node *childNode){
     }
 
     Node16 *node = (Node16 *)parentNode;
-
-    // Calculate the effective number of children in node
-    int count = 0;
-    for (int i = 0; i < 16; i++){
-        if (node->keys[i] != EMPTY_KEY){
-            count++;
-        }
-    }
+    int count = node->node.count;
 
     if (count >= 16){
         parentNode = grow(&parentNode);
@@ -461,6 +920,7 @@ Node *addChildToNode16(Node *parentNode, const void *keyPart, Node *childNode){
     // Insert the new key and child
     node->keys[position] = *(const uint8_t *)keyPart;
     node->children[position] = childNode;
+    node->node.count++;
 
     return parentNode;
 }
@@ -475,7 +935,7 @@ Node *addChildToNode48(Node *parentNode, const void *keyPart, Node *childNode){
     // Check whether we already have a child with this key
     unsigned char index = *(const unsigned char *)keyPart;
     if (node->keys[index] != EMPTY_KEY){
-        node->children[node->keys[index]] = childNode;
+        node->children[node->keys[index] - 1] = childNode;
         return parentNode;
     }
 
@@ -487,8 +947,9 @@ Node *addChildToNode48(Node *parentNode, const void *keyPart, Node *childNode){
     }
 
     // Insert the child into the node
-    node->keys[index] = position;
+    node->keys[index] = position + 1;
     node->children[position] = childNode;
+    node->node.count++;
 
     return parentNode;
 }
@@ -499,6 +960,9 @@ Node *addChildToNode256(Node *parentNode, const void *keyPart, Node *childNode){
     }
 
     Node256 *node = (Node256 *)parentNode;
+    if (node->children[*(const unsigned char *)keyPart] == NULL){
+        node->node.count++;
+    }
     node->children[*(const unsigned char *)keyPart] = childNode;
 
     return parentNode;
@@ -522,11 +986,19 @@ Node *addChild(Node *parentNode, const void *keyPart, Node *childNode){
         case NODE256:{
             return addChildToNode256(parentNode, keyPart, childNode);
         }
-        case LEAF:{
-            // A LeafNode cannot have children
+        case LEAF:
+        case BUCKET:{
+            // A LeafNode cannot have children, buckets hold leaves only
             return NULL;
         }
     }
+    return NULL;
+}
+
+// Grows the inner node in *ref if it is full, so that the next child
+// added always fits. False when out of memory.
+static bool makeChildRoom(const ART *tree, Node **ref) {
+    return !isNodeFull(*ref) || growNode(tree, ref) != NULL;
 }
 
 Node4 *transformLeafToNode4(Node *leafNode, const char *existingKey, size_t existingKeyLength, const char *newKey, void *newValue, size_t newKeyLength, size_t newValueLength, int depth){
@@ -552,10 +1024,9 @@ Node4 *transformLeafToNode4(Node *leafNode, const char *existingKey, size_t exis
     }
     newNode->node.prefixLen = prefixLen;
 
-    // Add existing leaf node and the new value to Node4
-    // Calculate the remaining key length after the prefix for the new leaf node
-    size_t remainingNewKeyLength = newKeyLength - (depth + prefixLen);
-    LeafNode *newLeafNode = makeLeafNode(newKey + depth + prefixLen, newValue, remainingNewKeyLength, newValueLength);
+    // Add existing leaf node and the new value to Node4. Like insert(), the
+    // new leaf keeps the whole key so that both leaves are comparable
+    LeafNode *newLeafNode = makeLeafNode(newKey, newValue, newKeyLength, newValueLength);
     if (newLeafNode == NULL){
         freeNode((Node *)newNode);
         return NULL;
@@ -568,6 +1039,7 @@ Node4 *transformLeafToNode4(Node *leafNode, const char *existingKey, size_t exis
     // Here, you would need to update addChild to handle a null character if it is part of the key
     addChild((Node *)newNode, &existingKeyChar, leafNode);
     addChild((Node *)newNode, &newKeyChar, (Node *)newLeafNode);
+    newNode->node.subtreeSize = 2;
 
     return newNode;
 }
@@ -578,42 +1050,16 @@ bool isNodeFull(Node *node) {
     }
 
     switch (node->type) {
-        case NODE4: {
-            Node4 *node4 = (Node4 *)node;
-            for (int i = 0; i < 4; i++) {
-                if (node4->keys[i] == EMPTY_KEY) {
-                    return false;
-                }
-            }
-            return true;
-        }
-        case NODE16: {
-            Node16 *node16 = (Node16 *)node;
-            for (int i = 0; i < 16; i++) {
-                if (node16->keys[i] == EMPTY_KEY) {
-                    return false;
-                }
-            }
-            return true;
-        }
-        case NODE48: {
-            Node48 *node48 = (Node48 *)node;
-            for (int i = 0; i < 256; i++) {
-                if (node48->keys[i] == EMPTY_KEY) {
-                    return false;
-                }
-            }
-            return true;
-        }
-        case NODE256: {
-            Node256 *node256 = (Node256 *)node;
-            for (int i = 0; i < 256; i++) {
-                if (node256->children[i] == NULL) {
-                    return false;
-                }
-            }
-            return true;
-        }
+        case NODE4:
+            return node->count >= 4;
+        case NODE16:
+            return node->count >= 16;
+        case NODE48:
+            return node->count >= 48;
+        case NODE256:
+            return node->count >= 256;
+        case BUCKET:
+            return node->count >= ((LeafBucket *)node)->capacity;
         default:
             return false;
     }
@@ -666,82 +1112,5250 @@ int compare_strings(const void *a, const void *b, size_t size){
     return 0;
 }
 
-Node *insert(Node **root, const void *key, size_t keyLength, void *value, size_t valueLength, int depth, compare_func cmp){
-    if(*root == NULL){
-        *root = (Node *)makeLeafNode(key, value, keyLength, valueLength);
-        return *root;
-    }
+static int insertRecursive(ART *tree, Node **ref, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth);
+static int collectChildren(Node *node, uint8_t *bytes, Node **children);
 
-    Node *node = *root;
-    Node **parentPointer = root;
+/*** HASH INDEX ***/
 
-    while (node != NULL){
-        if (node->type == LEAF){
-            LeafNode *leafNode = (LeafNode *)node;
-            if (cmp(leafNode->key, key, keyLength) == 0){
-                // La chiave esiste già, sostituisci il valore o restituisci il nodo
-                return node;
-            }
-            else{
-                // Gestione del prefisso comune
-                int commonPrefixLength = 0;
-                while (cmp(leafNode->key + commonPrefixLength, key + depth + commonPrefixLength, 1) == 0){
-                    commonPrefixLength++;
-                    if (commonPrefixLength >= MAX_PREFIX_LENGTH){
-                        break;
-                    }
-                }
+static uint64_t hashKey(const uint8_t *key, size_t keyLength) {
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ keyLength;
+    size_t i = 0;
+    for (; i + 8 <= keyLength; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+    }
+    if (i < keyLength) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, keyLength - i);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+    }
+    hash *= 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 29);
+}
 
-                Node4 *newNode4 = makeNode4();
-                if (newNode4 == NULL){
-                    return NULL;
+static HashIndex *makeHashIndex(size_t keys) {
+    size_t slots = HASH_INDEX_MIN_SLOTS;
+    while (slots * 3 < keys * 4) {
+        slots *= 2;
+    }
+
+    HashIndex *index = malloc(sizeof(HashIndex));
+    if (!index) {
+        return NULL;
+    }
+    index->slots = calloc(slots, sizeof(HashIndexSlot));
+    if (!index->slots) {
+        free(index);
+        return NULL;
+    }
+    index->mask = slots - 1;
+    index->count = 0;
+    return index;
+}
+
+static void freeHashIndex(HashIndex *index) {
+    if (index != NULL) {
+        free(index->slots);
+        free(index);
+    }
+}
+
+// Stores an entry for a key the table does not hold yet
+static void hashIndexPlace(HashIndex *index, uint64_t hash, LeafNode *leaf) {
+    size_t slot = hash & index->mask;
+    while (index->slots[slot].leaf != NULL) {
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot].hash = hash;
+    index->slots[slot].leaf = leaf;
+    index->count++;
+}
+
+// Doubles the table once it is three quarters full
+static bool hashIndexAdd(HashIndex *index, LeafNode *leaf) {
+    if ((index->count + 1) * 4 > (index->mask + 1) * 3) {
+        size_t slots = (index->mask + 1) * 2;
+        HashIndexSlot *old = index->slots;
+        HashIndexSlot *grown = calloc(slots, sizeof(HashIndexSlot));
+        if (!grown) {
+            return false;
+        }
+
+        size_t oldSlots = index->mask + 1;
+        index->slots = grown;
+        index->mask = slots - 1;
+        index->count = 0;
+        for (size_t i = 0; i < oldSlots; i++) {
+            if (old[i].leaf != NULL) {
+                hashIndexPlace(index, old[i].hash, old[i].leaf);
+            }
+        }
+        free(old);
+    }
+
+    hashIndexPlace(index, hashKey(leaf->key, leaf->keyLength), leaf);
+    return true;
+}
+
+static LeafNode *hashIndexFind(const HashIndex *index, const uint8_t *key, size_t keyLength, uint64_t hash) {
+    for (size_t slot = hash & index->mask; index->slots[slot].leaf != NULL; slot = (slot + 1) & index->mask) {
+        LeafNode *leaf = index->slots[slot].leaf;
+        if (index->slots[slot].hash == hash && leaf->keyLength == keyLength && memcmp(leaf->key, key, keyLength) == 0) {
+            return leaf;
+        }
+    }
+    return NULL;
+}
+
+static void hashIndexRemove(HashIndex *index, const LeafNode *leaf) {
+    size_t gap = hashKey(leaf->key, leaf->keyLength) & index->mask;
+    while (index->slots[gap].leaf != leaf) {
+        if (index->slots[gap].leaf == NULL) {
+            return;
+        }
+        gap = (gap + 1) & index->mask;
+    }
+
+    // Pull back every later entry of the run that may sit in the gap, so
+    // that no probe sequence is cut short
+    for (size_t next = (gap + 1) & index->mask; index->slots[next].leaf != NULL; next = (next + 1) & index->mask) {
+        size_t home = index->slots[next].hash & index->mask;
+        if (((next - home) & index->mask) >= ((next - gap) & index->mask)) {
+            index->slots[gap] = index->slots[next];
+            gap = next;
+        }
+    }
+    index->slots[gap].leaf = NULL;
+    index->count--;
+}
+
+// Adds every leaf below node, in no particular order
+static bool hashIndexAddSubtree(HashIndex *index, Node *node) {
+    if (node == NULL) {
+        return true;
+    }
+
+    switch (node->type) {
+        case LEAF:
+            return hashIndexAdd(index, (LeafNode *)node);
+        case BUCKET: {
+            LeafBucket *bucket = (LeafBucket *)node;
+            for (int i = 0; i < bucket->node.count; i++) {
+                if (!hashIndexAdd(index, bucket->leaves[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case NODE4:
+            for (int i = 0; i < node->count; i++) {
+                if (!hashIndexAddSubtree(index, ((Node4 *)node)->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        case NODE16:
+            for (int i = 0; i < node->count; i++) {
+                if (!hashIndexAddSubtree(index, ((Node16 *)node)->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        case NODE48:
+            for (int i = 0; i < 48; i++) {
+                if (!hashIndexAddSubtree(index, ((Node48 *)node)->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        case NODE256:
+            for (int i = 0; i < 256; i++) {
+                if (!hashIndexAddSubtree(index, ((Node256 *)node)->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return true;
+    }
+}
+
+/*** FRONT CACHE ***/
+
+// Slots come in pairs, so there are at least two
+static FrontCache *makeFrontCache(size_t slots) {
+    size_t count = 2;
+    while (count < slots) {
+        count *= 2;
+    }
+
+    FrontCache *cache = malloc(sizeof(FrontCache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->slots = calloc(count, sizeof(FrontCacheSlot));
+    if (!cache->slots) {
+        free(cache);
+        return NULL;
+    }
+    cache->mask = count - 1;
+    return cache;
+}
+
+static void freeFrontCache(FrontCache *cache) {
+    if (cache != NULL) {
+        free(cache->slots);
+        free(cache);
+    }
+}
+
+// The low bits of the hash pick a pair of slots, the high ones tell keys
+// apart
+static LeafNode *frontCacheFind(const FrontCache *cache, const uint8_t *key, size_t keyLength, uint64_t hash) {
+    FrontCacheSlot *pair = &cache->slots[hash & cache->mask & ~(size_t)1];
+    for (int way = 0; way < 2; way++) {
+        FrontCacheSlot *slot = &pair[way];
+        LeafNode *leaf = slot->leaf;
+        if (leaf != NULL && slot->hash == (uint32_t)(hash >> 32) && leaf->keyLength == keyLength && memcmp(leaf->key, key, keyLength) == 0) {
+            slot->hits += slot->hits < FRONT_CACHE_MAX_HITS;
+            return leaf;
+        }
+    }
+    return NULL;
+}
+
+// Offers a leaf found by a descent the colder slot of its pair. A key that
+// keeps being asked for has piled up hits, and each other key landing on
+// its slot only takes one away, so the rare keys of a skewed load do not
+// push out the hot ones.
+static void frontCacheOffer(FrontCache *cache, uint64_t hash, LeafNode *leaf) {
+    FrontCacheSlot *pair = &cache->slots[hash & cache->mask & ~(size_t)1];
+    FrontCacheSlot *slot = pair[1].leaf == NULL || pair[1].hits < pair[0].hits ? &pair[1] : &pair[0];
+    if (slot->leaf != NULL && slot->hits > 0) {
+        slot->hits--;
+        return;
+    }
+    slot->leaf = leaf;
+    slot->hash = (uint32_t)(hash >> 32);
+    slot->hits = 0;
+}
+
+static void frontCacheRemove(FrontCache *cache, const LeafNode *leaf) {
+    FrontCacheSlot *pair = &cache->slots[hashKey(leaf->key, leaf->keyLength) & cache->mask & ~(size_t)1];
+    for (int way = 0; way < 2; way++) {
+        if (pair[way].leaf == leaf) {
+            pair[way].leaf = NULL;
+            pair[way].hits = 0;
+        }
+    }
+}
+
+/*** JUMP TABLE ***/
+
+static inline bool isJumpParent(const Node *node) {
+    return node != NULL && node->type == NODE256 && node->prefixLen == 0;
+}
+
+static JumpTable *makeJumpTable(uint32_t depth) {
+    JumpTable *table = calloc(1, sizeof(JumpTable));
+    if (!table) {
+        return NULL;
+    }
+    table->slots = calloc((size_t)1 << (8 * depth), sizeof(Node **));
+    if (!table->slots) {
+        free(table);
+        return NULL;
+    }
+    table->depth = depth;
+    table->stale = true;
+    return table;
+}
+
+static void freeJumpTable(JumpTable *table) {
+    if (table != NULL) {
+        free(table->slots);
+        free(table);
+    }
+}
+
+// Points the slots into the Node256s now at the top of the tree. Below
+// any other kind of node they stay empty.
+static void jumpTableBuild(JumpTable *table, Node *root) {
+    memset(table->slots, 0, ((size_t)1 << (8 * table->depth)) * sizeof(Node **));
+    memset(table->parents, 0, sizeof(table->parents));
+    table->stale = false;
+    table->misses = 0;
+    if (!isJumpParent(root)) {
+        return;
+    }
+
+    Node256 *top = (Node256 *)root;
+    table->parents[0] = root;
+    for (int first = 0; first < 256; first++) {
+        if (table->depth == 1) {
+            table->slots[first] = &top->children[first];
+        } else if (isJumpParent(top->children[first])) {
+            Node256 *child = (Node256 *)top->children[first];
+            table->parents[1 + first] = (Node *)child;
+            for (int second = 0; second < 256; second++) {
+                table->slots[first << 8 | second] = &child->children[second];
+            }
+        }
+    }
+}
+
+// Rebuilds the table once a parent was freed, or once enough inserts
+// missed it that nodes at the top have likely grown into Node256s
+static void jumpTableRefresh(ART *tree) {
+    JumpTable *table = tree->jumpTable;
+    if (table && (table->stale || table->misses > ((size_t)1 << (8 * table->depth)) / 4)) {
+        jumpTableBuild(table, tree->root);
+    }
+}
+
+// Slot to start key at, NULL when the walk has to start at the root
+static inline Node **jumpTableSlot(const JumpTable *table, const uint8_t *key, size_t keyLength) {
+    if (table == NULL || table->stale || keyLength < table->depth) {
+        return NULL;
+    }
+    return table->slots[table->depth == 1 ? key[0] : (size_t)key[0] << 8 | key[1]];
+}
+
+// Called for every Node256 freed, slots into a parent must go with it
+static void jumpTableForget(JumpTable *table, const Node *node) {
+    for (int i = 0; i < 257 && !table->stale; i++) {
+        if (table->parents[i] == node) {
+            table->stale = true;
+        }
+    }
+}
+
+// Inserts as insertRecursive() does from the root, but starts at key's
+// slot when the jump table has one
+static int insertJumping(ART *tree, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength) {
+    JumpTable *table = tree->jumpTable;
+    if (table == NULL) {
+        return insertRecursive(tree, &tree->root, key, keyLength, value, valueLength, 0);
+    }
+
+    jumpTableRefresh(tree);
+    Node **slot = jumpTableSlot(table, key, keyLength);
+    // A new child has to be counted by its parent, so empty slots are
+    // filled from the root
+    if (slot == NULL || *slot == NULL) {
+        table->misses++;
+        return insertRecursive(tree, &tree->root, key, keyLength, value, valueLength, 0);
+    }
+
+    int result = insertRecursive(tree, slot, key, keyLength, value, valueLength, table->depth);
+    if (result == 1) {
+        table->parents[0]->subtreeSize++;
+        if (table->depth == 2) {
+            table->parents[1 + key[0]]->subtreeSize++;
+        }
+    }
+    return result;
+}
+
+/*** SUBTREE FILTERS ***/
+
+static size_t filterBlocksFor(size_t keys) {
+    // Twice the room the keys need, so that a rebuilt filter takes as many
+    // inserts again before the next rebuild
+    size_t blocks = 1;
+    while (blocks * 512 < keys * 2 * SUBTREE_FILTER_BITS_PER_KEY) {
+        blocks *= 2;
+    }
+    return blocks;
+}
+
+static SubtreeFilter *filterFor(const SubtreeFilters *filters, const uint8_t *key, size_t keyLength) {
+    return (SubtreeFilter *)&filters->filters[keyByteAt(key, keyLength, filters->depth)];
+}
+
+// Each key sets SUBTREE_FILTER_HASHES bits of one 512 bit block, taken
+// from the top of a remix of its hash; the block comes from the low bits
+static uint64_t *filterBlock(const SubtreeFilter *filter, uint64_t hash) {
+    return filter->blocks + 8 * (((hash & 0xFFFFFFFF) * filter->blockCount) >> 32);
+}
+
+static void filterSet(SubtreeFilter *filter, uint64_t hash) {
+    uint64_t *block = filterBlock(filter, hash);
+    uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < SUBTREE_FILTER_HASHES; i++, bits <<= 9) {
+        uint32_t bit = bits >> 55;
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+// False only for keys that are certainly not in the tree
+static bool filterMayContain(const SubtreeFilters *filters, const uint8_t *key, size_t keyLength, uint64_t hash) {
+    const SubtreeFilter *filter = filterFor(filters, key, keyLength);
+    if (filter->blocks == NULL) {
+        return false;
+    }
+
+    const uint64_t *block = filterBlock(filter, hash);
+    uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < SUBTREE_FILTER_HASHES; i++, bits <<= 9) {
+        uint32_t bit = bits >> 55;
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Filters only grow in rebuilds, the first key of an empty one brings a
+// single block
+static bool filterAdd(SubtreeFilters *filters, const LeafNode *leaf) {
+    SubtreeFilter *filter = filterFor(filters, leaf->key, leaf->keyLength);
+    if (filter->blocks == NULL) {
+        filter->blocks = calloc(8, sizeof(uint64_t));
+        if (!filter->blocks) {
+            return false;
+        }
+        filter->blockCount = 1;
+    }
+    filterSet(filter, hashKey(leaf->key, leaf->keyLength));
+    filter->keys++;
+    return true;
+}
+
+// The key's bits stay set, possibly shared with other keys, until the
+// next rebuild
+static void filterRemove(SubtreeFilters *filters, const LeafNode *leaf) {
+    SubtreeFilter *filter = filterFor(filters, leaf->key, leaf->keyLength);
+    filter->keys--;
+    filter->stale++;
+}
+
+// Counts (when count is set) or adds the keys below node that belong to
+// the filter for byte, or to any filter when byte is negative. Subtrees
+// whose path rules the byte out are skipped.
+static void filterWalk(SubtreeFilters *filters, Node *node, size_t depth, int byte, bool count) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->type == LEAF || node->type == BUCKET) {
+        LeafNode *single = (LeafNode *)node;
+        LeafNode **leaves = node->type == LEAF ? &single : ((LeafBucket *)node)->leaves;
+        int leafCount = node->type == LEAF ? 1 : node->count;
+        for (int i = 0; i < leafCount; i++) {
+            uint8_t leafByte = keyByteAt(leaves[i]->key, leaves[i]->keyLength, filters->depth);
+            if (byte >= 0 && leafByte != byte) {
+                continue;
+            }
+            if (count) {
+                filters->filters[leafByte].keys++;
+            } else {
+                filterSet(&filters->filters[leafByte], hashKey(leaves[i]->key, leaves[i]->keyLength));
+            }
+        }
+        return;
+    }
+
+    if (byte >= 0 && filters->depth >= depth && filters->depth < depth + node->prefixLen &&
+        node->prefix[filters->depth - depth] != byte) {
+        return;
+    }
+    depth += node->prefixLen;
+
+    uint8_t bytes[256];
+    Node *children[256];
+    int childCount = collectChildren(node, bytes, children);
+    for (int i = 0; i < childCount; i++) {
+        if (byte < 0 || depth != filters->depth || bytes[i] == byte) {
+            filterWalk(filters, children[i], depth + 1, byte, count);
+        }
+    }
+}
+
+// Sizes the filter for its live keys again and drops the bits of deleted
+// ones. On failure the old filter, which still covers every key, is kept.
+static void filterRebuild(const ART *tree, int byte) {
+    SubtreeFilter *filter = &tree->filters->filters[byte];
+    uint64_t *old = filter->blocks;
+
+    if (filter->keys == 0) {
+        filter->blocks = NULL;
+        filter->blockCount = 0;
+    } else {
+        size_t blocks = filterBlocksFor(filter->keys);
+        filter->blocks = calloc(blocks * 8, sizeof(uint64_t));
+        if (!filter->blocks) {
+            filter->blocks = old;
+            return;
+        }
+        filter->blockCount = blocks;
+        filterWalk(tree->filters, tree->root, 0, byte, false);
+    }
+    filter->stale = 0;
+    free(old);
+}
+
+// Rebuilds the filter for byte, or every filter when byte is negative,
+// once it is overfull or mostly made of deleted keys
+static void refreshFilters(const ART *tree, int byte) {
+    if (tree->filters == NULL) {
+        return;
+    }
+
+    for (int b = byte < 0 ? 0 : byte; b < (byte < 0 ? 256 : byte + 1); b++) {
+        SubtreeFilter *filter = &tree->filters->filters[b];
+        size_t capacity = (size_t)filter->blockCount * 512 / SUBTREE_FILTER_BITS_PER_KEY;
+        if (filter->keys + filter->stale > capacity || filter->stale > filter->keys + SUBTREE_FILTER_MIN_STALE ||
+            (filter->keys == 0 && filter->blocks != NULL)) {
+            filterRebuild(tree, b);
+        }
+    }
+}
+
+static void freeSubtreeFilters(SubtreeFilters *filters) {
+    if (filters != NULL) {
+        for (int i = 0; i < 256; i++) {
+            free(filters->filters[i].blocks);
+        }
+        free(filters);
+    }
+}
+
+/*** LEAF TRACKING ***/
+
+static KeyVersions *makeKeyVersions(size_t stripes) {
+    size_t count = KEY_VERSIONS_MIN_STRIPES;
+    while (count < stripes) {
+        count *= 2;
+    }
+
+    KeyVersions *versions = malloc(sizeof(KeyVersions));
+    if (!versions) {
+        return NULL;
+    }
+    versions->versions = calloc(count, sizeof(uint64_t));
+    if (!versions->versions) {
+        free(versions);
+        return NULL;
+    }
+    versions->mask = count - 1;
+    return versions;
+}
+
+static void freeKeyVersions(KeyVersions *versions) {
+    if (versions != NULL) {
+        free(versions->versions);
+        free(versions);
+    }
+}
+
+static inline size_t keyStripe(const KeyVersions *versions, const uint8_t *key, size_t keyLength) {
+    return hashKey(key, keyLength) & versions->mask;
+}
+
+// Called for every value stored under key and every leaf taken out
+static inline void bumpKeyVersion(const ART *tree, const uint8_t *key, size_t keyLength) {
+    if (tree->versions) {
+        tree->versions->versions[keyStripe(tree->versions, key, keyLength)]++;
+    }
+}
+
+// Enters a new leaf into the hash index and filters the tree keeps
+static bool trackLeaf(const ART *tree, LeafNode *leaf) {
+    if (tree->filters && !filterAdd(tree->filters, leaf)) {
+        return false;
+    }
+    if (tree->hashIndex && !hashIndexAdd(tree->hashIndex, leaf)) {
+        if (tree->filters) {
+            filterRemove(tree->filters, leaf);
+        }
+        return false;
+    }
+    return true;
+}
+
+static void untrackLeaf(const ART *tree, const LeafNode *leaf) {
+    bumpKeyVersion(tree, leaf->key, leaf->keyLength);
+    if (tree->filters) {
+        filterRemove(tree->filters, leaf);
+    }
+    if (tree->hashIndex) {
+        hashIndexRemove(tree->hashIndex, leaf);
+    }
+    if (tree->frontCache) {
+        frontCacheRemove(tree->frontCache, leaf);
+    }
+}
+
+/*** VERSION HISTORY ***/
+
+static VersionHistory *makeVersionHistory(void) {
+    VersionHistory *history = calloc(1, sizeof(VersionHistory));
+    if (!history) {
+        return NULL;
+    }
+    history->buckets = calloc(VERSION_HISTORY_MIN_BUCKETS, sizeof(VersionChain *));
+    if (!history->buckets) {
+        free(history);
+        return NULL;
+    }
+    history->mask = VERSION_HISTORY_MIN_BUCKETS - 1;
+    history->oldest = UINT64_MAX;
+    return history;
+}
+
+// Every present version but the newest owns its value, the newest shares
+// the leaf's
+static void freeKeyVersion(const ART *tree, KeyVersion *version, bool newest) {
+    if (version->present && !newest) {
+        if (tree->valuePolicy == ART_VALUE_COPY) {
+            treeFree(tree, version->value, version->valueLength);
+        } else if (tree->valuePolicy == ART_VALUE_OWN && version->value != NULL) {
+            (tree->freeValue ? tree->freeValue : free)(version->value);
+        }
+    }
+    free(version);
+}
+
+static size_t freeVersionChain(const ART *tree, VersionChain *chain) {
+    size_t freed = 0;
+    for (KeyVersion *version = chain->newest, *older; version != NULL; version = older) {
+        older = version->older;
+        freeKeyVersion(tree, version, version == chain->newest);
+        freed++;
+    }
+    free(chain);
+    return freed;
+}
+
+static void freeVersionHistory(const ART *tree, VersionHistory *history) {
+    if (history != NULL) {
+        for (size_t i = 0; i <= history->mask; i++) {
+            for (VersionChain *chain = history->buckets[i], *next; chain != NULL; chain = next) {
+                next = chain->next;
+                freeVersionChain(tree, chain);
+            }
+        }
+        free(history->buckets);
+        free(history->readers);
+        free(history);
+    }
+}
+
+// Link to the chain of key, or to where it would go
+static VersionChain **historySlot(const VersionHistory *history, const uint8_t *key, size_t keyLength) {
+    VersionChain **slot = &history->buckets[hashKey(key, keyLength) & history->mask];
+    while (*slot != NULL && !((*slot)->keyLength == keyLength && memcmp((*slot)->key, key, keyLength) == 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Doubles the buckets, which stay as they are when memory runs out
+static void historyGrow(VersionHistory *history) {
+    size_t count = 2 * (history->mask + 1);
+    VersionChain **buckets = calloc(count, sizeof(VersionChain *));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i <= history->mask; i++) {
+        for (VersionChain *chain = history->buckets[i], *next; chain != NULL; chain = next) {
+            next = chain->next;
+            VersionChain **bucket = &buckets[hashKey(chain->key, chain->keyLength) & (count - 1)];
+            chain->next = *bucket;
+            *bucket = chain;
+        }
+    }
+    free(history->buckets);
+    history->buckets = buckets;
+    history->mask = count - 1;
+}
+
+// Drops the versions no open snapshot reads, those older than the newest
+// one at or before the oldest snapshot. A chain left with one version
+// that every snapshot sees goes too, as the tree shows the same. Returns
+// the versions freed.
+static size_t trimVersionChain(const ART *tree, VersionHistory *history, VersionChain **slot) {
+    VersionChain *chain = *slot;
+    KeyVersion *keep = chain->newest;
+    while (keep->stamp > history->oldest && keep->older != NULL) {
+        keep = keep->older;
+    }
+
+    size_t freed = 0;
+    for (KeyVersion *version = keep->older, *older; version != NULL; version = older) {
+        older = version->older;
+        freeKeyVersion(tree, version, false);
+        freed++;
+    }
+    keep->older = NULL;
+    if (keep == chain->newest && keep->stamp <= history->oldest) {
+        *slot = chain->next;
+        history->chains--;
+        freed += freeVersionChain(tree, chain);
+    }
+    return freed;
+}
+
+// Sets *version up for a write to key, which current holds if it is in
+// the tree, along with the chain of key. Leaves *version NULL when no
+// snapshot could see the write, and returns false when out of memory.
+static bool historyReserve(const ART *tree, const uint8_t *key, size_t keyLength, const LeafNode *current, KeyVersion **version) {
+    VersionHistory *history = tree->history;
+    VersionChain **slot = historySlot(history, key, keyLength);
+    *version = NULL;
+    if (*slot == NULL && history->readerCount == 0) {
+        return true;
+    }
+
+    KeyVersion *reserved = malloc(sizeof(KeyVersion));
+    if (!reserved) {
+        return false;
+    }
+    if (*slot == NULL) {
+        // The key has been as it is since before any snapshot
+        VersionChain *chain = malloc(sizeof(VersionChain) + keyLength);
+        KeyVersion *base = current ? malloc(sizeof(KeyVersion)) : NULL;
+        if (!chain || (current && !base)) {
+            free(chain);
+            free(reserved);
+            return false;
+        }
+        if (base) {
+            *base = (KeyVersion){ .older = NULL, .stamp = 0, .value = current->value, .valueLength = current->valueLength, .present = true };
+        }
+        chain->next = NULL;
+        chain->newest = base;
+        chain->keyLength = keyLength;
+        memcpy(chain->key, key, keyLength);
+        *slot = chain;
+        if (++history->chains > history->mask + 1) {
+            historyGrow(history);
+        }
+    }
+    *version = reserved;
+    return true;
+}
+
+// Makes version the newest of key, under the stamp of the write
+static void historyPush(const ART *tree, const uint8_t *key, size_t keyLength, KeyVersion *version, bool present, void *value, uint32_t valueLength) {
+    VersionHistory *history = tree->history;
+    VersionChain **slot = historySlot(history, key, keyLength);
+    uint64_t stamp = history->holds ? history->clock : ++history->clock;
+    *version = (KeyVersion){ .older = (*slot)->newest, .stamp = stamp, .value = value, .valueLength = valueLength, .present = present };
+    (*slot)->newest = version;
+    trimVersionChain(tree, history, slot);
+}
+
+// Gives up a reserved version whose write failed
+static void historyCancel(const ART *tree, const uint8_t *key, size_t keyLength, KeyVersion *version) {
+    free(version);
+    VersionChain **slot = historySlot(tree->history, key, keyLength);
+    if ((*slot)->newest == NULL) {
+        VersionChain *chain = *slot;
+        *slot = chain->next;
+        tree->history->chains--;
+        free(chain);
+    } else {
+        trimVersionChain(tree, tree->history, slot);
+    }
+}
+
+// Writes in between share one stamp, so snapshots see all or none of them
+static inline void historyHold(const ART *tree) {
+    if (tree->history && tree->history->holds++ == 0) {
+        tree->history->clock++;
+    }
+}
+
+static inline void historyRelease(const ART *tree) {
+    if (tree->history) {
+        tree->history->holds--;
+    }
+}
+
+// Takes the value of a leaf about to be freed into the history when a
+// snapshot may still read it. Out of memory, snapshots lose the past of
+// the key instead.
+static void historyRemoved(const ART *tree, LeafNode *leaf) {
+    KeyVersion *version;
+    if (historyReserve(tree, leaf->key, leaf->keyLength, leaf, &version)) {
+        if (version != NULL) {
+            historyPush(tree, leaf->key, leaf->keyLength, version, false, NULL, 0);
+            leaf->value = NULL;
+        }
+        return;
+    }
+
+    VersionChain **slot = historySlot(tree->history, leaf->key, leaf->keyLength);
+    if (*slot != NULL) {
+        VersionChain *chain = *slot;
+        *slot = chain->next;
+        tree->history->chains--;
+        freeVersionChain(tree, chain);
+    }
+}
+
+/*** WATCHES ***/
+
+static void freeWatchTable(WatchTable *table) {
+    if (table != NULL) {
+        for (size_t i = 0; i <= table->mask; i++) {
+            for (ArtWatch *watch = table->buckets[i], *next; watch != NULL; watch = next) {
+                next = watch->next;
+                free(watch);
+            }
+        }
+        free(table->buckets);
+        free(table->lengths);
+        free(table->lengthWatches);
+        free(table);
+    }
+}
+
+static WatchTable *makeWatchTable(void) {
+    WatchTable *table = calloc(1, sizeof(WatchTable));
+    if (!table) {
+        return NULL;
+    }
+    table->buckets = calloc(WATCH_TABLE_MIN_BUCKETS, sizeof(ArtWatch *));
+    if (!table->buckets) {
+        free(table);
+        return NULL;
+    }
+    table->mask = WATCH_TABLE_MIN_BUCKETS - 1;
+    return table;
+}
+
+// Doubles the buckets, which stay as they are when memory runs out
+static void watchTableGrow(WatchTable *table) {
+    size_t count = 2 * (table->mask + 1);
+    ArtWatch **buckets = calloc(count, sizeof(ArtWatch *));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i <= table->mask; i++) {
+        for (ArtWatch *watch = table->buckets[i], *next; watch != NULL; watch = next) {
+            next = watch->next;
+            ArtWatch **bucket = &buckets[hashKey(watch->prefix, watch->prefixLength) & (count - 1)];
+            watch->next = *bucket;
+            *bucket = watch;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->mask = count - 1;
+}
+
+// Counts one more watch of length, keeping lengths ascending
+static bool watchLengthAdd(WatchTable *table, uint32_t length) {
+    size_t at = 0;
+    while (at < table->lengthCount && table->lengths[at] < length) {
+        at++;
+    }
+    if (at < table->lengthCount && table->lengths[at] == length) {
+        table->lengthWatches[at]++;
+        return true;
+    }
+
+    uint32_t *lengths = realloc(table->lengths, (table->lengthCount + 1) * sizeof(uint32_t));
+    if (!lengths) {
+        return false;
+    }
+    table->lengths = lengths;
+    size_t *watches = realloc(table->lengthWatches, (table->lengthCount + 1) * sizeof(size_t));
+    if (!watches) {
+        return false;
+    }
+    table->lengthWatches = watches;
+    memmove(lengths + at + 1, lengths + at, (table->lengthCount - at) * sizeof(uint32_t));
+    memmove(watches + at + 1, watches + at, (table->lengthCount - at) * sizeof(size_t));
+    lengths[at] = length;
+    watches[at] = 1;
+    table->lengthCount++;
+    return true;
+}
+
+static void watchLengthRemove(WatchTable *table, uint32_t length) {
+    size_t at = 0;
+    while (table->lengths[at] != length) {
+        at++;
+    }
+    if (--table->lengthWatches[at] == 0) {
+        table->lengthCount--;
+        memmove(table->lengths + at, table->lengths + at + 1, (table->lengthCount - at) * sizeof(uint32_t));
+        memmove(table->lengthWatches + at, table->lengthWatches + at + 1, (table->lengthCount - at) * sizeof(size_t));
+    }
+}
+
+// Calls the watches of every prefix of key, shortest prefix first
+static void notifyWatches(const ART *tree, ArtWatchEvent event, const uint8_t *key, size_t keyLength, void *value) {
+    const WatchTable *table = tree->watches;
+    for (size_t i = 0; i < table->lengthCount && table->lengths[i] <= keyLength; i++) {
+        uint32_t length = table->lengths[i];
+        for (ArtWatch *watch = table->buckets[hashKey(key, length) & table->mask]; watch != NULL; watch = watch->next) {
+            if (watch->prefixLength == length && memcmp(watch->prefix, key, length) == 0) {
+                watch->callback(watch->data, event, key, keyLength, value);
+            }
+        }
+    }
+}
+
+/*** VALUE LOG ***/
+
+typedef struct {
+    uint32_t keyLength;
+    uint32_t valueLength;
+    // Value bytes, then key bytes, so that values stay 8 byte aligned
+} ValueLogRecord;
+
+#define VALUE_LOG_NONE UINT64_MAX
+
+static size_t valueLogRecordSize(size_t keyLength, size_t valueLength) {
+    return (sizeof(ValueLogRecord) + valueLength + keyLength + 7) & ~(size_t)7;
+}
+
+static ValueLogRecord *valueLogRecord(const ValueLog *log, uint64_t ref) {
+    return (ValueLogRecord *)(log->segments[ref >> 32].data + (uint32_t)ref);
+}
+
+// Makes sure the head segment has room for size more bytes, opening a new
+// one in the slot of a collected segment when there is one
+static bool valueLogReserve(ValueLog *log, size_t size) {
+    if (log->segmentCount > 0) {
+        ValueLogSegment *head = &log->segments[log->head];
+        if (head->data && head->used + size <= head->capacity) {
+            return true;
+        }
+    }
+
+    uint32_t slot = 0;
+    while (slot < log->segmentCount && log->segments[slot].data != NULL) {
+        slot++;
+    }
+    if (slot == log->segmentCount) {
+        ValueLogSegment *segments = realloc(log->segments, (log->segmentCount + 1) * sizeof(ValueLogSegment));
+        if (!segments) {
+            return false;
+        }
+        log->segments = segments;
+        log->segmentCount++;
+        segments[slot].data = NULL;
+    }
+
+    // Records larger than a segment get a segment of their own
+    size_t capacity = size > log->segmentSize ? size : log->segmentSize;
+    ValueLogSegment *segment = &log->segments[slot];
+    segment->data = malloc(capacity);
+    if (!segment->data) {
+        return false;
+    }
+    segment->capacity = capacity;
+    segment->used = 0;
+    segment->liveBytes = 0;
+    log->head = slot;
+    return true;
+}
+
+static uint64_t valueLogAppend(ValueLog *log, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength) {
+    size_t size = valueLogRecordSize(keyLength, valueLength);
+    if (keyLength > UINT32_MAX || valueLength > UINT32_MAX || !valueLogReserve(log, size)) {
+        return VALUE_LOG_NONE;
+    }
+
+    ValueLogSegment *segment = &log->segments[log->head];
+    ValueLogRecord *record = (ValueLogRecord *)(segment->data + segment->used);
+    record->keyLength = keyLength;
+    record->valueLength = valueLength;
+    memcpy((uint8_t *)(record + 1), value, valueLength);
+    memcpy((uint8_t *)(record + 1) + valueLength, key, keyLength);
+
+    uint64_t ref = ((uint64_t)log->head << 32) | segment->used;
+    segment->used += size;
+    segment->liveBytes += size;
+    return ref;
+}
+
+static void valueLogRelease(ValueLog *log, uint64_t ref) {
+    ValueLogRecord *record = valueLogRecord(log, ref);
+    ValueLogSegment *segment = &log->segments[ref >> 32];
+
+    segment->liveBytes -= valueLogRecordSize(record->keyLength, record->valueLength);
+    if (segment->liveBytes == 0 && (uint32_t)(ref >> 32) != log->head) {
+        // Nothing to move, the segment can go right away
+        free(segment->data);
+        segment->data = NULL;
+    }
+}
+
+static void freeValueLog(ValueLog *log) {
+    if (log == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < log->segmentCount; i++) {
+        free(log->segments[i].data);
+    }
+    free(log->segments);
+    free(log);
+}
+
+static void *leafValue(const ART *tree, const LeafNode *leaf) {
+    if (leaf->flags & LEAF_VALUE_LOGGED) {
+        return valueLogRecord(tree->valueLog, (uint64_t)(uintptr_t)leaf->value) + 1;
+    }
+    return leaf->value;
+}
+
+static void releaseLeafValue(const ART *tree, LeafNode *leaf) {
+    if (leaf->flags & LEAF_VALUE_LOGGED) {
+        valueLogRelease(tree->valueLog, (uint64_t)(uintptr_t)leaf->value);
+    } else if (tree->valuePolicy == ART_VALUE_COPY) {
+        treeFree(tree, leaf->value, leaf->valueLength);
+    } else if (tree->valuePolicy == ART_VALUE_OWN && leaf->value != NULL) {
+        (tree->freeValue ? tree->freeValue : free)(leaf->value);
+    }
+}
+
+// Stored form of value as the tree's value policy says: a copy, a value
+// log reference when it is large enough, or the pointer itself
+static bool makeStoredValue(const ART *tree, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, void **stored, uint8_t *flags) {
+    if (valueLength > UINT32_MAX) {
+        return false;
+    }
+    if (tree->valuePolicy != ART_VALUE_COPY) {
+        *stored = (void *)value;
+        *flags = 0;
+    } else if (tree->valueLog && valueLength >= tree->valueLog->threshold) {
+        uint64_t ref = valueLogAppend(tree->valueLog, key, keyLength, value, valueLength);
+        if (ref == VALUE_LOG_NONE) {
+            return false;
+        }
+        *stored = (void *)(uintptr_t)ref;
+        *flags = LEAF_VALUE_LOGGED;
+    } else {
+        *stored = treeAlloc(tree, valueLength);
+        if (!*stored) {
+            return false;
+        }
+        memcpy(*stored, value, valueLength);
+        *flags = 0;
+    }
+    return true;
+}
+
+// Puts a value from makeStoredValue() in leaf. The previous value is only
+// released once the new one is in place.
+static void setLeafValue(const ART *tree, LeafNode *leaf, const uint8_t *key, size_t keyLength, void *stored, size_t valueLength, uint8_t flags) {
+    // Storing the pointer a leaf already owns must not destroy it
+    if ((leaf->value != NULL && leaf->value != stored) || (leaf->flags & LEAF_VALUE_LOGGED)) {
+        releaseLeafValue(tree, leaf);
+    }
+    leaf->value = stored;
+    leaf->valueLength = valueLength;
+    leaf->flags = (leaf->flags & ~LEAF_VALUE_LOGGED) | flags;
+    bumpKeyVersion(tree, key, keyLength);
+}
+
+static bool storeLeafValue(const ART *tree, LeafNode *leaf, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength) {
+    void *stored;
+    uint8_t flags;
+    if (!makeStoredValue(tree, key, keyLength, value, valueLength, &stored, &flags)) {
+        return false;
+    }
+    setLeafValue(tree, leaf, key, keyLength, stored, valueLength, flags);
+    return true;
+}
+
+// Value readied by prepareReplace() to go over a leaf's, which then
+// cannot fail
+typedef struct {
+    void *stored;
+    size_t valueLength;
+    uint8_t flags;
+    KeyVersion *version;
+} ReplacedValue;
+
+// The value replaced goes into the history when a snapshot may still read
+// it; storing the pointer the leaf holds changes nothing there
+static bool prepareReplace(const ART *tree, const LeafNode *leaf, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, ReplacedValue *replaced) {
+    replaced->version = NULL;
+    replaced->valueLength = valueLength;
+    if (tree->history && (tree->valuePolicy == ART_VALUE_COPY || value != leaf->value)) {
+        if (!historyReserve(tree, key, keyLength, leaf, &replaced->version)) {
+            return false;
+        }
+    }
+    if (!makeStoredValue(tree, key, keyLength, value, valueLength, &replaced->stored, &replaced->flags)) {
+        if (replaced->version) {
+            historyCancel(tree, key, keyLength, replaced->version);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Gives up a prepared value, which an owned one survives
+static void cancelReplace(const ART *tree, const uint8_t *key, size_t keyLength, ReplacedValue *replaced) {
+    if (replaced->flags & LEAF_VALUE_LOGGED) {
+        valueLogRelease(tree->valueLog, (uint64_t)(uintptr_t)replaced->stored);
+    } else if (tree->valuePolicy == ART_VALUE_COPY) {
+        treeFree(tree, replaced->stored, replaced->valueLength);
+    }
+    if (replaced->version) {
+        historyCancel(tree, key, keyLength, replaced->version);
+    }
+}
+
+// A value written over an existing key starts without a TTL, as a new key
+// would
+static void finishReplace(const ART *tree, LeafNode *leaf, const uint8_t *key, size_t keyLength, const ReplacedValue *replaced) {
+    if (replaced->version) {
+        // The history keeps the previous value
+        leaf->value = NULL;
+    }
+    setLeafValue(tree, leaf, key, keyLength, replaced->stored, replaced->valueLength, replaced->flags);
+    if (replaced->version) {
+        historyPush(tree, key, keyLength, replaced->version, true, leaf->value, leaf->valueLength);
+    }
+    leaf->expiresAt = 0;
+    if (tree->watches) {
+        notifyWatches(tree, ART_WATCH_UPDATE, key, keyLength, leafValue(tree, leaf));
+    }
+}
+
+static bool replaceLeafValue(const ART *tree, LeafNode *leaf, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength) {
+    ReplacedValue replaced;
+    if (!prepareReplace(tree, leaf, key, keyLength, value, valueLength, &replaced)) {
+        return false;
+    }
+    finishReplace(tree, leaf, key, keyLength, &replaced);
+    return true;
+}
+
+// Hands an owned value back to the caller when its insert is refused, as
+// artInsert() promises, so that freeing the leaf leaves it alone
+static inline void disownLeafValue(const ART *tree, LeafNode *leaf) {
+    if (tree->valuePolicy == ART_VALUE_OWN) {
+        leaf->value = NULL;
+    }
+}
+
+// Leaf for key hanging at depth, NULL if out of memory or if the key ended
+// above depth. Such a key is a prefix of the keys sharing its path, and
+// the byte it took there was only the zero past its end.
+static LeafNode *makeLeafAt(const ART *tree, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth) {
+    if (depth > keyLength) {
+        return NULL;
+    }
+    size_t base = leafBase(tree, depth);
+
+    LeafNode *leaf = makeEmptyLeaf(tree, key + base, keyLength - base);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    if (!storeLeafValue(tree, leaf, key, keyLength, value, valueLength)) {
+        freeNodeMemory(tree, (Node *)leaf);
+        return NULL;
+    }
+    if (!trackLeaf(tree, leaf)) {
+        disownLeafValue(tree, leaf);
+        releaseLeafValue(tree, leaf);
+        freeNodeMemory(tree, (Node *)leaf);
+        return NULL;
+    }
+
+    KeyVersion *version = NULL;
+    if (tree->history && !historyReserve(tree, key, keyLength, NULL, &version)) {
+        untrackLeaf(tree, leaf);
+        disownLeafValue(tree, leaf);
+        releaseLeafValue(tree, leaf);
+        freeNodeMemory(tree, (Node *)leaf);
+        return NULL;
+    }
+    if (version) {
+        historyPush(tree, key, keyLength, version, true, leaf->value, leaf->valueLength);
+    }
+    if (tree->watches) {
+        notifyWatches(tree, ART_WATCH_INSERT, key, keyLength, leafValue(tree, leaf));
+    }
+    return leaf;
+}
+
+// Frees a leaf that is out of the tree
+static void freeLeaf(const ART *tree, LeafNode *leaf) {
+    if (tree->watches) {
+        notifyWatches(tree, ART_WATCH_DELETE, leaf->key, leaf->keyLength, leafValue(tree, leaf));
+    }
+    if (tree->history) {
+        historyRemoved(tree, leaf);
+    }
+    untrackLeaf(tree, leaf);
+    releaseLeafValue(tree, leaf);
+    freeNodeMemory(tree, (Node *)leaf);
+}
+
+// Smallest inner node type able to hold count children without growing
+static NodeType typeForCount(int count) {
+    if (count <= 4) {
+        return NODE4;
+    }
+    if (count <= 16) {
+        return NODE16;
+    }
+    if (count <= 48) {
+        return NODE48;
+    }
+    return NODE256;
+}
+
+static Node *makeNodeForCount(const ART *tree, int count) {
+    return makeInnerNode(tree, typeForCount(count));
+}
+
+/*** LEAF BUCKETS ***/
+
+// FNV-1a folded to a single byte, taken over the key bytes below the
+// bucket so that it only depends on what the bucket has to tell apart.
+static uint8_t fingerprintAt(const uint8_t *key, size_t keyLength, size_t depth) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = depth; i < keyLength; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return (uint8_t)(hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24));
+}
+
+static int bucketFind(const ART *tree, const LeafBucket *bucket, const uint8_t *key, size_t keyLength, size_t depth) {
+    uint8_t fingerprint = fingerprintAt(key, keyLength, depth);
+    int count = bucket->node.count;
+
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8((char)fingerprint);
+    for (int base = 0; base < count; base += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(bucket->fingerprints + base));
+        int bitfield = _mm_movemask_epi8(_mm_cmpeq_epi8(needle, chunk));
+        if (count - base < 16) {
+            bitfield &= (1 << (count - base)) - 1;
+        }
+        while (bitfield) {
+            int index = base + __builtin_ctz(bitfield);
+            if (leafMatches(tree, bucket->leaves[index], key, keyLength, depth)) {
+                return index;
+            }
+            bitfield &= bitfield - 1;
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        if (bucket->fingerprints[i] == fingerprint && leafMatches(tree, bucket->leaves[i], key, keyLength, depth)) {
+            return i;
+        }
+    }
+#endif
+
+    return INVALID;
+}
+
+// Adds leaf at its sorted position; the caller makes sure there is room.
+// All leaves of a bucket share their base, so stored bytes compare as keys.
+static void bucketAddLeaf(const ART *tree, LeafBucket *bucket, LeafNode *leaf, size_t depth) {
+    int low = 0;
+    int high = bucket->node.count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        LeafNode *other = bucket->leaves[middle];
+        if (compareKeys(other->key, other->keyLength, leaf->key, leaf->keyLength) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (int i = bucket->node.count; i > low; i--) {
+        bucket->fingerprints[i] = bucket->fingerprints[i - 1];
+        bucket->leaves[i] = bucket->leaves[i - 1];
+    }
+    bucket->fingerprints[low] = fingerprintAt(leaf->key, leaf->keyLength, depth - leafBase(tree, depth));
+    bucket->leaves[low] = leaf;
+    bucket->node.count++;
+}
+
+// Replaces a full bucket by an inner node. Leaves sharing the next byte
+// move together into a child bucket, single leaves are hung directly.
+static Node *splitBucket(const ART *tree, LeafBucket *bucket, size_t depth) {
+    int count = bucket->node.count;
+    LeafNode *first = bucket->leaves[0];
+    LeafNode *last = bucket->leaves[count - 1];
+
+    // Offset of depth within the stored key bytes
+    size_t offset = depth - leafBase(tree, depth);
+
+    // Leaves are sorted, so the first and last key bound the common prefix
+    size_t limit = MIN(first->keyLength, last->keyLength);
+    size_t common = 0;
+    while (offset + common < limit && first->key[offset + common] == last->key[offset + common]) {
+        common++;
+    }
+    uint32_t prefixLen = MIN(common, MAX_PREFIX_LENGTH);
+    size_t childOffset = offset + prefixLen;
+
+    // Copy the prefix out before the leaves get trimmed below
+    uint8_t prefix[MAX_PREFIX_LENGTH];
+    memcpy(prefix, first->key + offset, prefixLen);
+
+    Node *children[MAX_BUCKET_CAPACITY];
+    uint8_t bytes[MAX_BUCKET_CAPACITY];
+    int groups = 0;
+    for (int start = 0, end; start < count; start = end) {
+        bytes[groups] = keyByteAt(bucket->leaves[start]->key, bucket->leaves[start]->keyLength, childOffset);
+        end = start + 1;
+        while (end < count && keyByteAt(bucket->leaves[end]->key, bucket->leaves[end]->keyLength, childOffset) == bytes[groups]) {
+            end++;
+        }
+
+        if (end - start == 1) {
+            children[groups++] = (Node *)bucket->leaves[start];
+            continue;
+        }
+
+        // Keys only differing by trailing zero bytes can never be told apart.
+        // insertIntoBucket() refuses them, so this only guards the recursion.
+        LeafBucket *child = end - start == count && prefixLen == common ? NULL : makeBucket(tree, bucket->capacity);
+        if (child == NULL) {
+            for (int i = 0; i < groups; i++) {
+                if (children[i]->type == BUCKET) {
+                    freeNodeMemory(tree, children[i]);
+                }
+            }
+            return NULL;
+        }
+        children[groups++] = (Node *)child;
+    }
+
+    Node *inner = makeNodeForCount(tree, groups);
+    if (inner == NULL) {
+        for (int i = 0; i < groups; i++) {
+            if (children[i]->type == BUCKET) {
+                freeNodeMemory(tree, children[i]);
+            }
+        }
+        return NULL;
+    }
+    setPrefix(inner, (const char *)prefix, prefixLen);
+    inner->subtreeSize = count;
+
+    // Nothing can fail from here on, leaves are moved below the new node
+    size_t shift = prefixLen + 1;
+    for (int i = 0, leaf = 0; i < groups; i++) {
+        if (children[i]->type == BUCKET) {
+            LeafBucket *child = (LeafBucket *)children[i];
+            while (leaf < count && keyByteAt(bucket->leaves[leaf]->key, bucket->leaves[leaf]->keyLength, childOffset) == bytes[i]) {
+                bucketAddLeaf(tree, child, moveLeafDown(tree, bucket->leaves[leaf++], shift), depth + shift);
+            }
+        } else {
+            children[i] = (Node *)moveLeafDown(tree, bucket->leaves[leaf++], shift);
+        }
+        inner = addChild(inner, &bytes[i], children[i]);
+    }
+
+    freeNodeMemory(tree, (Node *)bucket);
+    return inner;
+}
+
+// Whether key is a prefix of a leaf in bucket or the other way round.
+// splitBucket() could hang the shorter key below its own end, or never
+// tell the two apart when only zero bytes follow, so such keys are
+// refused as splitLeaf() refuses them.
+static bool bucketHasPrefixPair(const ART *tree, const LeafBucket *bucket, const uint8_t *key, size_t keyLength, size_t depth) {
+    size_t base = leafBase(tree, depth);
+    if (keyLength < base) {
+        return true;
+    }
+    for (int i = 0; i < bucket->node.count; i++) {
+        const LeafNode *leaf = bucket->leaves[i];
+        if (memcmp(leaf->key, key + base, MIN(leaf->keyLength, keyLength - base)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int insertIntoBucket(ART *tree, Node **ref, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth) {
+    LeafBucket *bucket = (LeafBucket *)*ref;
+
+    int index = bucketFind(tree, bucket, key, keyLength, depth);
+    if (index != INVALID) {
+        return replaceLeafValue(tree, bucket->leaves[index], key, keyLength, value, valueLength) ? 0 : INVALID;
+    }
+    if (bucketHasPrefixPair(tree, bucket, key, keyLength, depth)) {
+        return INVALID;
+    }
+
+    if (isNodeFull(*ref)) {
+        Node *inner = splitBucket(tree, bucket, depth);
+        if (inner == NULL) {
+            return INVALID;
+        }
+        *ref = inner;
+        return insertRecursive(tree, ref, key, keyLength, value, valueLength, depth);
+    }
+
+    LeafNode *leaf = makeLeafAt(tree, key, keyLength, value, valueLength, depth);
+    if (leaf == NULL) {
+        return INVALID;
+    }
+    bucketAddLeaf(tree, bucket, leaf, depth);
+    return 1;
+}
+
+/*** INSERTION ***/
+
+// Turns the leaf in *ref into an inner node holding both keys. Prefixes
+// longer than MAX_PREFIX_LENGTH are split over a chain of nodes, so every
+// byte of the path is stored and lookups never have to re-check a leaf.
+static int splitLeaf(ART *tree, Node **ref, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth) {
+    LeafNode *leaf = (LeafNode *)*ref;
+
+    size_t offset = depth - leafBase(tree, depth);
+    size_t common = 0;
+    while (offset + common < leaf->keyLength && depth + common < keyLength &&
+           leaf->key[offset + common] == key[depth + common]) {
+        common++;
+    }
+    if (offset + common >= leaf->keyLength || depth + common >= keyLength) {
+        // One key is a prefix of the other, buckets refuse the same pairs
+        return INVALID;
+    }
+
+    if (tree->bucketCapacity) {
+        LeafBucket *bucket = makeBucket(tree, tree->bucketCapacity);
+        if (bucket == NULL) {
+            return INVALID;
+        }
+        bucketAddLeaf(tree, bucket, leaf, depth);
+        *ref = (Node *)bucket;
+        return insertIntoBucket(tree, ref, key, keyLength, value, valueLength, depth);
+    }
+
+    Node *newNode = makeInnerNode(tree, NODE4);
+    if (newNode == NULL) {
+        return INVALID;
+    }
+    uint32_t prefixLen = MIN(common, MAX_PREFIX_LENGTH);
+    setPrefix(newNode, (const char *)key + depth, prefixLen);
+    uint8_t leafByte = leaf->key[offset + prefixLen];
+    addChild(newNode, &leafByte, (Node *)moveLeafDown(tree, leaf, prefixLen + 1));
+    newNode->subtreeSize = 1;
+
+    *ref = newNode;
+    return insertRecursive(tree, ref, key, keyLength, value, valueLength, depth);
+}
+
+// Splits the prefix of the inner node in *ref after matched bytes
+static int splitPrefix(ART *tree, Node **ref, uint32_t matched, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth) {
+    Node *node = *ref;
+
+    Node *newNode = makeInnerNode(tree, NODE4);
+    if (newNode == NULL) {
+        return INVALID;
+    }
+    setPrefix(newNode, (const char *)node->prefix, matched);
+
+    uint8_t nodeByte = node->prefix[matched];
+    node->prefixLen -= matched + 1;
+    memmove(node->prefix, node->prefix + matched + 1, node->prefixLen);
+    addChild(newNode, &nodeByte, node);
+    newNode->subtreeSize = keysBelow(node);
+
+    *ref = newNode;
+    return insertRecursive(tree, ref, key, keyLength, value, valueLength, depth);
+}
+
+// Returns 1 when key was added, 0 when an existing value was replaced and
+// INVALID when memory ran out or key is a prefix of a stored key.
+static int insertRecursive(ART *tree, Node **ref, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength, size_t depth) {
+    Node *node = *ref;
+
+    if (node == NULL) {
+        LeafNode *leaf = makeLeafAt(tree, key, keyLength, value, valueLength, depth);
+        if (leaf == NULL) {
+            return INVALID;
+        }
+        *ref = (Node *)leaf;
+        return 1;
+    }
+
+    if (node->type == LEAF) {
+        LeafNode *leaf = (LeafNode *)node;
+        if (leafMatches(tree, leaf, key, keyLength, depth)) {
+            return replaceLeafValue(tree, leaf, key, keyLength, value, valueLength) ? 0 : INVALID;
+        }
+        return splitLeaf(tree, ref, key, keyLength, value, valueLength, depth);
+    }
+
+    if (node->type == BUCKET) {
+        return insertIntoBucket(tree, ref, key, keyLength, value, valueLength, depth);
+    }
+
+    if (node->prefixLen) {
+        uint32_t matched = prefixMismatch(node, key, keyLength, depth);
+        if (matched < node->prefixLen) {
+            return splitPrefix(tree, ref, matched, key, keyLength, value, valueLength, depth);
+        }
+        depth += node->prefixLen;
+    }
+
+    uint8_t byte = keyByteAt(key, keyLength, depth);
+    Node **child = findChildRef(node, byte);
+    if (child) {
+        int result = insertRecursive(tree, child, key, keyLength, value, valueLength, depth + 1);
+        node->subtreeSize += result == 1;
+        return result;
+    }
+
+    // Room comes first, as a leaf once made has been seen by the history
+    // and watches
+    if (!makeChildRoom(tree, ref)) {
+        return INVALID;
+    }
+    LeafNode *leaf = makeLeafAt(tree, key, keyLength, value, valueLength, depth + 1);
+    if (leaf == NULL) {
+        return INVALID;
+    }
+    node = addChild(*ref, &byte, (Node *)leaf);
+    node->subtreeSize++;
+    return 1;
+}
+
+Node *insert(Node **root, const void *key, size_t keyLength, void *value, size_t valueLength, int depth, compare_func cmp){
+    // The radix structure orders keys bytewise on its own, cmp is kept so
+    // that existing callers still compile
+    (void)cmp;
+
+    ART tree = { .root = *root };
+    int result = insertRecursive(&tree, &tree.root, key, keyLength, value, valueLength, depth);
+    *root = tree.root;
+
+    return result == INVALID ? NULL : *root;
+}
+
+Node *insertInt(Node **root, int key, void *value, size_t valueLength) {
+    return insert(root, &key, sizeof(int), value, valueLength, 0, compare_ints);
+}
+
+Node *insertString(Node **root, const char *key, void *value, size_t valueLength) {
+    return insert(root, key, strlen(key) + 1, value, valueLength, 0, compare_strings);
+}
+
+/*** LOOKUP ***/
+
+static void lookupStart(const ART *tree, ArtLookup *state, const uint8_t *key, size_t keyLength) {
+    state->key = key;
+    state->keyLength = keyLength;
+    state->node = tree->root;
+    state->depth = 0;
+    state->leaf = NULL;
+
+    Node **slot = jumpTableSlot(tree->jumpTable, key, keyLength);
+    if (slot != NULL) {
+        state->node = *slot;
+        state->depth = tree->jumpTable->depth;
+    }
+}
+
+// Handles the current node of the lookup and prefetches the next one.
+// Returns true once the lookup has finished.
+static bool lookupStep(const ART *tree, ArtLookup *state) {
+    Node *node = state->node;
+    if (node == NULL) {
+        return true;
+    }
+
+    if (node->type == LEAF) {
+        LeafNode *leaf = (LeafNode *)node;
+        state->leaf = leafMatches(tree, leaf, state->key, state->keyLength, state->depth) ? leaf : NULL;
+        state->node = NULL;
+        return true;
+    }
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        int index = bucketFind(tree, bucket, state->key, state->keyLength, state->depth);
+        state->leaf = index == INVALID ? NULL : bucket->leaves[index];
+        state->node = NULL;
+        return true;
+    }
+
+    if (node->prefixLen) {
+        if (prefixMismatch(node, state->key, state->keyLength, state->depth) != node->prefixLen) {
+            state->node = NULL;
+            return true;
+        }
+        state->depth += node->prefixLen;
+    }
+
+    Node **child = findChildRef(node, keyByteAt(state->key, state->keyLength, state->depth));
+    state->node = child ? *child : NULL;
+    state->depth++;
+    if (state->node == NULL) {
+        return true;
+    }
+
+    __builtin_prefetch(state->node);
+    return false;
+}
+
+static LeafNode *findLeaf(const ART *tree, const uint8_t *key, size_t keyLength) {
+    ArtLookup state;
+    lookupStart(tree, &state, key, keyLength);
+    while (!lookupStep(tree, &state)) {
+    }
+    return state.leaf;
+}
+
+// Like findLeaf, but fetches the key's filter line first and only tests
+// it after the top levels, which are usually cached, have been walked.
+// Absent keys then stop early while present ones hardly wait for it.
+static LeafNode *findLeafFiltered(const ART *tree, const uint8_t *key, size_t keyLength) {
+    uint64_t hash = hashKey(key, keyLength);
+    const SubtreeFilter *filter = filterFor(tree->filters, key, keyLength);
+    if (filter->blocks == NULL) {
+        return NULL;
+    }
+    __builtin_prefetch(filterBlock(filter, hash));
+
+    ArtLookup state;
+    lookupStart(tree, &state, key, keyLength);
+    for (int step = 0; ; step++) {
+        if (step == SUBTREE_FILTER_STEPS && !filterMayContain(tree->filters, key, keyLength, hash)) {
+            return NULL;
+        }
+        if (lookupStep(tree, &state)) {
+            return state.leaf;
+        }
+    }
+}
+
+void *search(Node *root, const void *key, size_t keyLength) {
+    ART tree = { .root = root };
+    LeafNode *leaf = findLeaf(&tree, key, keyLength);
+    return leaf ? leaf->value : NULL;
+}
+
+/*** ITERATION ***/
+
+typedef struct {
+    const ART *tree;
+    ArtIterateFunc callback;
+    void *data;
+    uint64_t now;   // Keys expired at this time are skipped
+    uint8_t *path;  // Key bytes implied by the nodes above the current one
+    size_t capacity;
+} IterateState;
+
+static bool reservePath(IterateState *state, size_t length) {
+    if (length <= state->capacity && state->path != NULL) {
+        return true;
+    }
+
+    size_t capacity = state->capacity ? state->capacity : 64;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    uint8_t *path = realloc(state->path, capacity);
+    if (!path) {
+        return false;
+    }
+    state->path = path;
+    state->capacity = capacity;
+    return true;
+}
+
+static int iterateLeaf(IterateState *state, LeafNode *leaf, size_t depth) {
+    if (leaf->expiresAt && leaf->expiresAt <= state->now) {
+        return 0;
+    }
+
+    if (!(state->tree->flags & ART_LEAF_SUFFIX)) {
+        return state->callback(state->data, leaf->key, leaf->keyLength, leafValue(state->tree, leaf));
+    }
+
+    // Suffix leaves: the full key is the path followed by the stored bytes
+    if (!reservePath(state, depth + leaf->keyLength)) {
+        return INVALID;
+    }
+    memcpy(state->path + depth, leaf->key, leaf->keyLength);
+    return state->callback(state->data, state->path, depth + leaf->keyLength, leafValue(state->tree, leaf));
+}
+
+static int iterateNode(IterateState *state, Node *node, size_t depth);
+
+static int iterateChild(IterateState *state, Node *child, uint8_t byte, size_t depth) {
+    if (!reservePath(state, depth + 1)) {
+        return INVALID;
+    }
+    state->path[depth] = byte;
+    return iterateNode(state, child, depth + 1);
+}
+
+static int iterateNode(IterateState *state, Node *node, size_t depth) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int result = 0;
+    switch (node->type) {
+        case LEAF:
+            return iterateLeaf(state, (LeafNode *)node, depth);
+        case BUCKET: {
+            LeafBucket *bucket = (LeafBucket *)node;
+            for (int i = 0; i < bucket->node.count && result == 0; i++) {
+                result = iterateLeaf(state, bucket->leaves[i], depth);
+            }
+            return result;
+        }
+        default:
+            break;
+    }
+
+    if (!reservePath(state, depth + node->prefixLen)) {
+        return INVALID;
+    }
+    memcpy(state->path + depth, node->prefix, node->prefixLen);
+    depth += node->prefixLen;
+
+    switch (node->type) {
+        case NODE4: {
+            Node4 *node4 = (Node4 *)node;
+            for (int i = 0; i < node4->node.count && result == 0; i++) {
+                result = iterateChild(state, node4->children[i], node4->keys[i], depth);
+            }
+            break;
+        }
+        case NODE16: {
+            Node16 *node16 = (Node16 *)node;
+            for (int i = 0; i < node16->node.count && result == 0; i++) {
+                result = iterateChild(state, node16->children[i], node16->keys[i], depth);
+            }
+            break;
+        }
+        case NODE48: {
+            Node48 *node48 = (Node48 *)node;
+            for (int i = 0; i < 256 && result == 0; i++) {
+                if (node48->keys[i] != EMPTY_KEY) {
+                    result = iterateChild(state, node48->children[node48->keys[i] - 1], i, depth);
+                }
+            }
+            break;
+        }
+        case NODE256: {
+            Node256 *node256 = (Node256 *)node;
+            for (int i = 0; i < 256 && result == 0; i++) {
+                if (node256->children[i] != NULL) {
+                    result = iterateChild(state, node256->children[i], i, depth);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    return result;
+}
+
+/*** DELETION ***/
+
+// Children of an inner node in ascending byte order
+static int collectChildren(Node *node, uint8_t *bytes, Node **children) {
+    int count = 0;
+    switch (node->type) {
+        case NODE4:
+        case NODE16: {
+            // Node4 and Node16 share the layout up to their key array
+            uint8_t *keys = node->type == NODE4 ? ((Node4 *)node)->keys : ((Node16 *)node)->keys;
+            Node **slots = node->type == NODE4 ? ((Node4 *)node)->children : ((Node16 *)node)->children;
+            for (; count < node->count; count++) {
+                bytes[count] = keys[count];
+                children[count] = slots[count];
+            }
+            break;
+        }
+        case NODE48: {
+            Node48 *node48 = (Node48 *)node;
+            for (int i = 0; i < 256; i++) {
+                if (node48->keys[i] != EMPTY_KEY) {
+                    bytes[count] = i;
+                    children[count++] = node48->children[node48->keys[i] - 1];
+                }
+            }
+            break;
+        }
+        case NODE256: {
+            Node256 *node256 = (Node256 *)node;
+            for (int i = 0; i < 256; i++) {
+                if (node256->children[i] != NULL) {
+                    bytes[count] = i;
+                    children[count++] = node256->children[i];
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return count;
+}
+
+// Drops the child at byte, which must exist; deletions may already have
+// cleared its slot
+static void removeChild(Node *node, uint8_t byte) {
+    switch (node->type) {
+        case NODE4:
+        case NODE16: {
+            uint8_t *keys = node->type == NODE4 ? ((Node4 *)node)->keys : ((Node16 *)node)->keys;
+            Node **children = node->type == NODE4 ? ((Node4 *)node)->children : ((Node16 *)node)->children;
+            int position = 0;
+            while (position < node->count && keys[position] != byte) {
+                position++;
+            }
+            if (position == node->count) {
+                return;
+            }
+            for (int i = position; i < node->count - 1; i++) {
+                keys[i] = keys[i + 1];
+                children[i] = children[i + 1];
+            }
+            keys[node->count - 1] = EMPTY_KEY;
+            children[node->count - 1] = NULL;
+            node->count--;
+            break;
+        }
+        case NODE48: {
+            Node48 *node48 = (Node48 *)node;
+            if (node48->keys[byte] != EMPTY_KEY) {
+                node48->children[node48->keys[byte] - 1] = NULL;
+                node48->keys[byte] = EMPTY_KEY;
+                node->count--;
+            }
+            break;
+        }
+        case NODE256: {
+            // The slot alone cannot tell, its child may already be unlinked
+            Node256 *node256 = (Node256 *)node;
+            node256->children[byte] = NULL;
+            node->count--;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Re-hangs leaf length levels higher; suffix leaves get back the bytes the
+// removed path implied. Returns NULL, leaving leaf untouched, if out of memory.
+static LeafNode *moveLeafUp(const ART *tree, LeafNode *leaf, const uint8_t *bytes, size_t length) {
+    if (!(tree->flags & ART_LEAF_SUFFIX)) {
+        return leaf;
+    }
+
+    LeafNode *grown = treeRealloc(tree, leaf, sizeof(LeafNode) + leaf->keyLength, sizeof(LeafNode) + leaf->keyLength + length);
+    if (!grown) {
+        return NULL;
+    }
+    memmove(grown->key + length, grown->key, grown->keyLength);
+    memcpy(grown->key, bytes, length);
+    grown->keyLength += length;
+    return grown;
+}
+
+// Moves the children of the inner node in *ref into the smallest node type
+// that holds them and room more
+static void resizeNode(const ART *tree, Node **ref, int room) {
+    Node *node = *ref;
+    uint8_t bytes[256];
+    Node *children[256];
+    int count = collectChildren(node, bytes, children);
+
+    Node *resized = makeNodeForCount(tree, count + room);
+    if (resized == NULL) {
+        return;
+    }
+    setPrefix(resized, (const char *)node->prefix, node->prefixLen);
+    resized->subtreeSize = node->subtreeSize;
+    for (int i = 0; i < count; i++) {
+        resized = addChild(resized, &bytes[i], children[i]);
+    }
+
+    freeNodeMemory(tree, node);
+    *ref = resized;
+}
+
+// Restores the node invariants in *ref after children were removed: empty
+// nodes go away, a Node4 with one child is merged into it when the merged
+// path still fits, and sparse nodes shrink to a smaller type.
+static void compactNode(const ART *tree, Node **ref) {
+    Node *node = *ref;
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        if (bucket->node.count <= 1) {
+            // A single leaf stays at the depth of its bucket
+            *ref = bucket->node.count ? (Node *)bucket->leaves[0] : NULL;
+            freeNodeMemory(tree, node);
+        }
+        return;
+    }
+
+    if (node->type == LEAF) {
+        return;
+    }
+
+    if (node->count == 0) {
+        freeNodeMemory(tree, node);
+        *ref = NULL;
+        return;
+    }
+
+    if (node->count == 1) {
+        uint8_t byte;
+        Node *child;
+        collectChildren(node, &byte, &child);
+
+        uint8_t path[MAX_PREFIX_LENGTH + 1];
+        memcpy(path, node->prefix, node->prefixLen);
+        path[node->prefixLen] = byte;
+        size_t pathLength = node->prefixLen + 1;
+
+        if (child->type == LEAF) {
+            LeafNode *leaf = moveLeafUp(tree, (LeafNode *)child, path, pathLength);
+            if (leaf != NULL) {
+                freeNodeMemory(tree, node);
+                *ref = (Node *)leaf;
+            }
+        } else if (child->type != BUCKET && pathLength + child->prefixLen <= MAX_PREFIX_LENGTH) {
+            memmove(child->prefix + pathLength, child->prefix, child->prefixLen);
+            memcpy(child->prefix, path, pathLength);
+            child->prefixLen += pathLength;
+            freeNodeMemory(tree, node);
+            *ref = child;
+        }
+        return;
+    }
+
+    // Promoted nodes are sparse on purpose until artAdaptNodes() finds
+    // them cold
+    bool sparse = (node->type == NODE16 && node->count <= 3) ||
+                  (node->type == NODE48 && node->count <= 12) ||
+                  (node->type == NODE256 && node->count <= 37 && !node->promoted);
+    if (sparse) {
+        resizeNode(tree, ref, 0);
+    }
+}
+
+// Owned values waiting for the tree's bulk destructor
+typedef struct {
+    void *values[ART_FREE_BATCH];
+    size_t count;
+} ValueBatch;
+
+static void flushValueBatch(const ART *tree, ValueBatch *batch) {
+    if (batch->count > 0) {
+        tree->bulkFree(tree->bulkFreeData, batch->values, batch->count);
+        batch->count = 0;
+    }
+}
+
+static void freeBatchedLeaf(const ART *tree, LeafNode *leaf, ValueBatch *batch) {
+    if (batch == NULL || tree->valuePolicy != ART_VALUE_OWN || leaf->value == NULL) {
+        freeLeaf(tree, leaf);
+        return;
+    }
+
+    untrackLeaf(tree, leaf);
+    batch->values[batch->count++] = leaf->value;
+    if (batch->count == ART_FREE_BATCH) {
+        flushValueBatch(tree, batch);
+    }
+    freeNodeMemory(tree, (Node *)leaf);
+}
+
+// Like freeNode, but follows the value policy and releases logged values
+// too. Owned values go to batch when there is one. Returns the keys freed.
+static size_t freeSubtree(const ART *tree, Node *node, ValueBatch *batch) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    if (node->type == LEAF) {
+        freeBatchedLeaf(tree, (LeafNode *)node, batch);
+        return 1;
+    }
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        for (int i = 0; i < bucket->node.count; i++) {
+            freeBatchedLeaf(tree, bucket->leaves[i], batch);
+        }
+        freed = bucket->node.count;
+    } else {
+        uint8_t bytes[256];
+        Node *children[256];
+        int count = collectChildren(node, bytes, children);
+        for (int i = 0; i < count; i++) {
+            freed += freeSubtree(tree, children[i], batch);
+        }
+    }
+
+    freeNodeMemory(tree, node);
+    return freed;
+}
+
+static void bucketRemove(LeafBucket *bucket, int index) {
+    for (int i = index; i < bucket->node.count - 1; i++) {
+        bucket->fingerprints[i] = bucket->fingerprints[i + 1];
+        bucket->leaves[i] = bucket->leaves[i + 1];
+    }
+    bucket->node.count--;
+}
+
+static bool deleteRecursive(ART *tree, Node **ref, const uint8_t *key, size_t keyLength, size_t depth) {
+    Node *node = *ref;
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->type == LEAF) {
+        if (!leafMatches(tree, (LeafNode *)node, key, keyLength, depth)) {
+            return false;
+        }
+        freeLeaf(tree, (LeafNode *)node);
+        *ref = NULL;
+        return true;
+    }
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        int index = bucketFind(tree, bucket, key, keyLength, depth);
+        if (index == INVALID) {
+            return false;
+        }
+        freeLeaf(tree, bucket->leaves[index]);
+        bucketRemove(bucket, index);
+        compactNode(tree, ref);
+        return true;
+    }
+
+    if (prefixMismatch(node, key, keyLength, depth) != node->prefixLen) {
+        return false;
+    }
+    depth += node->prefixLen;
+
+    uint8_t byte = keyByteAt(key, keyLength, depth);
+    Node **child = findChildRef(node, byte);
+    if (child == NULL || !deleteRecursive(tree, child, key, keyLength, depth + 1)) {
+        return false;
+    }
+
+    node->subtreeSize--;
+    if (*child == NULL) {
+        removeChild(node, byte);
+        compactNode(tree, ref);
+    }
+    return true;
+}
+
+// Key interval [lo, hi) being deleted; a NULL bound is open
+typedef struct {
+    const uint8_t *lo;
+    size_t loLength;
+    const uint8_t *hi;
+    size_t hiLength;
+} KeyRange;
+
+// Orders length path bytes, starting at depth, against the same bytes of
+// bound. A bound ending inside the path is a prefix of it and sorts first.
+static int compareWithBound(const uint8_t *bytes, size_t length, const uint8_t *bound, size_t boundLength, size_t depth) {
+    for (size_t i = 0; i < length; i++) {
+        if (depth + i >= boundLength) {
+            return 1;
+        }
+        if (bytes[i] != bound[depth + i]) {
+            return bytes[i] < bound[depth + i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Key bytes of leaf from depth on
+static const uint8_t *leafBytesFrom(const ART *tree, const LeafNode *leaf, size_t depth, size_t *length) {
+    size_t offset = MIN(depth - leafBase(tree, depth), (size_t)leaf->keyLength);
+    *length = leaf->keyLength - offset;
+    return leaf->key + offset;
+}
+
+// Whether a leaf whose path so far equals the still bound ends of range
+// falls inside it
+static bool leafInRange(const ART *tree, const LeafNode *leaf, const KeyRange *range, size_t depth, bool loBound, bool hiBound) {
+    size_t length;
+    const uint8_t *bytes = leafBytesFrom(tree, leaf, depth, &length);
+
+    if (loBound && compareKeys(bytes, length, range->lo + depth, range->loLength - depth) < 0) {
+        return false;
+    }
+    if (hiBound && compareKeys(bytes, length, range->hi + depth, range->hiLength - depth) >= 0) {
+        return false;
+    }
+    return true;
+}
+
+// Deletes the keys of range below *ref, whose path up to depth equals the
+// bounds flagged as bound. Subtrees entirely inside the range are unlinked
+// as a whole, so only the paths to the two bounds are walked.
+static size_t deleteRange(ART *tree, Node **ref, const KeyRange *range, size_t depth, bool loBound, bool hiBound) {
+    Node *node = *ref;
+    if (node == NULL) {
+        return 0;
+    }
+
+    if (!loBound && !hiBound) {
+        *ref = NULL;
+        return freeSubtree(tree, node, NULL);
+    }
+
+    if (node->type == LEAF) {
+        if (!leafInRange(tree, (LeafNode *)node, range, depth, loBound, hiBound)) {
+            return 0;
+        }
+        freeLeaf(tree, (LeafNode *)node);
+        *ref = NULL;
+        return 1;
+    }
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        size_t deleted = 0;
+        for (int i = 0; i < bucket->node.count; ) {
+            if (leafInRange(tree, bucket->leaves[i], range, depth, loBound, hiBound)) {
+                freeLeaf(tree, bucket->leaves[i]);
+                bucketRemove(bucket, i);
+                deleted++;
+            } else {
+                i++;
+            }
+        }
+        compactNode(tree, ref);
+        return deleted;
+    }
+
+    if (loBound) {
+        int order = compareWithBound(node->prefix, node->prefixLen, range->lo, range->loLength, depth);
+        if (order < 0) {
+            return 0;
+        }
+        loBound = order == 0;
+    }
+    if (hiBound) {
+        int order = compareWithBound(node->prefix, node->prefixLen, range->hi, range->hiLength, depth);
+        if (order > 0) {
+            return 0;
+        }
+        hiBound = order == 0;
+    }
+    if (!loBound && !hiBound) {
+        *ref = NULL;
+        return freeSubtree(tree, node, NULL);
+    }
+    depth += node->prefixLen;
+
+    uint8_t bytes[256];
+    Node *children[256];
+    int count = collectChildren(node, bytes, children);
+    size_t deleted = 0;
+
+    for (int i = 0; i < count; i++) {
+        bool childLoBound = loBound;
+        bool childHiBound = hiBound;
+
+        if (loBound && depth < range->loLength) {
+            if (bytes[i] < range->lo[depth]) {
+                continue;
+            }
+            childLoBound = bytes[i] == range->lo[depth];
+        } else {
+            childLoBound = false;
+        }
+        if (hiBound) {
+            if (depth >= range->hiLength || bytes[i] > range->hi[depth]) {
+                break;
+            }
+            childHiBound = bytes[i] == range->hi[depth];
+        }
+
+        Node **child = findChildRef(node, bytes[i]);
+        deleted += deleteRange(tree, child, range, depth + 1, childLoBound, childHiBound);
+        if (*child == NULL) {
+            removeChild(node, bytes[i]);
+        }
+    }
+
+    node->subtreeSize -= deleted;
+    compactNode(tree, ref);
+    return deleted;
+}
+
+// The keys starting with prefix are exactly [prefix, next), where next is
+// the prefix with its last byte below 0xFF incremented and the rest dropped.
+// *nextLength is 0 when there is no such key and the range is open.
+static uint8_t *prefixSuccessor(const uint8_t *prefix, size_t prefixLength, size_t *nextLength) {
+    uint8_t *next = malloc(prefixLength ? prefixLength : 1);
+    if (!next) {
+        return NULL;
+    }
+
+    *nextLength = prefixLength;
+    memcpy(next, prefix, prefixLength);
+    while (*nextLength > 0 && next[*nextLength - 1] == 0xFF) {
+        (*nextLength)--;
+    }
+    if (*nextLength > 0) {
+        next[*nextLength - 1]++;
+    }
+    return next;
+}
+
+/*** BATCH INSERTION ***/
+
+typedef struct {
+    const uint8_t *key;
+    size_t keyLength;
+    size_t index; // Position in the caller's arrays
+} BatchEntry;
+
+typedef struct {
+    BatchEntry *entries;
+    BatchEntry *scratch; // As long as entries, for reordering runs
+    const void *const *values;
+    const size_t *valueLengths;
+    size_t stored; // Keys stored, new or replaced
+} InsertBatch;
+
+#define BATCH_INSERTION_SORT 32 // Runs shorter than this skip counting
+
+static inline uint8_t batchByteAt(const InsertBatch *batch, size_t position, size_t depth) {
+    return keyByteAt(batch->entries[position].key, batch->entries[position].keyLength, depth);
+}
+
+// Orders entries [first, last) by their byte at depth. The sort is stable,
+// so equal keys stay in batch order and the last value wins, and input
+// that already is in order is only read.
+static void sortBatchRun(InsertBatch *batch, size_t first, size_t last, size_t depth) {
+    size_t i = first + 1;
+    while (i < last && batchByteAt(batch, i - 1, depth) <= batchByteAt(batch, i, depth)) {
+        i++;
+    }
+    if (i >= last) {
+        return;
+    }
+
+    BatchEntry *entries = batch->entries;
+    if (last - first < BATCH_INSERTION_SORT) {
+        for (; i < last; i++) {
+            BatchEntry entry = entries[i];
+            uint8_t byte = keyByteAt(entry.key, entry.keyLength, depth);
+            size_t j = i;
+            for (; j > first && batchByteAt(batch, j - 1, depth) > byte; j--) {
+                entries[j] = entries[j - 1];
+            }
+            entries[j] = entry;
+        }
+        return;
+    }
+
+    size_t offsets[256] = { 0 };
+    for (i = first; i < last; i++) {
+        offsets[batchByteAt(batch, i, depth)]++;
+    }
+    size_t offset = first;
+    for (int byte = 0; byte < 256; byte++) {
+        size_t count = offsets[byte];
+        offsets[byte] = offset;
+        offset += count;
+    }
+    for (i = first; i < last; i++) {
+        batch->scratch[offsets[batchByteAt(batch, i, depth)]++] = entries[i];
+    }
+    memcpy(entries + first, batch->scratch + first, (last - first) * sizeof(BatchEntry));
+}
+
+static bool batchEntryMatches(const BatchEntry *entry, const Node *node, size_t depth) {
+    if (entry->keyLength >= depth + node->prefixLen) {
+        return memcmp(entry->key + depth, node->prefix, node->prefixLen) == 0;
+    }
+    return prefixMismatch(node, entry->key, entry->keyLength, depth) == node->prefixLen;
+}
+
+// Moves the entries of [first, last) that match the prefix of the inner
+// node to the front, keeping the batch order on both sides, and returns
+// where the others start
+static size_t partitionBatchRun(InsertBatch *batch, const Node *node, size_t first, size_t last, size_t depth) {
+    size_t matched = first;
+    size_t others = first;
+    for (size_t i = first; i < last; i++) {
+        const BatchEntry *entry = &batch->entries[i];
+        if (!batchEntryMatches(entry, node, depth)) {
+            batch->scratch[others++] = *entry;
+        } else if (matched++ != i) {
+            batch->entries[matched - 1] = *entry;
+        }
+    }
+    memcpy(batch->entries + matched, batch->scratch + first, (others - first) * sizeof(BatchEntry));
+    return matched;
+}
+
+// Depth at which the keys of two entries part, at least depth
+static size_t batchEntriesPart(const BatchEntry *a, const BatchEntry *b, size_t depth) {
+    size_t shared = MIN(a->keyLength, b->keyLength);
+    size_t longest = a->keyLength + b->keyLength - shared;
+    while (depth < shared && a->key[depth] == b->key[depth]) {
+        depth++;
+    }
+    while (depth >= shared && depth < longest && keyByteAt(a->key, a->keyLength, depth) == keyByteAt(b->key, b->keyLength, depth)) {
+        depth++;
+    }
+    return depth;
+}
+
+// Moves the first entry that parts from entry first earliest to the front.
+// Inserted one by one into a leaf or an empty slot, the entries then make
+// a node with the prefix they all share at the latest on the second
+// split, where neighbouring keys would split it again for every shorter
+// prefix. Entries in between keep their order.
+static void frontEarliestParting(InsertBatch *batch, size_t first, size_t last, size_t depth) {
+    // Equal keys part at their end and are never taken, keeping them in
+    // batch order
+    size_t earliest = first;
+    size_t parting = batch->entries[first].keyLength;
+    for (size_t i = first + 1; i < last; i++) {
+        size_t at = batchEntriesPart(&batch->entries[first], &batch->entries[i], depth);
+        if (at < parting && at < batch->entries[i].keyLength) {
+            earliest = i;
+            parting = at;
+        }
+    }
+    if (earliest != first) {
+        BatchEntry entry = batch->entries[earliest];
+        memmove(batch->entries + first + 1, batch->entries + first, (earliest - first) * sizeof(BatchEntry));
+        batch->entries[first] = entry;
+    }
+}
+
+static int insertBatchEntry(ART *tree, Node **ref, InsertBatch *batch, size_t position, size_t depth) {
+    const BatchEntry *entry = &batch->entries[position];
+    int result = insertRecursive(tree, ref, entry->key, entry->keyLength, batch->values[entry->index], batch->valueLengths[entry->index], depth);
+    batch->stored += result != INVALID;
+    return result;
+}
+
+// End of the run of entries from first on that share their byte at depth
+static size_t batchRunEnd(const InsertBatch *batch, size_t first, size_t last, size_t depth) {
+    uint8_t byte = batchByteAt(batch, first, depth);
+    size_t end = first + 1;
+    while (end < last && batchByteAt(batch, end, depth) == byte) {
+        end++;
+    }
+    return end;
+}
+
+static size_t insertBatchBelow(ART *tree, Node **ref, InsertBatch *batch, size_t first, size_t last, size_t depth);
+
+// Entries [first, last) all match the prefix of the inner node in *ref.
+// The node is grown once to the size the whole run needs, then each run
+// of entries sharing the next byte goes down to its child together.
+static size_t insertBatchInner(ART *tree, Node **ref, InsertBatch *batch, size_t first, size_t last, size_t depth) {
+    Node *node = *ref;
+    depth += node->prefixLen;
+    sortBatchRun(batch, first, last, depth);
+
+    int missing = 0;
+    for (size_t i = first; i < last; i = batchRunEnd(batch, i, last, depth)) {
+        missing += findChildRef(node, batchByteAt(batch, i, depth)) == NULL;
+    }
+    if (missing > 0 && node->type != NODE256 && node->count + missing > (node->type == NODE4 ? 4 : node->type == NODE16 ? 16 : 48)) {
+        // Should this fail, makeChildRoom() still grows one step at a time
+        resizeNode(tree, ref, missing);
+        node = *ref;
+    }
+
+    size_t added = 0;
+    for (size_t i = first; i < last; ) {
+        uint8_t byte = batchByteAt(batch, i, depth);
+        size_t end = batchRunEnd(batch, i, last, depth);
+
+        // A missing child starts out as the leaf of the first entry that
+        // can be stored
+        Node **child = findChildRef(node, byte);
+        for (; child == NULL && i < end; i++) {
+            const BatchEntry *entry = &batch->entries[i];
+            if (!makeChildRoom(tree, ref)) {
+                continue;
+            }
+            node = *ref;
+            LeafNode *leaf = makeLeafAt(tree, entry->key, entry->keyLength, batch->values[entry->index], batch->valueLengths[entry->index], depth + 1);
+            if (leaf == NULL) {
+                continue;
+            }
+            node = addChild(node, &byte, (Node *)leaf);
+            node->subtreeSize++;
+            batch->stored++;
+            added++;
+            child = findChildRef(node, byte);
+        }
+
+        if (child != NULL && i < end) {
+            size_t below = insertBatchBelow(tree, child, batch, i, end, depth + 1);
+            node->subtreeSize += below;
+            added += below;
+        }
+        i = end;
+    }
+    return added;
+}
+
+// Inserts entries [first, last), which all belong below *ref at depth, and
+// returns how many of them were new keys. Entries the inner node in *ref
+// takes as a whole share its descent; the others are inserted one by one
+// from *ref, which also restructures the node for those that follow.
+static size_t insertBatchBelow(ART *tree, Node **ref, InsertBatch *batch, size_t first, size_t last, size_t depth) {
+    // A lone key has no descent to share
+    if (last - first == 1) {
+        return insertBatchEntry(tree, ref, batch, first, depth) == 1;
+    }
+
+    size_t added = 0;
+    if (last - first > 2 && (*ref == NULL || (*ref)->type == LEAF)) {
+        frontEarliestParting(batch, first, last, depth);
+    }
+    while (first < last) {
+        Node *node = *ref;
+        if (node != NULL && node->type != LEAF && node->type != BUCKET) {
+            size_t end = partitionBatchRun(batch, node, first, last, depth);
+            if (end > first) {
+                added += insertBatchInner(tree, ref, batch, first, end, depth);
+                first = end;
+                continue;
+            }
+        }
+        added += insertBatchEntry(tree, ref, batch, first++, depth) == 1;
+    }
+    return added;
+}
+
+/*** APPEND PATH ***/
+
+// Keys inserted in ascending order, such as timestamps, all go down the
+// right edge of the tree. Such an insert starts at the node of the append
+// path where it parts from the largest key, so it touches the last node
+// or two, and only the nodes above it have their counts bumped.
+
+static void freeAppendPath(AppendPath *path) {
+    if (path != NULL) {
+        free(path->maxKey);
+        free(path);
+    }
+}
+
+static bool setAppendMaxKey(AppendPath *path, const uint8_t *key, size_t keyLength) {
+    if (keyLength > path->maxKeyCapacity) {
+        uint8_t *maxKey = realloc(path->maxKey, keyLength);
+        if (maxKey == NULL) {
+            return false;
+        }
+        path->maxKey = maxKey;
+        path->maxKeyCapacity = keyLength;
+    }
+    memcpy(path->maxKey, key, keyLength);
+    path->maxKeyLength = keyLength;
+    return true;
+}
+
+// Slot of the child with the largest byte
+static Node **lastChildRef(Node *node) {
+    switch (node->type) {
+        case NODE4:
+            return &((Node4 *)node)->children[node->count - 1];
+        case NODE16:
+            return &((Node16 *)node)->children[node->count - 1];
+        default:
+            for (int byte = 255; byte >= 0; byte--) {
+                Node **child = findChildRef(node, byte);
+                if (child) {
+                    return child;
+                }
+            }
+            return NULL;
+    }
+}
+
+static Node *childBefore(Node *node, uint8_t byte) {
+    for (int before = byte - 1; before >= 0; before--) {
+        Node **child = findChildRef(node, before);
+        if (child) {
+            return *child;
+        }
+    }
+    return NULL;
+}
+
+// Ascending keys tend to give every node at one level the same fan-out,
+// so a full node on the path grows straight to the size of its left
+// sibling instead of one type at a time
+static void presizeAppendNode(const ART *tree, Node **ref, Node *parent, uint8_t byte) {
+    Node *node = *ref;
+    if (node->type == NODE256 || !isNodeFull(node)) {
+        return;
+    }
+    Node *sibling = childBefore(parent, byte);
+    if (sibling && sibling->type != LEAF && sibling->type != BUCKET && sibling->count > node->count) {
+        resizeNode(tree, ref, sibling->count - node->count);
+    }
+}
+
+// Extends the path from entry i down to key, which is the largest key
+static void appendPathFollow(const ART *tree, AppendPath *path, uint32_t i, const uint8_t *key, size_t keyLength) {
+    for (;; i++) {
+        Node *node = *path->refs[i];
+        if (node->type == LEAF || node->type == BUCKET) {
+            path->length = i + 1;
+            return;
+        }
+        if (i > 0) {
+            presizeAppendNode(tree, path->refs[i], *path->refs[i - 1], keyByteAt(key, keyLength, path->depths[i] - 1));
+            node = *path->refs[i];
+        }
+
+        size_t depth = path->depths[i] + node->prefixLen;
+        Node **child = findChildRef(node, keyByteAt(key, keyLength, depth));
+        if (child == NULL || i + 1 == APPEND_PATH_DEPTH) {
+            path->length = 0;
+            return;
+        }
+        path->refs[i + 1] = child;
+        path->depths[i + 1] = depth + 1;
+    }
+}
+
+// Walks down the right edge to find the largest key again
+static void appendPathFind(ART *tree, AppendPath *path) {
+    path->known = false;
+    path->length = 0;
+    Node **ref = &tree->root;
+    size_t depth = 0;
+    for (uint32_t i = 0; *ref != NULL && i < APPEND_PATH_DEPTH; i++) {
+        Node *node = *ref;
+        path->refs[i] = ref;
+        path->depths[i] = depth;
+
+        if (node->type == LEAF || node->type == BUCKET) {
+            const LeafNode *largest = (const LeafNode *)node;
+            if (node->type == BUCKET) {
+                const LeafBucket *bucket = (const LeafBucket *)node;
+                largest = bucket->leaves[0];
+                for (int j = 1; j < node->count; j++) {
+                    const LeafNode *leaf = bucket->leaves[j];
+                    if (compareKeys(leaf->key, leaf->keyLength, largest->key, largest->keyLength) > 0) {
+                        largest = leaf;
+                    }
+                }
+            }
+            if (setAppendMaxKey(path, largest->key, largest->keyLength)) {
+                path->known = true;
+                path->length = i + 1;
+            }
+            return;
+        }
+        depth += node->prefixLen + 1;
+        ref = lastChildRef(node);
+    }
+}
+
+// Inserts as insertRecursive() does from the root, but starts keys larger
+// than every other one on the append path
+static int insertAppending(ART *tree, const uint8_t *key, size_t keyLength, const void *value, size_t valueLength) {
+    // Suffix leaves do not hold the key the path compares with
+    AppendPath *path = tree->appendPath;
+    if (path == NULL && !(tree->flags & ART_LEAF_SUFFIX)) {
+        path = tree->appendPath = calloc(1, sizeof(AppendPath));
+    }
+    if (path == NULL || (tree->flags & ART_LEAF_SUFFIX)) {
+        return insertJumping(tree, key, keyLength, value, valueLength);
+    }
+
+    size_t parts = 0;
+    bool larger = false;
+    if (path->known) {
+        size_t shared = MIN(keyLength, path->maxKeyLength);
+        while (parts < shared && key[parts] == path->maxKey[parts]) {
+            parts++;
+        }
+        larger = parts < shared && key[parts] > path->maxKey[parts];
+    }
+    if (!larger) {
+        // Nodes on the path may be replaced, the largest key stays
+        int result = insertJumping(tree, key, keyLength, value, valueLength);
+        path->length = 0;
+        if (!path->known) {
+            appendPathFind(tree, path);
+        }
+        return result;
+    }
+
+    // The deepest node that starts at or above the byte where key parts
+    uint32_t start = 0;
+    if (path->length > 0) {
+        start = path->length - 1;
+        while (start > 0 && path->depths[start] > parts) {
+            start--;
+        }
+    } else {
+        path->refs[0] = &tree->root;
+        path->depths[0] = 0;
+    }
+
+    int result = insertRecursive(tree, path->refs[start], key, keyLength, value, valueLength, path->depths[start]);
+    if (result == INVALID) {
+        path->length = 0;
+        return result;
+    }
+    for (uint32_t i = 0; i < start && result == 1; i++) {
+        (*path->refs[i])->subtreeSize++;
+    }
+
+    if (!setAppendMaxKey(path, key, keyLength)) {
+        path->known = false;
+        path->length = 0;
+        return result;
+    }
+    appendPathFollow(tree, path, start, key, keyLength);
+    return result;
+}
+
+// Called after other changes to the tree. Nodes on the path may have been
+// replaced; when keys may have gone or come in bulk, the largest one has
+// to be found again too.
+static void appendPathChanged(ART *tree, bool largestChanged) {
+    if (tree->appendPath) {
+        tree->appendPath->length = 0;
+        tree->appendPath->known = tree->appendPath->known && !largestChanged;
+    }
+}
+
+/*** NODE PROMOTION ***/
+
+// Heats every inner node key passes on its way down
+static void heatPath(const ART *tree, const uint8_t *key, size_t keyLength) {
+    Node *node = tree->root;
+    size_t depth = 0;
+    while (node != NULL && node->type != LEAF && node->type != BUCKET) {
+        node->heat += node->heat < UINT8_MAX;
+        if (node->prefixLen) {
+            if (prefixMismatch(node, key, keyLength, depth) != node->prefixLen) {
+                return;
+            }
+            depth += node->prefixLen;
+        }
+        Node **child = findChildRef(node, keyByteAt(key, keyLength, depth++));
+        node = child ? *child : NULL;
+    }
+}
+
+static inline bool isPromotable(const Node *node) {
+    return node->type == NODE16 || node->type == NODE48;
+}
+
+// Counts the nodes competing for the budget by heat
+static void heatHistogram(Node *node, size_t *counts) {
+    if (node == NULL || node->type == LEAF || node->type == BUCKET) {
+        return;
+    }
+    if (node->promoted || isPromotable(node)) {
+        counts[node->heat]++;
+    }
+
+    uint8_t bytes[256];
+    Node *children[256];
+    int count = collectChildren(node, bytes, children);
+    for (int i = 0; i < count; i++) {
+        heatHistogram(children[i], counts);
+    }
+}
+
+// Gives nodes at least hot the Node256 form, takes it from promoted nodes
+// below hot and shrinks other nodes nobody looked up to their smallest
+// form, then halves every heat. Returns the nodes replaced.
+static size_t adaptSubtree(const ART *tree, Node **ref, unsigned hot) {
+    Node *node = *ref;
+    if (node == NULL || node->type == LEAF || node->type == BUCKET) {
+        return 0;
+    }
+
+    size_t changed = 0;
+    uint8_t heat = node->heat;
+    if (node->promoted && typeForCount(node->count) == NODE256) {
+        // Filled up to its form, it no longer counts against the budget
+        node->promoted = false;
+        tree->promotion->promoted--;
+    } else if (node->promoted && heat < hot) {
+        resizeNode(tree, ref, 0);
+    } else if (isPromotable(node) && heat >= hot) {
+        resizeNode(tree, ref, 256 - node->count);
+        if (*ref != node) {
+            (*ref)->promoted = true;
+            tree->promotion->promoted++;
+        }
+    } else if (heat == 0 && node->type > typeForCount(node->count)) {
+        resizeNode(tree, ref, 0);
+    }
+    changed += *ref != node;
+    node = *ref;
+    node->heat = heat / 2;
+
+    uint8_t bytes[256];
+    Node *children[256];
+    int count = collectChildren(node, bytes, children);
+    for (int i = 0; i < count; i++) {
+        changed += adaptSubtree(tree, findChildRef(node, bytes[i]), hot);
+    }
+    return changed;
+}
+
+/*** RANGE ITERATION ***/
+
+// Same pruning as deleteRange: subtrees inside the range are walked in
+// full, only the paths to the two bounds compare keys
+static int iterateRange(IterateState *state, Node *node, const KeyRange *range, size_t depth, bool loBound, bool hiBound) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (!loBound && !hiBound) {
+        return iterateNode(state, node, depth);
+    }
+
+    if (node->type == LEAF) {
+        LeafNode *leaf = (LeafNode *)node;
+        return leafInRange(state->tree, leaf, range, depth, loBound, hiBound) ? iterateLeaf(state, leaf, depth) : 0;
+    }
+
+    if (node->type == BUCKET) {
+        LeafBucket *bucket = (LeafBucket *)node;
+        int result = 0;
+        for (int i = 0; i < bucket->node.count && result == 0; i++) {
+            if (leafInRange(state->tree, bucket->leaves[i], range, depth, loBound, hiBound)) {
+                result = iterateLeaf(state, bucket->leaves[i], depth);
+            }
+        }
+        return result;
+    }
+
+    if (loBound) {
+        int order = compareWithBound(node->prefix, node->prefixLen, range->lo, range->loLength, depth);
+        if (order < 0) {
+            return 0;
+        }
+        loBound = order == 0;
+    }
+    if (hiBound) {
+        int order = compareWithBound(node->prefix, node->prefixLen, range->hi, range->hiLength, depth);
+        if (order > 0) {
+            return 0;
+        }
+        hiBound = order == 0;
+    }
+
+    if (!reservePath(state, depth + node->prefixLen)) {
+        return INVALID;
+    }
+    memcpy(state->path + depth, node->prefix, node->prefixLen);
+    depth += node->prefixLen;
+
+    uint8_t bytes[256];
+    Node *children[256];
+    int count = collectChildren(node, bytes, children);
+    int result = 0;
+
+    for (int i = 0; i < count && result == 0; i++) {
+        bool childLoBound = false;
+        bool childHiBound = false;
+
+        if (loBound && depth < range->loLength) {
+            if (bytes[i] < range->lo[depth]) {
+                continue;
+            }
+            childLoBound = bytes[i] == range->lo[depth];
+        }
+        if (hiBound) {
+            if (depth >= range->hiLength || bytes[i] > range->hi[depth]) {
+                break;
+            }
+            childHiBound = bytes[i] == range->hi[depth];
+        }
+
+        if (!reservePath(state, depth + 1)) {
+            return INVALID;
+        }
+        state->path[depth] = bytes[i];
+        result = iterateRange(state, children[i], range, depth + 1, childLoBound, childHiBound);
+    }
+
+    return result;
+}
+
+/*** SAMPLING ***/
+
+// Calls callback with the key of the given rank, 0 being the smallest.
+// The key counts kept by inner nodes lead straight down to it.
+static int selectRank(const ART *tree, size_t rank, ArtIterateFunc callback, void *data) {
+    IterateState state = { .tree = tree, .callback = callback, .data = data };
+    Node *node = tree->root;
+    size_t depth = 0;
+    int result = INVALID;
+
+    while (node != NULL) {
+        if (node->type == LEAF) {
+            result = iterateLeaf(&state, (LeafNode *)node, depth);
+            break;
+        }
+        if (node->type == BUCKET) {
+            result = iterateLeaf(&state, ((LeafBucket *)node)->leaves[rank], depth);
+            break;
+        }
+
+        if (!reservePath(&state, depth + node->prefixLen + 1)) {
+            break;
+        }
+        memcpy(state.path + depth, node->prefix, node->prefixLen);
+        depth += node->prefixLen;
+
+        uint8_t bytes[256];
+        Node *children[256];
+        int count = collectChildren(node, bytes, children);
+        Node *next = NULL;
+        for (int i = 0; i < count && next == NULL; i++) {
+            size_t below = keysBelow(children[i]);
+            if (rank < below) {
+                state.path[depth++] = bytes[i];
+                next = children[i];
+            } else {
+                rank -= below;
+            }
+        }
+        node = next;
+    }
+
+    free(state.path);
+    return result;
+}
+
+/*** EXPORT ***/
+
+typedef struct {
+    int fd;
+    uint8_t *buffer; // ART_EXPORT_BUFFER bytes
+    size_t length;
+    bool failed;
+} ExportOutput;
+
+// Writes all of iov, resuming after short writes and signals
+static bool writeVector(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static void exportFlush(ExportOutput *out) {
+    struct iovec iov = { .iov_base = out->buffer, .iov_len = out->length };
+    out->failed = out->failed || !writeVector(out->fd, &iov, 1);
+    out->length = 0;
+}
+
+static void exportBytes(ExportOutput *out, const void *data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (out->length + length <= ART_EXPORT_BUFFER) {
+        memcpy(out->buffer + out->length, data, length);
+        out->length += length;
+        return;
+    }
+
+    // Whatever does not fit goes out in the same system call as the
+    // buffered bytes, so large values are never copied
+    struct iovec iov[2] = {
+        { .iov_base = out->buffer, .iov_len = out->length },
+        { .iov_base = (void *)data, .iov_len = length }
+    };
+    out->failed = out->failed || !writeVector(out->fd, iov, 2);
+    out->length = 0;
+}
+
+static void exportEscaped(ExportOutput *out, const uint8_t *data, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        if (out->length + 4 > ART_EXPORT_BUFFER) {
+            exportFlush(out);
+        }
+        uint8_t byte = data[i];
+        if (byte >= 0x20 && byte < 0x7f && byte != '\\') {
+            out->buffer[out->length++] = byte;
+        } else {
+            uint8_t *escape = out->buffer + out->length;
+            escape[0] = '\\';
+            escape[1] = 'x';
+            escape[2] = hex[byte >> 4];
+            escape[3] = hex[byte & 0xf];
+            out->length += 4;
+        }
+    }
+}
+
+static void exportLength(ExportOutput *out, uint32_t length) {
+    uint8_t bytes[4] = { length, length >> 8, length >> 16, length >> 24 };
+    exportBytes(out, bytes, sizeof(bytes));
+}
+
+// Writes one record; in suffix mode the key is path followed by the leaf's bytes
+static void exportLeaf(const ART *tree, ExportOutput *out, ArtExportFormat format, const uint8_t *path, size_t depth, const LeafNode *leaf) {
+    const uint8_t *value = leafValue(tree, leaf);
+    if (!(tree->flags & ART_LEAF_SUFFIX)) {
+        depth = 0;
+    }
+
+    if (format == ART_EXPORT_BINARY) {
+        exportLength(out, depth + leaf->keyLength);
+        exportLength(out, leaf->valueLength);
+        exportBytes(out, path, depth);
+        exportBytes(out, leaf->key, leaf->keyLength);
+        exportBytes(out, value, leaf->valueLength);
+    } else {
+        exportEscaped(out, path, depth);
+        exportEscaped(out, leaf->key, leaf->keyLength);
+        exportBytes(out, "\t", 1);
+        exportEscaped(out, value, leaf->valueLength);
+        exportBytes(out, "\n", 1);
+    }
+}
+
+// Child of an inner node at or after *position in byte order, moving
+// *position past it; NULL once there are no more
+static Node *nextChild(Node *node, int *position, uint8_t *byte) {
+    switch (node->type) {
+        case NODE4:
+        case NODE16: {
+            uint8_t *keys = node->type == NODE4 ? ((Node4 *)node)->keys : ((Node16 *)node)->keys;
+            Node **children = node->type == NODE4 ? ((Node4 *)node)->children : ((Node16 *)node)->children;
+            if (*position >= node->count) {
+                return NULL;
+            }
+            *byte = keys[*position];
+            return children[(*position)++];
+        }
+        case NODE48: {
+            Node48 *node48 = (Node48 *)node;
+            for (int i = *position; i < 256; i++) {
+                if (node48->keys[i] != EMPTY_KEY) {
+                    *position = i + 1;
+                    *byte = i;
+                    return node48->children[node48->keys[i] - 1];
+                }
+            }
+            return NULL;
+        }
+        case NODE256: {
+            Node256 *node256 = (Node256 *)node;
+            for (int i = *position; i < 256; i++) {
+                if (node256->children[i] != NULL) {
+                    *position = i + 1;
+                    *byte = i;
+                    return node256->children[i];
+                }
+            }
+            return NULL;
+        }
+        default:
+            return NULL;
+    }
+}
+
+typedef struct {
+    Node *node;
+    size_t depth; // Key bytes above the node's children
+    int position; // Next child to visit
+} ExportFrame;
+
+// Depth first walk with its own stack, so deep trees cannot exhaust the
+// call stack. Returns the keys written, INVALID if memory or a write failed.
+static ssize_t exportTree(const ART *tree, ExportOutput *out, ArtExportFormat format, uint64_t now) {
+    IterateState path = { .tree = tree };
+    ExportFrame *stack = NULL;
+    size_t height = 0;
+    size_t capacity = 0;
+    ssize_t exported = 0;
+    Node *node = tree->root;
+    size_t depth = 0;
+
+    while (!out->failed) {
+        // Visit node, then move on to the next child of the deepest inner
+        // node that has one left
+        if (node != NULL && (node->type == LEAF || node->type == BUCKET)) {
+            LeafNode *leaf = (LeafNode *)node;
+            LeafNode **leaves = node->type == LEAF ? &leaf : ((LeafBucket *)node)->leaves;
+            int count = node->type == LEAF ? 1 : node->count;
+            for (int i = 0; i < count; i++) {
+                if (leaves[i]->expiresAt == 0 || leaves[i]->expiresAt > now) {
+                    exportLeaf(tree, out, format, path.path, depth, leaves[i]);
+                    exported++;
+                }
+            }
+        } else if (node != NULL) {
+            if (height == capacity) {
+                capacity = capacity ? capacity * 2 : 32;
+                ExportFrame *grown = realloc(stack, capacity * sizeof(ExportFrame));
+                if (!grown) {
+                    out->failed = true;
+                    break;
+                }
+                stack = grown;
+            }
+            if (!reservePath(&path, depth + node->prefixLen + 1)) {
+                out->failed = true;
+                break;
+            }
+            memcpy(path.path + depth, node->prefix, node->prefixLen);
+            stack[height++] = (ExportFrame){ .node = node, .depth = depth + node->prefixLen, .position = 0 };
+        }
+
+        node = NULL;
+        while (height > 0 && node == NULL) {
+            ExportFrame *frame = &stack[height - 1];
+            uint8_t byte;
+            node = nextChild(frame->node, &frame->position, &byte);
+            if (node == NULL) {
+                height--;
+            } else {
+                path.path[frame->depth] = byte;
+                depth = frame->depth + 1;
+            }
+        }
+        if (node == NULL) {
+            break;
+        }
+    }
+
+    free(stack);
+    free(path.path);
+    return out->failed ? INVALID : exported;
+}
+
+/*** EXPIRY ***/
+
+static uint64_t monotonicMillis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t currentMillis(const ART *tree) {
+    return tree->clock ? tree->clock() : monotonicMillis();
+}
+
+static TimerWheel *makeTimerWheel(uint64_t now) {
+    TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+    if (!wheel) {
+        return NULL;
+    }
+    wheel->tickMillis = TIMER_WHEEL_TICK_MILLIS;
+    wheel->tick = now / wheel->tickMillis;
+    return wheel;
+}
+
+static void freeTimerList(TimerEntry *entry) {
+    while (entry) {
+        TimerEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+static void freeTimerWheel(TimerWheel *wheel) {
+    if (wheel == NULL) {
+        return;
+    }
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < (1 << TIMER_WHEEL_BITS); slot++) {
+            freeTimerList(wheel->slots[level][slot]);
+        }
+    }
+    freeTimerList(wheel->due);
+    free(wheel);
+}
+
+// Files entry on the lowest level whose span still reaches its tick.
+// Expiries past the last level wait in its farthest slot and are filed
+// again when it cascades.
+static void timerWheelPlace(TimerWheel *wheel, TimerEntry *entry) {
+    uint64_t expiresTick = (entry->expiresAt + wheel->tickMillis - 1) / wheel->tickMillis;
+    if (expiresTick <= wheel->tick) {
+        entry->next = wheel->due;
+        wheel->due = entry;
+        return;
+    }
+
+    uint64_t delta = expiresTick - wheel->tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+        expiresTick = wheel->tick + (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    int slot = (expiresTick >> (TIMER_WHEEL_BITS * level)) & ((1 << TIMER_WHEEL_BITS) - 1);
+    entry->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = entry;
+    wheel->scheduled++;
+}
+
+static void timerWheelAdvance(TimerWheel *wheel, uint64_t nowTick) {
+    while (wheel->tick < nowTick) {
+        if (wheel->scheduled == 0) {
+            wheel->tick = nowTick;
+            break;
+        }
+
+        uint64_t tick = ++wheel->tick;
+        int mask = (1 << TIMER_WHEEL_BITS) - 1;
+
+        // Higher levels first, so that their entries can land in the
+        // lower level slots cascading at the same tick
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if (tick & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            TimerEntry **slot = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & mask];
+            TimerEntry *entry = *slot;
+            *slot = NULL;
+            while (entry) {
+                TimerEntry *next = entry->next;
+                wheel->scheduled--;
+                timerWheelPlace(wheel, entry);
+                entry = next;
+            }
+        }
+
+        TimerEntry **slot = &wheel->slots[0][tick & mask];
+        while (*slot) {
+            TimerEntry *entry = *slot;
+            *slot = entry->next;
+            entry->next = wheel->due;
+            wheel->due = entry;
+            wheel->scheduled--;
+        }
+    }
+}
+
+// Timer for key, with the wheel it goes on, NULL if out of memory
+static TimerEntry *makeTimerEntry(ART *tree, const uint8_t *key, size_t keyLength, uint64_t expiresAt, uint64_t now) {
+    if (tree->timers == NULL) {
+        tree->timers = makeTimerWheel(now);
+        if (tree->timers == NULL) {
+            return NULL;
+        }
+    }
+
+    TimerEntry *entry = malloc(sizeof(TimerEntry) + keyLength);
+    if (!entry) {
+        return NULL;
+    }
+    entry->expiresAt = expiresAt;
+    entry->keyLength = keyLength;
+    memcpy(entry->key, key, keyLength);
+    return entry;
+}
+
+static bool scheduleExpiry(ART *tree, const uint8_t *key, size_t keyLength, uint64_t expiresAt, uint64_t now) {
+    TimerEntry *entry = makeTimerEntry(tree, key, keyLength, expiresAt, now);
+    if (!entry) {
+        return false;
+    }
+    timerWheelPlace(tree->timers, entry);
+    return true;
+}
+
+/*** CURSORS ***/
+
+static bool cursorReserveKey(ArtCursor *cursor, size_t length) {
+    if (length <= cursor->keyCapacity) {
+        return true;
+    }
+
+    size_t capacity = cursor->keyCapacity ? cursor->keyCapacity : 64;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    uint8_t *key = realloc(cursor->key, capacity);
+    if (!key) {
+        return false;
+    }
+    cursor->key = key;
+    cursor->keyCapacity = capacity;
+    return true;
+}
+
+static bool cursorPush(ArtCursor *cursor, Node *node, size_t depth, int position) {
+    if (cursor->height == cursor->capacity) {
+        uint32_t capacity = cursor->capacity ? cursor->capacity * 2 : 16;
+        ArtCursorFrame *frames = realloc(cursor->frames, capacity * sizeof(ArtCursorFrame));
+        if (!frames) {
+            return false;
+        }
+        cursor->frames = frames;
+        cursor->capacity = capacity;
+    }
+    cursor->frames[cursor->height++] = (ArtCursorFrame){ .node = node, .depth = depth, .position = position };
+    return true;
+}
+
+// Makes leaf, reached at depth, the current key. The key bytes above depth
+// are already in place.
+static bool cursorLand(ArtCursor *cursor, LeafNode *leaf, size_t depth) {
+    size_t base = leafBase(cursor->tree, depth);
+    if (!cursorReserveKey(cursor, base + leaf->keyLength)) {
+        return false;
+    }
+    memcpy(cursor->key + base, leaf->key, leaf->keyLength);
+    cursor->keyLength = base + leaf->keyLength;
+    cursor->leaf = leaf;
+    return true;
+}
+
+// Goes down to the smallest key below node, which starts at depth. Like
+// the other cursor moves, returns false only when memory ran out.
+static bool cursorFirst(ArtCursor *cursor, Node *node, size_t depth) {
+    for (;;) {
+        if (node->type == LEAF) {
+            return cursorLand(cursor, (LeafNode *)node, depth);
+        }
+        if (node->type == BUCKET) {
+            return cursorPush(cursor, node, depth, 1) && cursorLand(cursor, ((LeafBucket *)node)->leaves[0], depth);
+        }
+
+        if (!cursorReserveKey(cursor, depth + node->prefixLen + 1)) {
+            return false;
+        }
+        int position = 0;
+        uint8_t byte;
+        Node *child = nextChild(node, &position, &byte);
+        if (!cursorPush(cursor, node, depth, position)) {
+            return false;
+        }
+        memcpy(cursor->key + depth, node->prefix, node->prefixLen);
+        depth += node->prefixLen;
+        cursor->key[depth++] = byte;
+        node = child;
+    }
+}
+
+// Moves on to the smallest key right of where the top frame was left, or
+// off the keys when there is none
+static bool cursorAdvance(ArtCursor *cursor) {
+    while (cursor->height > 0) {
+        ArtCursorFrame *frame = &cursor->frames[cursor->height - 1];
+        Node *node = frame->node;
+        if (node->type == BUCKET) {
+            if (frame->position < node->count) {
+                return cursorLand(cursor, ((LeafBucket *)node)->leaves[frame->position++], frame->depth);
+            }
+        } else {
+            uint8_t byte;
+            Node *child = nextChild(node, &frame->position, &byte);
+            if (child) {
+                size_t depth = frame->depth + node->prefixLen;
+                cursor->key[depth] = byte;
+                return cursorFirst(cursor, child, depth + 1);
+            }
+        }
+        cursor->height--;
+    }
+    cursor->leaf = NULL;
+    return true;
+}
+
+// nextChild() position of the first child with a byte of at least byte
+static int childPositionFrom(const Node *node, uint8_t byte) {
+    if (node->type == NODE4 || node->type == NODE16) {
+        const uint8_t *keys = node->type == NODE4 ? ((const Node4 *)node)->keys : ((const Node16 *)node)->keys;
+        int position = 0;
+        while (position < node->count && keys[position] < byte) {
+            position++;
+        }
+        return position;
+    }
+    return byte;
+}
+
+// Goes down to the smallest key below node, which starts at depth and
+// whose path matches key above depth, that is not smaller than key, or on
+// past node when there is none
+static bool cursorLowerBound(ArtCursor *cursor, Node *node, size_t depth, const uint8_t *key, size_t keyLength) {
+    for (;;) {
+        if (node->type == LEAF) {
+            if (!cursorLand(cursor, (LeafNode *)node, depth)) {
+                return false;
+            }
+            return compareKeys(cursor->key, cursor->keyLength, key, keyLength) >= 0 || cursorAdvance(cursor);
+        }
+        if (node->type == BUCKET) {
+            // Bucket leaves are sorted, the cursor goes on from the first
+            // one that is not smaller
+            LeafBucket *bucket = (LeafBucket *)node;
+            size_t base = leafBase(cursor->tree, depth);
+            int position = 0;
+            while (position < node->count) {
+                const LeafNode *leaf = bucket->leaves[position];
+                if (compareKeys(leaf->key, leaf->keyLength, key + base, keyLength - base) >= 0) {
+                    break;
+                }
+                position++;
+            }
+            return cursorPush(cursor, node, depth, position) && cursorAdvance(cursor);
+        }
+
+        int order = compareWithBound(node->prefix, node->prefixLen, key, keyLength, depth);
+        if (order != 0 || depth + node->prefixLen >= keyLength) {
+            // Every key below is larger, every key below is smaller, or
+            // every key below extends key
+            return order < 0 ? cursorAdvance(cursor) : cursorFirst(cursor, node, depth);
+        }
+
+        if (!cursorReserveKey(cursor, depth + node->prefixLen + 1)) {
+            return false;
+        }
+        uint8_t wanted = key[depth + node->prefixLen];
+        int position = childPositionFrom(node, wanted);
+        uint8_t byte;
+        Node *child = nextChild(node, &position, &byte);
+        if (child == NULL) {
+            return cursorAdvance(cursor);
+        }
+        if (!cursorPush(cursor, node, depth, position)) {
+            return false;
+        }
+        memcpy(cursor->key + depth, node->prefix, node->prefixLen);
+        depth += node->prefixLen;
+        cursor->key[depth++] = byte;
+        if (byte > wanted) {
+            return cursorFirst(cursor, child, depth);
+        }
+        node = child;
+    }
+}
+
+// Moves past expired keys as iteration skips them. Returns whether the
+// cursor is on a key.
+static bool cursorSkipExpired(ArtCursor *cursor) {
+    uint64_t now = 0;
+    while (cursor->leaf && cursor->leaf->expiresAt) {
+        now = now ? now : currentMillis(cursor->tree);
+        if (cursor->leaf->expiresAt > now) {
+            break;
+        }
+        if (!cursorAdvance(cursor)) {
+            cursor->height = 0;
+            cursor->leaf = NULL;
+        }
+    }
+    return cursor->leaf != NULL;
+}
+
+/*** WRITE BUFFERS ***/
+
+// Position of key among the pending inserts, or where it would go
+static size_t writeBufferFind(const ArtWriteBuffer *buffer, const uint8_t *key, size_t keyLength, bool *found) {
+    size_t low = 0;
+    size_t high = buffer->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = compareKeys(buffer->keys[middle], buffer->keyLengths[middle], key, keyLength);
+        if (order == 0) {
+            *found = true;
+            return middle;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *found = false;
+    return low;
+}
+
+// Block with a copy of key, then one of value when the tree copies values,
+// for a write held back from the tree. *kept is the value to pass on.
+static uint8_t *copyPendingWrite(const ART *tree, const void *key, size_t keyLength, const void *value, size_t valueLength, const void **kept) {
+    // Copied values are read in place, so they start aligned as the
+    // tree's own copies do
+    bool copy = tree->valuePolicy == ART_VALUE_COPY;
+    size_t valueAt = (keyLength + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    uint8_t *block = malloc(copy ? valueAt + valueLength : keyLength);
+    if (!block) {
+        return NULL;
+    }
+    memcpy(block, key, keyLength);
+    *kept = value;
+    if (copy && value != NULL) {
+        memcpy(block + valueAt, value, valueLength);
+        *kept = block + valueAt;
+    }
+    return block;
+}
+
+// Frees the block of a held back write, and its value when the tree would
+// have owned it
+static void releasePendingWrite(const ART *tree, const void *block, const void *value, const void *keptValue) {
+    if (tree->valuePolicy == ART_VALUE_OWN && value != NULL && value != keptValue) {
+        (tree->freeValue ? tree->freeValue : free)((void *)value);
+    }
+    free((void *)block);
+}
+
+static void writeBufferRelease(const ArtWriteBuffer *buffer, size_t i, const void *keptValue) {
+    releasePendingWrite(buffer->tree, buffer->keys[i], buffer->values[i], keptValue);
+}
+
+static bool writeBufferDue(const ArtWriteBuffer *buffer) {
+    return buffer->maxDelayMillis > 0 && buffer->count > 0 && currentMillis(buffer->tree) - buffer->oldest >= buffer->maxDelayMillis;
+}
+
+static inline void writeBufferLock(ArtWriteBuffer *buffer, bool exclusive) {
+    if (buffer->lock) {
+        buffer->lock->lock(buffer->lock, exclusive);
+    }
+}
+
+static inline void writeBufferUnlock(ArtWriteBuffer *buffer, bool exclusive) {
+    if (buffer->lock) {
+        buffer->lock->unlock(buffer->lock, exclusive);
+    }
+}
+
+/*** FLAT COMBINING ***/
+
+enum { COMBINE_IDLE, COMBINE_POSTED, COMBINE_DONE };
+
+static bool sameCombineKey(const ArtCombineSlot *a, const ArtCombineSlot *b) {
+    return a->keyLength == b->keyLength && memcmp(a->key, b->key, a->keyLength) == 0;
+}
+
+// Key order, posts of one key in slot order
+static int compareCombineSlots(const void *a, const void *b) {
+    const ArtCombineSlot *x = *(ArtCombineSlot *const *)a;
+    const ArtCombineSlot *y = *(ArtCombineSlot *const *)b;
+    int order = compareKeys(x->key, x->keyLength, y->key, y->keyLength);
+    return order ? order : (x > y) - (x < y);
+}
+
+// Posts of one pass all overlap in time, so any order of them is one the
+// threads could have seen. Inserts go first as one batch, of several
+// inserts of a key the last is stored and replaces the others at once.
+static void combineInserts(ArtCombiner *combiner, size_t count) {
+    ART *tree = combiner->tree;
+    size_t first = combiner->threads;
+    ArtCombineSlot *last = NULL;
+    for (size_t i = count; i-- > 0; ) {
+        ArtCombineSlot *slot = combiner->pending[i];
+        if (slot->op == ART_COMBINE_INSERT && (last == NULL || !sameCombineKey(slot, last))) {
+            last = slot;
+            first--;
+            combiner->keys[first] = slot->key;
+            combiner->keyLengths[first] = slot->keyLength;
+            combiner->values[first] = slot->value;
+            combiner->valueLengths[first] = slot->valueLength;
+        }
+    }
+    if (first == combiner->threads) {
+        return;
+    }
+
+    size_t batched = combiner->threads - first;
+    size_t stored = artInsertBatch(tree, combiner->keys + first, combiner->keyLengths + first, combiner->values + first, combiner->valueLengths + first, batched);
+    last = NULL;
+    for (size_t i = count; i-- > 0; ) {
+        ArtCombineSlot *slot = combiner->pending[i];
+        if (slot->op != ART_COMBINE_INSERT) {
+            continue;
+        }
+        if (last != NULL && sameCombineKey(slot, last)) {
+            // Replaced by last, whose value the tree took instead
+            slot->ok = last->ok;
+            if (slot->ok && tree->valuePolicy == ART_VALUE_OWN && slot->value != NULL && slot->value != last->value) {
+                (tree->freeValue ? tree->freeValue : free)((void *)slot->value);
+            }
+            continue;
+        }
+        last = slot;
+        LeafNode *leaf = stored < batched ? findLeaf(tree, slot->key, slot->keyLength) : NULL;
+        slot->ok = stored == batched || (leaf != NULL && (tree->valuePolicy != ART_VALUE_OWN || leafValue(tree, leaf) == slot->value));
+    }
+}
+
+// Applies every posted operation and hands the results back. Sorted, the
+// deletes and searches of a pass follow one another down shared paths.
+static void combinePass(ArtCombiner *combiner) {
+    size_t count = 0;
+    for (size_t i = 0; i < combiner->threads; i++) {
+        if (atomic_load_explicit(&combiner->slots[i].state, memory_order_acquire) == COMBINE_POSTED) {
+            combiner->pending[count++] = &combiner->slots[i];
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    qsort(combiner->pending, count, sizeof(ArtCombineSlot *), compareCombineSlots);
+
+    ART *tree = combiner->tree;
+    if (combiner->lock) {
+        combiner->lock->lock(combiner->lock, true);
+    }
+    combineInserts(combiner, count);
+
+    size_t searches = 0;
+    for (size_t i = 0; i < count; i++) {
+        ArtCombineSlot *slot = combiner->pending[i];
+        if (slot->op == ART_COMBINE_DELETE) {
+            slot->ok = artDelete(tree, slot->key, slot->keyLength);
+        } else if (slot->op == ART_COMBINE_SEARCH) {
+            combiner->keys[searches] = slot->key;
+            combiner->keyLengths[searches++] = slot->keyLength;
+        }
+    }
+    if (searches > 0) {
+        void **found = (void **)combiner->values;
+        artSearchBatch(tree, combiner->keys, combiner->keyLengths, searches, found);
+        searches = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (combiner->pending[i]->op == ART_COMBINE_SEARCH) {
+                combiner->pending[i]->result = found[searches++];
+            }
+        }
+    }
+    if (combiner->lock) {
+        combiner->lock->unlock(combiner->lock, true);
+    }
+
+    combiner->passes++;
+    combiner->applied += count;
+    for (size_t i = 0; i < count; i++) {
+        atomic_store_explicit(&combiner->pending[i]->state, COMBINE_DONE, memory_order_release);
+    }
+}
+
+// Posts an operation in the slot of thread and waits for a combiner to
+// apply it, becoming the combiner whenever there is none
+static ArtCombineSlot *combine(ArtCombiner *combiner, size_t thread, ArtCombineOp op, const void *key, size_t keyLength, const void *value, size_t valueLength) {
+    ArtCombineSlot *slot = &combiner->slots[thread];
+    slot->op = op;
+    slot->key = key;
+    slot->keyLength = keyLength;
+    slot->value = value;
+    slot->valueLength = valueLength;
+    slot->result = NULL;
+    slot->ok = false;
+    atomic_store_explicit(&slot->state, COMBINE_POSTED, memory_order_release);
+
+    while (atomic_load_explicit(&slot->state, memory_order_acquire) != COMBINE_DONE) {
+        if (!atomic_flag_test_and_set_explicit(&combiner->busy, memory_order_acquire)) {
+            combinePass(combiner);
+            atomic_flag_clear_explicit(&combiner->busy, memory_order_release);
+        } else {
+            sched_yield();
+        }
+    }
+    atomic_store_explicit(&slot->state, COMBINE_IDLE, memory_order_relaxed);
+    return slot;
+}
+
+/*** TRANSACTIONS ***/
+
+static inline void txnLock(ArtTxn *txn, bool exclusive) {
+    if (txn->lock) {
+        txn->lock->lock(txn->lock, exclusive);
+    }
+}
+
+static inline void txnUnlock(ArtTxn *txn, bool exclusive) {
+    if (txn->lock) {
+        txn->lock->unlock(txn->lock, exclusive);
+    }
+}
+
+// Latest write of the transaction to key, NULL if there is none. Writes
+// are few, so they are scanned.
+static ArtTxnWrite *txnFindWrite(const ArtTxn *txn, const void *key, size_t keyLength) {
+    for (size_t i = 0; i < txn->writeCount; i++) {
+        ArtTxnWrite *write = &txn->writes[i];
+        if (write->keyLength == keyLength && memcmp(write->key, key, keyLength) == 0) {
+            return write;
+        }
+    }
+    return NULL;
+}
+
+static bool txnGrow(void **array, size_t *capacity, size_t size) {
+    size_t grown = *capacity ? 2 * *capacity : 4;
+    void *larger = realloc(*array, grown * size);
+    if (!larger) {
+        return false;
+    }
+    *array = larger;
+    *capacity = grown;
+    return true;
+}
+
+// Records a write of key, replacing an earlier one of the same key
+static bool txnWrite(ArtTxn *txn, const void *key, size_t keyLength, const void *value, size_t valueLength, bool deleted) {
+    const void *kept = NULL;
+    uint8_t *block = copyPendingWrite(txn->tree, key, keyLength, deleted ? NULL : value, valueLength, &kept);
+    if (!block) {
+        return false;
+    }
+
+    ArtTxnWrite *write = txnFindWrite(txn, key, keyLength);
+    if (write) {
+        releasePendingWrite(txn->tree, write->key, write->value, kept);
+    } else {
+        if (txn->writeCount == txn->writeCapacity && !txnGrow((void **)&txn->writes, &txn->writeCapacity, sizeof(ArtTxnWrite))) {
+            free(block);
+            return false;
+        }
+        write = &txn->writes[txn->writeCount++];
+    }
+    *write = (ArtTxnWrite){ .key = block, .keyLength = keyLength, .value = kept, .valueLength = valueLength, .deleted = deleted };
+    return true;
+}
+
+// Whether the tree holds a key that key is a prefix of, or one that is a
+// prefix of key, for which artInsert() refuses key. key is not in the
+// tree, whose leaves hold whole keys as transactions need.
+static bool treeHasPrefixPair(const ART *tree, const uint8_t *key, size_t keyLength) {
+    Node *node = tree->root;
+    size_t depth = 0;
+    while (node != NULL) {
+        if (node->type == LEAF) {
+            const LeafNode *leaf = (const LeafNode *)node;
+            return memcmp(leaf->key, key, MIN(leaf->keyLength, keyLength)) == 0;
+        }
+        if (node->type == BUCKET) {
+            return bucketHasPrefixPair(tree, (const LeafBucket *)node, key, keyLength, depth);
+        }
+
+        uint32_t matched = prefixMismatch(node, key, keyLength, depth);
+        if (depth + matched >= keyLength) {
+            // key ends on the path of every key below
+            return true;
+        }
+        if (matched < node->prefixLen) {
+            return false;
+        }
+        depth += node->prefixLen;
+        Node **child = findChildRef(node, key[depth]);
+        node = child ? *child : NULL;
+        depth++;
+    }
+    return false;
+}
+
+// Whether artInsert() would refuse a value the transaction puts for any
+// reason but memory: a length it cannot store, or a new key that is a
+// prefix of a stored key, of another new key, or the other way round.
+// Marks the writes of new keys added.
+static bool txnRefused(ArtTxn *txn) {
+    const ART *tree = txn->tree;
+    for (size_t i = 0; i < txn->writeCount; i++) {
+        ArtTxnWrite *write = &txn->writes[i];
+        write->added = !write->deleted && findLeaf(tree, write->key, write->keyLength) == NULL;
+        if (write->deleted) {
+            continue;
+        }
+        if (write->valueLength > UINT32_MAX) {
+            return true;
+        }
+        if (!write->added) {
+            continue;
+        }
+        if (treeHasPrefixPair(tree, write->key, write->keyLength)) {
+            return true;
+        }
+        for (size_t j = 0; j < i; j++) {
+            const ArtTxnWrite *other = &txn->writes[j];
+            if (other->added && memcmp(other->key, write->key, MIN(other->keyLength, write->keyLength)) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Applies the writes of a validated transaction, all of them or none.
+// Refusals are looked for and replacing values is made ready before the
+// tree changes, so that only new keys may then fail, when memory runs
+// out. Those go in first with watches and key versions set aside, and
+// come out again unseen should one fail; their notices follow once every
+// write is in.
+static bool txnApply(ArtTxn *txn) {
+    ART *tree = txn->tree;
+    bool own = tree->valuePolicy == ART_VALUE_OWN;
+    if (txnRefused(txn)) {
+        return false;
+    }
+    ReplacedValue *replaced = malloc(txn->writeCount * sizeof(ReplacedValue));
+    if (!replaced) {
+        return false;
+    }
+
+    size_t prepared = 0;
+    for (; prepared < txn->writeCount; prepared++) {
+        const ArtTxnWrite *write = &txn->writes[prepared];
+        if (write->deleted || write->added) {
+            continue;
+        }
+        LeafNode *leaf = findLeaf(tree, write->key, write->keyLength);
+        if (!prepareReplace(tree, leaf, write->key, write->keyLength, write->value, write->valueLength, &replaced[prepared])) {
+            break;
+        }
+    }
+
+    WatchTable *watches = tree->watches;
+    KeyVersions *versions = tree->versions;
+    tree->watches = NULL;
+    tree->versions = NULL;
+    bool failed = prepared < txn->writeCount;
+    size_t inserted = 0;
+    while (!failed && inserted < txn->writeCount) {
+        const ArtTxnWrite *write = &txn->writes[inserted];
+        failed = write->added && !artInsert(tree, write->key, write->keyLength, write->value, write->valueLength);
+        inserted += !failed;
+    }
+    if (failed) {
+        while (inserted-- > 0) {
+            ArtTxnWrite *write = &txn->writes[inserted];
+            if (write->added) {
+                // Deleting the key destroys an owned value with it
+                artDelete(tree, write->key, write->keyLength);
+                write->value = own ? NULL : write->value;
+            }
+        }
+        while (prepared-- > 0) {
+            const ArtTxnWrite *write = &txn->writes[prepared];
+            if (!write->deleted && !write->added) {
+                cancelReplace(tree, write->key, write->keyLength, &replaced[prepared]);
+            }
+        }
+    }
+    tree->watches = watches;
+    tree->versions = versions;
+    if (failed) {
+        free(replaced);
+        return false;
+    }
+
+    for (size_t i = 0; i < txn->writeCount; i++) {
+        ArtTxnWrite *write = &txn->writes[i];
+        if (write->deleted) {
+            artDelete(tree, write->key, write->keyLength);
+            continue;
+        }
+
+        LeafNode *leaf = findLeaf(tree, write->key, write->keyLength);
+        if (write->added) {
+            bumpKeyVersion(tree, write->key, write->keyLength);
+            if (tree->watches) {
+                notifyWatches(tree, ART_WATCH_INSERT, write->key, write->keyLength, leafValue(tree, leaf));
+            }
+        } else {
+            finishReplace(tree, leaf, write->key, write->keyLength, &replaced[i]);
+        }
+        if (own) {
+            // The tree owns the value now
+            write->value = NULL;
+        }
+    }
+    free(replaced);
+    return true;
+}
+
+// Releases what the transaction holds, including owned values that did
+// not reach the tree
+static void txnEnd(ArtTxn *txn) {
+    for (size_t i = 0; i < txn->writeCount; i++) {
+        releasePendingWrite(txn->tree, txn->writes[i].key, txn->writes[i].value, NULL);
+    }
+    free(txn->reads);
+    free(txn->writes);
+    txn->tree = NULL;
+}
+
+/*** TREE API ***/
+
+bool artSetLeafBuckets(ART *tree, int capacity) {
+    if (tree == NULL) {
+        return false;
+    }
+    if (capacity != 0 && (capacity < MIN_BUCKET_CAPACITY || capacity > MAX_BUCKET_CAPACITY)) {
+        return false;
+    }
+
+    // Buckets already in the tree keep the capacity they were created with
+    tree->bucketCapacity = capacity;
+    return true;
+}
+
+bool artSetLeafSuffixes(ART *tree, bool enabled) {
+    // Leaves of both layouts cannot be mixed in one tree, and the hash
+    // index, filters, front cache, key versions, version history and
+    // watches need whole keys in their leaves
+    if (tree == NULL || tree->root != NULL || (enabled && (tree->hashIndex || tree->filters || tree->frontCache || tree->versions || tree->history || tree->watches))) {
+        return false;
+    }
+
+    if (enabled) {
+        tree->flags |= ART_LEAF_SUFFIX;
+    } else {
+        tree->flags &= ~ART_LEAF_SUFFIX;
+    }
+    return true;
+}
+
+// Keeps a hash table of all leaves next to the tree, so that artSearch()
+// and artSearchBatch() find a key in one or two memory accesses instead of
+// a descent. Costs a table update on every insert and delete; the ordered
+// operations still use the tree. Not available with leaf suffixes.
+bool artSetHashIndex(ART *tree, bool enabled) {
+    if (tree == NULL || (enabled && (tree->flags & ART_LEAF_SUFFIX))) {
+        return false;
+    }
+    if (!enabled || tree->hashIndex) {
+        if (!enabled) {
+            freeHashIndex(tree->hashIndex);
+            tree->hashIndex = NULL;
+        }
+        return true;
+    }
+
+    HashIndex *index = makeHashIndex(tree->size);
+    if (index == NULL || !hashIndexAddSubtree(index, tree->root)) {
+        freeHashIndex(index);
+        return false;
+    }
+    tree->hashIndex = index;
+    return true;
+}
+
+// Keeps a small Bloom filter for each subtree below the root, so that
+// artSearch() and artSearchBatch() turn most absent keys away after one
+// cache line instead of a descent. Filters follow inserts and deletes and
+// are rebuilt one at a time when they fill up or hold too many deleted
+// keys. Enable them once the tree holds keys, as the byte that picks the
+// filter is fixed by the root's prefix then. Not available with leaf
+// suffixes.
+bool artSetSubtreeFilters(ART *tree, bool enabled) {
+    if (tree == NULL || (enabled && (tree->flags & ART_LEAF_SUFFIX))) {
+        return false;
+    }
+    if (!enabled || tree->filters) {
+        if (!enabled) {
+            freeSubtreeFilters(tree->filters);
+            tree->filters = NULL;
+        }
+        return true;
+    }
+
+    // Keys are split on the byte the root's children stand for
+    SubtreeFilters *filters = calloc(1, sizeof(SubtreeFilters));
+    if (filters == NULL) {
+        return false;
+    }
+    Node *root = tree->root;
+    filters->depth = root && root->type != LEAF && root->type != BUCKET ? root->prefixLen : 0;
+
+    filterWalk(filters, root, 0, -1, true);
+    for (int i = 0; i < 256; i++) {
+        SubtreeFilter *filter = &filters->filters[i];
+        if (filter->keys > 0) {
+            filter->blockCount = filterBlocksFor(filter->keys);
+            filter->blocks = calloc(filter->blockCount * 8, sizeof(uint64_t));
+            if (!filter->blocks) {
+                freeSubtreeFilters(filters);
+                return false;
+            }
+        }
+    }
+    filterWalk(filters, root, 0, -1, false);
+    tree->filters = filters;
+    return true;
+}
+
+// Keeps the leaves of the keys artSearch() finds most often in a table of
+// slots entries, rounded up to a power of two, so that a few hot keys are
+// answered without a descent. Deleting a key takes its leaf out
+// of the cache at once. Changing the size starts an empty cache, 0 turns
+// it off. Not available with leaf suffixes.
+bool artSetFrontCache(ART *tree, size_t slots) {
+    if (tree == NULL || slots > FRONT_CACHE_MAX_SLOTS || (slots > 0 && (tree->flags & ART_LEAF_SUFFIX))) {
+        return false;
+    }
+
+    FrontCache *cache = NULL;
+    if (slots > 0) {
+        cache = makeFrontCache(slots);
+        if (cache == NULL) {
+            return false;
+        }
+    }
+    freeFrontCache(tree->frontCache);
+    tree->frontCache = cache;
+    return true;
+}
+
+// Indexes the child slots of the top depth levels, 1 or 2, by the leading
+// key bytes, so that inserts and lookups of keys at least depth bytes
+// long skip those levels. Pays off for evenly spread keys such as hashes
+// or random ids, whose top levels are full Node256s anyway; below other
+// nodes keys take the usual way from the root. 0 turns the table off.
+bool artSetJumpTable(ART *tree, int depth) {
+    if (tree == NULL || depth < 0 || depth > JUMP_TABLE_MAX_DEPTH) {
+        return false;
+    }
+
+    JumpTable *table = NULL;
+    if (depth > 0) {
+        table = makeJumpTable(depth);
+        if (table == NULL) {
+            return false;
+        }
+        jumpTableBuild(table, tree->root);
+    }
+    freeJumpTable(tree->jumpTable);
+    tree->jumpTable = table;
+    return true;
+}
+
+// Lets lookups choose the node types on their paths. One artSearch() in
+// NODE_HEAT_SAMPLE that descends heats the inner nodes it passes, and
+// artAdaptNodes() turns the hottest Node16 and Node48 into Node256s, which
+// find a child without a compare, as far as budgetBytes of Node256s go.
+// 0 turns promotion off and shrinks promoted nodes back.
+bool artSetNodePromotion(ART *tree, size_t budgetBytes) {
+    if (tree == NULL) {
+        return false;
+    }
+    if (budgetBytes == 0) {
+        if (tree->promotion) {
+            tree->promotion->budget = 0;
+            artAdaptNodes(tree);
+            free(tree->promotion);
+            tree->promotion = NULL;
+        }
+        return true;
+    }
+
+    if (tree->promotion == NULL) {
+        tree->promotion = calloc(1, sizeof(NodePromotion));
+        if (tree->promotion == NULL) {
+            return false;
+        }
+        tree->promotion->countdown = NODE_HEAT_SAMPLE;
+    }
+    tree->promotion->budget = budgetBytes / sizeof(Node256);
+    return true;
+}
+
+// Keeps write counters for keys hashed onto stripes, a power of two of at
+// least KEY_VERSIONS_MIN_STRIPES, so that transactions can tell whether
+// what they read changed before they commit. More stripes mean fewer
+// transactions aborted by writes to other keys of their stripe. 0 turns
+// transactions off; neither is allowed while transactions are open.
+bool artSetTransactions(ART *tree, size_t stripes) {
+    if (tree == NULL || stripes > KEY_VERSIONS_MAX_STRIPES || (stripes > 0 && (tree->flags & ART_LEAF_SUFFIX))) {
+        return false;
+    }
+
+    KeyVersions *versions = NULL;
+    if (stripes > 0) {
+        versions = makeKeyVersions(stripes);
+        if (versions == NULL) {
+            return false;
+        }
+    }
+    freeKeyVersions(tree->versions);
+    tree->versions = versions;
+    return true;
+}
+
+// Keeps the values that writes replace or delete for as long as a
+// snapshot taken before the write is open, so that readers can see the
+// tree as of their snapshot. Values stay where they are in the tree, only
+// their past is kept aside. Needs whole keys in leaves and no value log;
+// it cannot be turned off while snapshots are open.
+bool artSetVersioning(ART *tree, bool enabled) {
+    if (tree == NULL || (enabled && (tree->flags & ART_LEAF_SUFFIX || tree->valueLog))) {
+        return false;
+    }
+    if (!enabled) {
+        if (tree->history && tree->history->readerCount > 0) {
+            return false;
+        }
+        freeVersionHistory(tree, tree->history);
+        tree->history = NULL;
+        return true;
+    }
+
+    if (tree->history == NULL) {
+        tree->history = makeVersionHistory();
+    }
+    return tree->history != NULL;
+}
+
+// Values of every policy cannot be told apart, so the policy can only be
+// chosen while the tree is empty. freeValue is only used by ART_VALUE_OWN.
+bool artSetValuePolicy(ART *tree, ArtValuePolicy policy, FreeValueFunc freeValue) {
+    if (tree == NULL || tree->root != NULL) {
+        return false;
+    }
+
+    tree->valuePolicy = policy;
+    tree->freeValue = freeValue;
+    return true;
+}
+
+// Lets freeART() hand owned values over in batches of up to ART_FREE_BATCH
+void artSetBulkFree(ART *tree, ArtBulkFreeFunc bulkFree, void *data) {
+    if (tree != NULL) {
+        tree->bulkFree = bulkFree;
+        tree->bulkFreeData = data;
+    }
+}
+
+// Refuses a key that is a prefix of a stored key or the other way round,
+// which includes keys differing only in trailing zero bytes
+// Under ART_VALUE_OWN the tree takes value over only when this succeeds
+bool artInsert(ART *tree, const void *key, size_t keyLength, const void *value, size_t valueLength) {
+    if (tree == NULL || key == NULL || keyLength == 0) {
+        return false;
+    }
+
+    int result = insertAppending(tree, key, keyLength, value, valueLength);
+    if (result == INVALID) {
+        return false;
+    }
+
+    tree->size += result;
+    if (tree->filters) {
+        refreshFilters(tree, keyByteAt(key, keyLength, tree->filters->depth));
+    }
+    return true;
+}
+
+// Inserts count keys at once and returns how many were stored. Keys that
+// share a path descend it together, sorted radix style one byte per node
+// on the way down, and every node is grown at most once, straight to the
+// size the batch needs. Sorted input skips the sorting; when a key comes
+// more than once the last value is kept.
+size_t artInsertBatch(ART *tree, const void *const *keys, const size_t *keyLengths, const void *const *values, const size_t *valueLengths, size_t count) {
+    if (tree == NULL || keys == NULL || keyLengths == NULL || values == NULL || valueLengths == NULL || count == 0) {
+        return 0;
+    }
+
+    BatchEntry *entries = malloc(2 * count * sizeof(BatchEntry));
+    if (!entries) {
+        return 0;
+    }
+    size_t valid = 0;
+    for (size_t i = 0; i < count; i++) {
+        // Keys artInsert() would refuse are left out
+        if (keys[i] != NULL && keyLengths[i] > 0) {
+            entries[valid++] = (BatchEntry){ .key = keys[i], .keyLength = keyLengths[i], .index = i };
+        }
+    }
+
+    InsertBatch batch = { .entries = entries, .scratch = entries + count, .values = values, .valueLengths = valueLengths, .stored = 0 };
+    historyHold(tree);
+    tree->size += insertBatchBelow(tree, &tree->root, &batch, 0, valid, 0);
+    historyRelease(tree);
+    refreshFilters(tree, -1);
+    appendPathChanged(tree, true);
+    if (tree->jumpTable) {
+        // Nodes only grew, the batch went in from the root
+        tree->jumpTable->misses += valid;
+    }
+    free(entries);
+    return batch.stored;
+}
+
+void *artSearch(ART *tree, const void *key, size_t keyLength) {
+    if (tree == NULL || key == NULL) {
+        return NULL;
+    }
+
+    uint64_t hash = 0;
+    if (tree->frontCache || tree->hashIndex) {
+        hash = hashKey(key, keyLength);
+    }
+    LeafNode *leaf = NULL;
+    if (tree->frontCache) {
+        leaf = frontCacheFind(tree->frontCache, key, keyLength, hash);
+    }
+
+    // The filters only pay off when they save a descent
+    if (leaf == NULL) {
+        if (tree->hashIndex) {
+            leaf = hashIndexFind(tree->hashIndex, key, keyLength, hash);
+        } else {
+            // Only lookups that descend tell which nodes pay for a Node256
+            NodePromotion *promotion = tree->promotion;
+            if (promotion && --promotion->countdown == 0) {
+                promotion->countdown = NODE_HEAT_SAMPLE;
+                heatPath(tree, key, keyLength);
+            }
+            leaf = tree->filters ? findLeafFiltered(tree, key, keyLength) : findLeaf(tree, key, keyLength);
+        }
+        if (leaf == NULL) {
+            return NULL;
+        }
+        if (tree->frontCache) {
+            frontCacheOffer(tree->frontCache, hash, leaf);
+        }
+    }
+
+    // Only keys with a TTL pay for reading the clock
+    if (leaf->expiresAt && leaf->expiresAt <= currentMillis(tree)) {
+        artDelete(tree, key, keyLength);
+        return NULL;
+    }
+    return leafValue(tree, leaf);
+}
+
+// Looks up count keys at once, storing each value or NULL in values, and
+// returns how many were found. Lookups advance in groups one node at a
+// time, so the cache misses of a group overlap instead of queueing up.
+// With a hash index the table slots of a group are fetched together
+// instead. Unlike artSearch() the tree is never modified, expired keys
+// just read as missing, so concurrent batches only need a shared lock.
+size_t artSearchBatch(ART *tree, const void *const *keys, const size_t *keyLengths, size_t count, void **values) {
+    if (tree == NULL || keys == NULL || keyLengths == NULL || values == NULL) {
+        return 0;
+    }
+
+    size_t found = 0;
+    uint64_t now = 0;
+    ArtLookup states[ART_BATCH_GROUP];
+
+    for (size_t base = 0; base < count; base += ART_BATCH_GROUP) {
+        int group = MIN(count - base, (size_t)ART_BATCH_GROUP);
+        if (tree->hashIndex) {
+            // Fetch the slots of the whole group before probing any
+            HashIndex *index = tree->hashIndex;
+            uint64_t hashes[ART_BATCH_GROUP];
+            for (int i = 0; i < group; i++) {
+                hashes[i] = hashKey(keys[base + i], keyLengths[base + i]);
+                __builtin_prefetch(&index->slots[hashes[i] & index->mask]);
+            }
+            for (int i = 0; i < group; i++) {
+                __builtin_prefetch(index->slots[hashes[i] & index->mask].leaf);
+            }
+            for (int i = 0; i < group; i++) {
+                states[i].leaf = hashIndexFind(index, keys[base + i], keyLengths[base + i], hashes[i]);
+            }
+        } else {
+            uint64_t hashes[ART_BATCH_GROUP];
+            for (int i = 0; i < group; i++) {
+                lookupStart(tree, &states[i], keys[base + i], keyLengths[base + i]);
+                if (tree->filters) {
+                    hashes[i] = hashKey(keys[base + i], keyLengths[base + i]);
+                    const SubtreeFilter *filter = filterFor(tree->filters, keys[base + i], keyLengths[base + i]);
+                    if (filter->blocks != NULL) {
+                        __builtin_prefetch(filterBlock(filter, hashes[i]));
+                    }
+                }
+            }
+            // Keys the filters rule out finish before their first step
+            for (int i = 0; i < group && tree->filters; i++) {
+                if (!filterMayContain(tree->filters, keys[base + i], keyLengths[base + i], hashes[i])) {
+                    states[i].node = NULL;
+                }
+            }
+        }
+
+        for (int active = tree->hashIndex ? 0 : group; active > 0; ) {
+            active = 0;
+            for (int i = 0; i < group; i++) {
+                if (states[i].node != NULL && !lookupStep(tree, &states[i])) {
+                    active++;
                 }
+            }
+        }
+
+        for (int i = 0; i < group; i++) {
+            LeafNode *leaf = states[i].leaf;
+            if (leaf != NULL && leaf->expiresAt) {
+                now = now ? now : currentMillis(tree);
+                leaf = leaf->expiresAt <= now ? NULL : leaf;
+            }
+            values[base + i] = leaf ? leafValue(tree, leaf) : NULL;
+            found += leaf != NULL;
+        }
+    }
+
+    return found;
+}
+
+// Resumable lookups. Each artLookupStep() call handles one node and
+// prefetches the next, so a caller can switch to other work, typically
+// other lookups, while that node is on its way from memory.
+void artLookupStart(ART *tree, ArtLookup *lookup, const void *key, size_t keyLength) {
+    lookupStart(tree, lookup, key, keyLength);
+}
+
+// Returns true once the lookup has finished and artLookupValue() is valid
+bool artLookupStep(ART *tree, ArtLookup *lookup) {
+    return lookupStep(tree, lookup);
+}
+
+// The value found by a finished lookup, NULL if the key is missing or has
+// expired. Like artSearchBatch() this never modifies the tree.
+void *artLookupValue(ART *tree, const ArtLookup *lookup) {
+    LeafNode *leaf = lookup->leaf;
+    if (leaf == NULL || (leaf->expiresAt && leaf->expiresAt <= currentMillis(tree))) {
+        return NULL;
+    }
+    return leafValue(tree, leaf);
+}
+
+// Keeps up to width lookups in flight, round robin. Keys are pulled from
+// next until it returns false, and done is called with each result as
+// soon as that lookup finishes, so a slow lookup does not hold back the
+// ones started after it. Returns the number of keys found.
+size_t artLookupInterleaved(ART *tree, size_t width, ArtLookupSource next, ArtLookupDone done, void *data) {
+    if (tree == NULL || next == NULL || done == NULL) {
+        return 0;
+    }
+
+    ArtLookup lookups[ART_MAX_INTERLEAVE];
+    width = MIN(width ? width : 1, (size_t)ART_MAX_INTERLEAVE);
+    size_t active = 0;
+    size_t found = 0;
+    bool more = true;
+
+    for (;;) {
+        // Refill free slots, slots are kept packed at the front
+        while (more && active < width) {
+            const void *key;
+            size_t keyLength;
+            void *context = NULL;
+            if (!(more = next(data, &key, &keyLength, &context))) {
+                break;
+            }
+            lookupStart(tree, &lookups[active], key, keyLength);
+            lookups[active].context = context;
+            active++;
+        }
+        if (active == 0) {
+            break;
+        }
+
+        for (size_t i = 0; i < active; ) {
+            if (!lookupStep(tree, &lookups[i])) {
+                i++;
+                continue;
+            }
+            void *value = artLookupValue(tree, &lookups[i]);
+            found += value != NULL;
+            done(data, lookups[i].context, value);
+            lookups[i] = lookups[--active];
+        }
+    }
+
+    return found;
+}
+
+// Values of at least threshold bytes inserted from now on are appended to
+// a log of segmentSize byte segments instead of being allocated one by one.
+// Pointers returned by artSearch() for them stay valid until the value is
+// replaced or its segment is collected.
+bool artSetValueLog(ART *tree, size_t threshold, size_t segmentSize) {
+    // Versions keep the values they replace, which logged values cannot
+    // outlive
+    if (tree == NULL || segmentSize == 0 || segmentSize > UINT32_MAX || tree->history) {
+        return false;
+    }
+
+    if (tree->valueLog == NULL) {
+        tree->valueLog = calloc(1, sizeof(ValueLog));
+        if (!tree->valueLog) {
+            return false;
+        }
+    }
+    tree->valueLog->threshold = threshold;
+    tree->valueLog->segmentSize = segmentSize;
+    return true;
+}
+
+// Moves the live records out of every sealed segment whose live bytes are
+// at most maxLiveRatio of its used bytes and frees it. Records are matched
+// to their leaf through the key stored with them. Returns the bytes freed.
+size_t artValueLogCollect(ART *tree, double maxLiveRatio) {
+    if (tree == NULL || tree->valueLog == NULL) {
+        return 0;
+    }
+
+    ValueLog *log = tree->valueLog;
+    size_t reclaimed = 0;
+    uint32_t segmentCount = log->segmentCount;
+
+    for (uint32_t i = 0; i < segmentCount; i++) {
+        ValueLogSegment *segment = &log->segments[i];
+        if (segment->data == NULL || i == log->head || segment->liveBytes > maxLiveRatio * segment->used) {
+            continue;
+        }
+
+        size_t used = segment->used;
+        for (size_t offset = 0; offset < used; ) {
+            // Appending may move the segment array, so look it up each time
+            ValueLogRecord *record = (ValueLogRecord *)(log->segments[i].data + offset);
+            size_t size = valueLogRecordSize(record->keyLength, record->valueLength);
+            uint64_t ref = ((uint64_t)i << 32) | offset;
+            offset += size;
+
+            const uint8_t *value = (const uint8_t *)(record + 1);
+            LeafNode *leaf = findLeaf(tree, value + record->valueLength, record->keyLength);
+            if (leaf == NULL || !(leaf->flags & LEAF_VALUE_LOGGED) || (uint64_t)(uintptr_t)leaf->value != ref) {
+                continue;
+            }
+
+            uint64_t moved = valueLogAppend(log, value + record->valueLength, record->keyLength, value, record->valueLength);
+            if (moved == VALUE_LOG_NONE) {
+                return reclaimed;
+            }
+            leaf->value = (void *)(uintptr_t)moved;
+            log->segments[i].liveBytes -= size;
+        }
+
+        reclaimed += log->segments[i].capacity;
+        free(log->segments[i].data);
+        log->segments[i].data = NULL;
+    }
+
+    return reclaimed;
+}
+
+bool artDelete(ART *tree, const void *key, size_t keyLength) {
+    if (tree == NULL || key == NULL || !deleteRecursive(tree, &tree->root, key, keyLength, 0)) {
+        return false;
+    }
+
+    tree->size--;
+    if (tree->filters) {
+        refreshFilters(tree, keyByteAt(key, keyLength, tree->filters->depth));
+    }
+    AppendPath *path = tree->appendPath;
+    appendPathChanged(tree, path && path->known && compareKeys(key, keyLength, path->maxKey, path->maxKeyLength) == 0);
+    jumpTableRefresh(tree);
+    return true;
+}
+
+// Deletes every key k with lo <= k < hi, a NULL bound leaves that side
+// open. Returns the number of keys deleted.
+size_t artDeleteRange(ART *tree, const void *lo, size_t loLength, const void *hi, size_t hiLength) {
+    if (tree == NULL) {
+        return 0;
+    }
+    if (lo != NULL && hi != NULL && compareKeys(lo, loLength, hi, hiLength) >= 0) {
+        return 0;
+    }
+
+    KeyRange range = { lo, loLength, hi, hiLength };
+    historyHold(tree);
+    size_t deleted = deleteRange(tree, &tree->root, &range, 0, lo != NULL, hi != NULL);
+    historyRelease(tree);
+    tree->size -= deleted;
+    if (deleted > 0) {
+        refreshFilters(tree, -1);
+    }
+    // deleteRange() compacts every node it passes, so the cached path can
+    // point into a freed node even when nothing was deleted
+    appendPathChanged(tree, true);
+    return deleted;
+}
+
+// Deletes every key starting with prefix, returns the number deleted
+size_t artDeletePrefix(ART *tree, const void *prefix, size_t prefixLength) {
+    if (tree == NULL || prefix == NULL) {
+        return 0;
+    }
+
+    size_t nextLength;
+    uint8_t *next = prefixSuccessor(prefix, prefixLength, &nextLength);
+    if (!next) {
+        return 0;
+    }
+
+    size_t deleted = artDeleteRange(tree, prefix, prefixLength, nextLength ? next : NULL, nextLength);
+    free(next);
+    return deleted;
+}
+
+void artSetClock(ART *tree, ArtClockFunc clock) {
+    if (tree != NULL) {
+        tree->clock = clock;
+    }
+}
+
+// The timer is made before the key goes in, so that false leaves the tree
+// as it was and an owned value with the caller
+bool artInsertWithTTL(ART *tree, const void *key, size_t keyLength, const void *value, size_t valueLength, uint64_t ttlMillis) {
+    if (tree == NULL || key == NULL || keyLength == 0) {
+        return false;
+    }
+    if (ttlMillis == 0) {
+        // Written values start without a TTL
+        return artInsert(tree, key, keyLength, value, valueLength);
+    }
+
+    uint64_t now = currentMillis(tree);
+    TimerEntry *entry = makeTimerEntry(tree, key, keyLength, now + ttlMillis, now);
+    if (!entry) {
+        return false;
+    }
+    if (!artInsert(tree, key, keyLength, value, valueLength)) {
+        free(entry);
+        return false;
+    }
+    timerWheelPlace(tree->timers, entry);
+    findLeaf(tree, key, keyLength)->expiresAt = now + ttlMillis;
+    return true;
+}
+
+// Makes key expire ttlMillis from now, or never for a TTL of 0. Expired
+// keys are dropped when looked up and skipped by artIterate(); the rest
+// are removed by artExpireStep().
+bool artExpire(ART *tree, const void *key, size_t keyLength, uint64_t ttlMillis) {
+    if (tree == NULL || key == NULL) {
+        return false;
+    }
+
+    LeafNode *leaf = findLeaf(tree, key, keyLength);
+    if (leaf == NULL) {
+        return false;
+    }
+    if (ttlMillis == 0) {
+        leaf->expiresAt = 0;
+        return true;
+    }
+
+    uint64_t now = currentMillis(tree);
+    if (!scheduleExpiry(tree, key, keyLength, now + ttlMillis, now)) {
+        return false;
+    }
+    leaf->expiresAt = now + ttlMillis;
+    return true;
+}
+
+// Deletes expired keys whose timers have fired, looking at no more than
+// budget timers so that callers can bound the pause. Returns the number of
+// keys deleted.
+size_t artExpireStep(ART *tree, size_t budget) {
+    if (tree == NULL || tree->timers == NULL) {
+        return 0;
+    }
+
+    TimerWheel *wheel = tree->timers;
+    uint64_t now = currentMillis(tree);
+    timerWheelAdvance(wheel, now / wheel->tickMillis);
+
+    size_t expired = 0;
+    while (wheel->due && budget > 0) {
+        TimerEntry *entry = wheel->due;
+        wheel->due = entry->next;
+        budget--;
+
+        LeafNode *leaf = findLeaf(tree, entry->key, entry->keyLength);
+        if (leaf != NULL && leaf->expiresAt == entry->expiresAt) {
+            if (leaf->expiresAt > now) {
+                // Only possible with a clock that went backwards
+                timerWheelPlace(wheel, entry);
+                continue;
+            }
+            artDelete(tree, entry->key, entry->keyLength);
+            expired++;
+        }
+        free(entry);
+    }
+
+    return expired;
+}
+
+// Applies artSetNodePromotion(): the hottest Node16 and Node48 that fit the
+// budget become Node256s, promoted nodes that cooled down and nodes no
+// sampled lookup went through shrink to their smallest type, and all heat
+// is halved so that it follows the recent lookups. Walks the whole tree;
+// call it now and then, as with artExpireStep(). Returns the number of
+// nodes replaced.
+size_t artAdaptNodes(ART *tree) {
+    if (tree == NULL || tree->promotion == NULL) {
+        return 0;
+    }
+
+    // Lowest heat at which every node as hot or hotter fits the budget
+    size_t counts[UINT8_MAX + 1] = { 0 };
+    heatHistogram(tree->root, counts);
+    unsigned hot = UINT8_MAX + 1;
+    size_t fitting = 0;
+    while (hot > NODE_HEAT_MIN && fitting + counts[hot - 1] <= tree->promotion->budget) {
+        fitting += counts[--hot];
+    }
+
+    size_t changed = adaptSubtree(tree, &tree->root, hot);
+    if (changed > 0) {
+        appendPathChanged(tree, false);
+        if (tree->jumpTable) {
+            jumpTableBuild(tree->jumpTable, tree->root);
+        }
+    }
+    return changed;
+}
+
+// Visits every key in ascending byte order. Returns 0 after a full walk,
+// the callback's value if it stopped early, or INVALID if out of memory.
+int artIterate(ART *tree, ArtIterateFunc callback, void *data) {
+    if (tree == NULL || callback == NULL) {
+        return INVALID;
+    }
 
-                setPrefix((Node *)newNode4, key + depth, commonPrefixLength);
+    IterateState state = { .tree = tree, .callback = callback, .data = data };
+    state.now = tree->timers ? currentMillis(tree) : 0;
+    int result = iterateNode(&state, tree->root, 0);
+    free(state.path);
+    return result;
+}
 
-                addChildToNode4((Node *)newNode4, &leafNode->key[depth + commonPrefixLength], node);
-                const void *specificKeyPart = (const char *)key + depth + commonPrefixLength;
-                addChildToNode4((Node *)newNode4, specificKeyPart, (Node *)makeLeafNode(key, value, keyLength, valueLength));
+// Like artIterate, limited to the keys k with lo <= k < hi; a NULL bound
+// leaves that side open
+int artIterateRange(ART *tree, const void *lo, size_t loLength, const void *hi, size_t hiLength, ArtIterateFunc callback, void *data) {
+    if (tree == NULL || callback == NULL) {
+        return INVALID;
+    }
+    if (lo != NULL && hi != NULL && compareKeys(lo, loLength, hi, hiLength) >= 0) {
+        return 0;
+    }
 
-                *parentPointer = (Node *)newNode4;
-                return (Node *)newNode4;
-            }
+    KeyRange range = { lo, loLength, hi, hiLength };
+    IterateState state = { .tree = tree, .callback = callback, .data = data };
+    state.now = tree->timers ? currentMillis(tree) : 0;
+    int result = iterateRange(&state, tree->root, &range, 0, lo != NULL, hi != NULL);
+    free(state.path);
+    return result;
+}
+
+// Calls callback with a key drawn uniformly at random, using the 64 bit
+// random numbers of random. Returns INVALID if the tree is empty, else
+// what callback returned. Keys past their TTL may be drawn until reclaimed.
+int artSampleRandom(ART *tree, ArtRandomFunc random, void *state, ArtIterateFunc callback, void *data) {
+    if (tree == NULL || tree->root == NULL || random == NULL || callback == NULL) {
+        return INVALID;
+    }
+
+    size_t count = keysBelow(tree->root);
+    size_t rank = (size_t)(((unsigned __int128)random(state) * count) >> 64);
+    return selectRank(tree, rank, callback, data);
+}
+
+// Calls callback with the key at quantile q of the key order, 0 giving the
+// smallest key and 1 the largest. Ranks are exact; the result is only
+// approximate in counting keys past their TTL that were not reclaimed yet.
+int artApproxQuantile(ART *tree, double q, ArtIterateFunc callback, void *data) {
+    if (tree == NULL || tree->root == NULL || callback == NULL || !(q >= 0 && q <= 1)) {
+        return INVALID;
+    }
+
+    size_t count = keysBelow(tree->root);
+    return selectRank(tree, (size_t)(q * (count - 1) + 0.5), callback, data);
+}
+
+int artIteratePrefix(ART *tree, const void *prefix, size_t prefixLength, ArtIterateFunc callback, void *data) {
+    if (tree == NULL || prefix == NULL) {
+        return INVALID;
+    }
+
+    size_t nextLength;
+    uint8_t *next = prefixSuccessor(prefix, prefixLength, &nextLength);
+    if (!next) {
+        return INVALID;
+    }
+
+    int result = artIterateRange(tree, prefix, prefixLength, nextLength ? next : NULL, nextLength, callback, data);
+    free(next);
+    return result;
+}
+
+// Writes every live key and its value to fd in key order, as records of the
+// given format. Returns the keys written, INVALID if a write failed; the
+// file then ends with a partial export.
+ssize_t artExportSorted(ART *tree, int fd, ArtExportFormat format) {
+    if (tree == NULL || fd < 0 || (format != ART_EXPORT_BINARY && format != ART_EXPORT_TEXT)) {
+        return INVALID;
+    }
+
+    ExportOutput out = { .fd = fd, .buffer = malloc(ART_EXPORT_BUFFER) };
+    if (!out.buffer) {
+        return INVALID;
+    }
+
+    ssize_t exported = exportTree(tree, &out, format, tree->timers ? currentMillis(tree) : 0);
+    if (exported != INVALID) {
+        exportFlush(&out);
+    }
+    free(out.buffer);
+    return out.failed ? INVALID : exported;
+}
+
+void artCursorInit(ArtCursor *cursor, ART *tree) {
+    if (cursor != NULL) {
+        *cursor = (ArtCursor){ .tree = tree };
+    }
+}
+
+void artCursorFree(ArtCursor *cursor) {
+    if (cursor != NULL) {
+        free(cursor->frames);
+        free(cursor->key);
+        *cursor = (ArtCursor){ .tree = cursor->tree };
+    }
+}
+
+// Moves the cursor to the smallest key not smaller than key and returns
+// whether there is one. The descent starts from the deepest node the
+// current key shares with key rather than from the root, so seeks in
+// nearly sorted order skip most of it.
+bool artCursorSeek(ArtCursor *cursor, const void *key, size_t keyLength) {
+    if (cursor == NULL || cursor->tree == NULL || key == NULL) {
+        return false;
+    }
+
+    // Nodes that start above the byte where key parts from the current
+    // key lead to key as well
+    const uint8_t *bytes = key;
+    size_t shared = 0;
+    if (cursor->leaf) {
+        size_t limit = MIN(keyLength, cursor->keyLength);
+        while (shared < limit && bytes[shared] == cursor->key[shared]) {
+            shared++;
         }
-        
-        // Here we handle the internal nodes
-        if(isNodeFull(node)){
-            // Node is full, we have to grow it
-            Node *grownNode = grow(&node);
-            if (!grownNode){
-                return NULL;
+    } else {
+        cursor->height = 0;
+    }
+    while (cursor->height > 0 && cursor->frames[cursor->height - 1].depth > shared) {
+        cursor->height--;
+    }
+
+    Node *node = cursor->tree->root;
+    size_t depth = 0;
+    if (cursor->height > 0) {
+        cursor->height--;
+        node = cursor->frames[cursor->height].node;
+        depth = cursor->frames[cursor->height].depth;
+    }
+    cursor->leaf = NULL;
+    if (node == NULL) {
+        return false;
+    }
+
+    if (!cursorLowerBound(cursor, node, depth, bytes, keyLength)) {
+        cursor->height = 0;
+        cursor->leaf = NULL;
+        return false;
+    }
+    return cursorSkipExpired(cursor);
+}
+
+// Moves the cursor to the next key and returns whether there is one
+bool artCursorNext(ArtCursor *cursor) {
+    if (cursor == NULL || cursor->leaf == NULL) {
+        return false;
+    }
+    if (!cursorAdvance(cursor)) {
+        cursor->height = 0;
+        cursor->leaf = NULL;
+        return false;
+    }
+    return cursorSkipExpired(cursor);
+}
+
+// Key the cursor is on, NULL when it is on none
+const uint8_t *artCursorKey(const ArtCursor *cursor, size_t *keyLength) {
+    if (cursor == NULL || cursor->leaf == NULL) {
+        return NULL;
+    }
+    if (keyLength) {
+        *keyLength = cursor->keyLength;
+    }
+    return cursor->key;
+}
+
+void *artCursorValue(const ArtCursor *cursor) {
+    if (cursor == NULL || cursor->leaf == NULL) {
+        return NULL;
+    }
+    return leafValue(cursor->tree, cursor->leaf);
+}
+
+bool artWriteBufferInit(ArtWriteBuffer *buffer, ART *tree, size_t capacity, uint64_t maxDelayMillis, ArtLock *lock) {
+    if (buffer == NULL || tree == NULL || capacity == 0) {
+        return false;
+    }
+
+    buffer->keys = malloc(capacity * sizeof(void *));
+    buffer->keyLengths = malloc(capacity * sizeof(size_t));
+    buffer->values = malloc(capacity * sizeof(void *));
+    buffer->valueLengths = malloc(capacity * sizeof(size_t));
+    if (!buffer->keys || !buffer->keyLengths || !buffer->values || !buffer->valueLengths) {
+        free(buffer->keys);
+        free(buffer->keyLengths);
+        free(buffer->values);
+        free(buffer->valueLengths);
+        return false;
+    }
+    buffer->tree = tree;
+    buffer->lock = lock;
+    buffer->count = 0;
+    buffer->capacity = capacity;
+    buffer->maxDelayMillis = maxDelayMillis;
+    buffer->oldest = 0;
+    return true;
+}
+
+// Flushes what is still pending before releasing the buffer
+void artWriteBufferFree(ArtWriteBuffer *buffer) {
+    if (buffer == NULL || buffer->keys == NULL) {
+        return;
+    }
+    artWriteBufferFlush(buffer);
+    free(buffer->keys);
+    free(buffer->keyLengths);
+    free(buffer->values);
+    free(buffer->valueLengths);
+    buffer->keys = NULL;
+}
+
+// Holds an insert back in the buffer, where artBufferedSearch() sees it
+// at once and other threads after the next flush. Values are copied or
+// kept as the tree's value policy says, as artInsert() would. Returns
+// false on bad arguments or when out of memory; keys the tree refuses,
+// such as those that are a prefix of another key, are only dropped by
+// the flush.
+bool artBufferedInsert(ArtWriteBuffer *buffer, const void *key, size_t keyLength, const void *value, size_t valueLength) {
+    if (buffer == NULL || key == NULL || keyLength == 0) {
+        return false;
+    }
+
+    bool found;
+    size_t at = writeBufferFind(buffer, key, keyLength, &found);
+    if (!found && buffer->count == buffer->capacity) {
+        artWriteBufferFlush(buffer);
+        at = 0;
+    }
+
+    const void *kept;
+    uint8_t *block = copyPendingWrite(buffer->tree, key, keyLength, value, valueLength, &kept);
+    if (!block) {
+        return false;
+    }
+
+    if (found) {
+        writeBufferRelease(buffer, at, value);
+    } else {
+        size_t later = buffer->count - at;
+        memmove(buffer->keys + at + 1, buffer->keys + at, later * sizeof(void *));
+        memmove(buffer->keyLengths + at + 1, buffer->keyLengths + at, later * sizeof(size_t));
+        memmove(buffer->values + at + 1, buffer->values + at, later * sizeof(void *));
+        memmove(buffer->valueLengths + at + 1, buffer->valueLengths + at, later * sizeof(size_t));
+        if (buffer->count++ == 0 && buffer->maxDelayMillis > 0) {
+            buffer->oldest = currentMillis(buffer->tree);
+        }
+    }
+    buffer->keys[at] = block;
+    buffer->keyLengths[at] = keyLength;
+    buffer->values[at] = kept;
+    buffer->valueLengths[at] = valueLength;
+
+    if (writeBufferDue(buffer)) {
+        artWriteBufferFlush(buffer);
+    }
+    return true;
+}
+
+// Drops a pending insert of key and deletes key from the tree, returning
+// whether either held it
+bool artBufferedDelete(ArtWriteBuffer *buffer, const void *key, size_t keyLength) {
+    if (buffer == NULL || key == NULL) {
+        return false;
+    }
+
+    bool found;
+    size_t at = writeBufferFind(buffer, key, keyLength, &found);
+    if (found) {
+        writeBufferRelease(buffer, at, NULL);
+        size_t later = buffer->count - at - 1;
+        memmove(buffer->keys + at, buffer->keys + at + 1, later * sizeof(void *));
+        memmove(buffer->keyLengths + at, buffer->keyLengths + at + 1, later * sizeof(size_t));
+        memmove(buffer->values + at, buffer->values + at + 1, later * sizeof(void *));
+        memmove(buffer->valueLengths + at, buffer->valueLengths + at + 1, later * sizeof(size_t));
+        buffer->count--;
+    }
+
+    writeBufferLock(buffer, true);
+    bool deleted = artDelete(buffer->tree, key, keyLength);
+    writeBufferUnlock(buffer, true);
+    return found || deleted;
+}
+
+// Looks key up among the pending inserts first, then in the tree under a
+// shared lock. Tree values are read as artSearchBatch() reads them;
+// buffered values stay valid until the next write through the buffer.
+void *artBufferedSearch(ArtWriteBuffer *buffer, const void *key, size_t keyLength) {
+    if (buffer == NULL || key == NULL) {
+        return NULL;
+    }
+    if (writeBufferDue(buffer)) {
+        artWriteBufferFlush(buffer);
+    }
+
+    bool found;
+    size_t at = writeBufferFind(buffer, key, keyLength, &found);
+    if (found) {
+        return (void *)buffer->values[at];
+    }
+
+    void *value = NULL;
+    writeBufferLock(buffer, false);
+    artSearchBatch(buffer->tree, &key, &keyLength, 1, &value);
+    writeBufferUnlock(buffer, false);
+    return value;
+}
+
+// Merges the pending inserts into the tree in one sorted batch under the
+// exclusive lock, and returns how many keys were stored. A writer that
+// goes quiet calls it to keep within its delay.
+size_t artWriteBufferFlush(ArtWriteBuffer *buffer) {
+    if (buffer == NULL || buffer->count == 0) {
+        return 0;
+    }
+
+    ART *tree = buffer->tree;
+    writeBufferLock(buffer, true);
+    size_t stored = artInsertBatch(tree, buffer->keys, buffer->keyLengths, buffer->values, buffer->valueLengths, buffer->count);
+    if (tree->valuePolicy == ART_VALUE_OWN) {
+        // Values that reached a leaf belong to the tree now, those of
+        // refused keys are still the buffer's to destroy
+        for (size_t i = 0; i < buffer->count; i++) {
+            LeafNode *leaf = stored < buffer->count ? findLeaf(tree, buffer->keys[i], buffer->keyLengths[i]) : NULL;
+            if (stored == buffer->count || (leaf != NULL && leafValue(tree, leaf) == buffer->values[i])) {
+                buffer->values[i] = NULL;
             }
+        }
+    }
+    writeBufferUnlock(buffer, true);
 
-            // Update the parent pointer to the new node
-            *parentPointer = grownNode;
-            node = grownNode;
-        } else {
-            // Take the address of the specific byte in the key
-            const void *keyPartAtDepth = (const char *)key + depth;
-            addChild(node, keyPartAtDepth, (Node *)makeLeafNode(key, value, keyLength, valueLength));
+    for (size_t i = 0; i < buffer->count; i++) {
+        writeBufferRelease(buffer, i, NULL);
+    }
+    buffer->count = 0;
+    return stored;
+}
+
+bool artCombinerInit(ArtCombiner *combiner, ART *tree, size_t threads, ArtLock *lock) {
+    if (combiner == NULL || tree == NULL || threads == 0) {
+        return false;
+    }
+
+    combiner->slots = aligned_alloc(ART_COMBINE_LINE, threads * sizeof(ArtCombineSlot));
+    combiner->pending = malloc(threads * sizeof(ArtCombineSlot *));
+    combiner->keys = malloc(threads * sizeof(void *));
+    combiner->keyLengths = malloc(threads * sizeof(size_t));
+    combiner->values = malloc(threads * sizeof(void *));
+    combiner->valueLengths = malloc(threads * sizeof(size_t));
+    if (!combiner->slots || !combiner->pending || !combiner->keys || !combiner->keyLengths || !combiner->values || !combiner->valueLengths) {
+        combiner->threads = threads;
+        artCombinerFree(combiner);
+        return false;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        atomic_init(&combiner->slots[i].state, COMBINE_IDLE);
+    }
+    combiner->tree = tree;
+    combiner->lock = lock;
+    combiner->threads = threads;
+    atomic_flag_clear(&combiner->busy);
+    combiner->passes = 0;
+    combiner->applied = 0;
+    return true;
+}
+
+// No thread may still be waiting on the combiner
+void artCombinerFree(ArtCombiner *combiner) {
+    if (combiner == NULL || combiner->threads == 0) {
+        return;
+    }
+    free(combiner->slots);
+    free(combiner->pending);
+    free(combiner->keys);
+    free(combiner->keyLengths);
+    free(combiner->values);
+    free(combiner->valueLengths);
+    combiner->threads = 0;
+}
+
+// artInsert() through the combiner, called only by thread, which numbers
+// the calling thread. Under ART_VALUE_OWN the tree takes value over only
+// when this succeeds.
+bool artCombinedInsert(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength, const void *value, size_t valueLength) {
+    if (combiner == NULL || thread >= combiner->threads || key == NULL || keyLength == 0) {
+        return false;
+    }
+    return combine(combiner, thread, ART_COMBINE_INSERT, key, keyLength, value, valueLength)->ok;
+}
+
+bool artCombinedDelete(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength) {
+    if (combiner == NULL || thread >= combiner->threads || key == NULL) {
+        return false;
+    }
+    return combine(combiner, thread, ART_COMBINE_DELETE, key, keyLength, NULL, 0)->ok;
+}
+
+// Values are read as artSearchBatch() reads them, and stay valid only
+// until a combined write replaces or deletes them
+void *artCombinedSearch(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength) {
+    if (combiner == NULL || thread >= combiner->threads || key == NULL) {
+        return NULL;
+    }
+    return combine(combiner, thread, ART_COMBINE_SEARCH, key, keyLength, NULL, 0)->result;
+}
+
+// Needs artSetTransactions(). lock is taken shared by reads and exclusive
+// by the commit.
+bool artTxnBegin(ArtTxn *txn, ART *tree, ArtLock *lock) {
+    if (txn == NULL || tree == NULL || tree->versions == NULL) {
+        return false;
+    }
+    *txn = (ArtTxn){ .tree = tree, .lock = lock };
+    return true;
+}
+
+// Sees the transaction's own writes first. Values from the tree are read
+// as artSearchBatch() reads them and stay valid until their key is next
+// written; reads need not agree with each other until the commit checks
+// them.
+void *artTxnGet(ArtTxn *txn, const void *key, size_t keyLength) {
+    if (txn == NULL || txn->tree == NULL || key == NULL) {
+        return NULL;
+    }
+
+    const ArtTxnWrite *write = txnFindWrite(txn, key, keyLength);
+    if (write) {
+        return write->deleted ? NULL : (void *)write->value;
+    }
+    if (txn->readCount == txn->readCapacity && !txnGrow((void **)&txn->reads, &txn->readCapacity, sizeof(ArtTxnRead))) {
+        return NULL;
+    }
+
+    void *value = NULL;
+    txnLock(txn, false);
+    KeyVersions *versions = txn->tree->versions;
+    size_t stripe = keyStripe(versions, key, keyLength);
+    txn->reads[txn->readCount++] = (ArtTxnRead){ .stripe = stripe, .version = versions->versions[stripe] };
+    artSearchBatch(txn->tree, &key, &keyLength, 1, &value);
+    txnUnlock(txn, false);
+    return value;
+}
+
+// Values are copied or kept as the tree's value policy says, as
+// artInsert() would. Under ART_VALUE_OWN the transaction owns value from
+// here on, and frees it unless the commit hands it to the tree.
+bool artTxnPut(ArtTxn *txn, const void *key, size_t keyLength, const void *value, size_t valueLength) {
+    if (txn == NULL || txn->tree == NULL || key == NULL || keyLength == 0) {
+        return false;
+    }
+    return txnWrite(txn, key, keyLength, value, valueLength, false);
+}
+
+bool artTxnDelete(ArtTxn *txn, const void *key, size_t keyLength) {
+    if (txn == NULL || txn->tree == NULL || key == NULL || keyLength == 0) {
+        return false;
+    }
+    return txnWrite(txn, key, keyLength, NULL, 0, true);
+}
+
+// Applies every write of the transaction at once if nothing it read has
+// been written since, and returns whether it did. Either way the
+// transaction is over; one that failed can run again from artTxnBegin().
+bool artTxnCommit(ArtTxn *txn) {
+    if (txn == NULL || txn->tree == NULL) {
+        return false;
+    }
+
+    txnLock(txn, true);
+    const KeyVersions *versions = txn->tree->versions;
+    bool valid = versions != NULL;
+    for (size_t i = 0; valid && i < txn->readCount; i++) {
+        valid = versions->versions[txn->reads[i].stripe] == txn->reads[i].version;
+    }
+    if (valid && txn->writeCount > 0) {
+        historyHold(txn->tree);
+        valid = txnApply(txn);
+        historyRelease(txn->tree);
+    }
+    txnUnlock(txn, true);
+    txnEnd(txn);
+    return valid;
+}
+
+void artTxnAbort(ArtTxn *txn) {
+    if (txn != NULL && txn->tree != NULL) {
+        txnEnd(txn);
+    }
+}
+
+// Runs body in a new transaction and commits it, starting over when a
+// conflict aborts the commit, at most attempts times in all. Returns
+// whether a run committed; body returning false gives up at once.
+bool artTxnRun(ART *tree, ArtLock *lock, ArtTxnFunc body, void *data, int attempts) {
+    if (body == NULL) {
+        return false;
+    }
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        ArtTxn txn;
+        if (!artTxnBegin(&txn, tree, lock)) {
+            return false;
+        }
+        if (!body(&txn, data)) {
+            artTxnAbort(&txn);
+            return false;
+        }
+        if (artTxnCommit(&txn)) {
+            return true;
+        }
+        sched_yield();
+    }
+    return false;
+}
+
+// Opens a snapshot of the tree as of now, taking lock exclusive while it
+// registers. Needs artSetVersioning(); end it with artSnapshotEnd(), as
+// an open snapshot keeps every value it may read.
+bool artSnapshotBegin(ArtSnapshot *snapshot, ART *tree, ArtLock *lock) {
+    if (snapshot == NULL || tree == NULL || tree->history == NULL) {
+        return false;
+    }
+
+    bool registered = true;
+    if (lock) {
+        lock->lock(lock, true);
+    }
+    VersionHistory *history = tree->history;
+    if (history->readerCount == history->readerCapacity) {
+        registered = txnGrow((void **)&history->readers, &history->readerCapacity, sizeof(uint64_t));
+    }
+    if (registered) {
+        history->readers[history->readerCount++] = history->clock;
+        history->oldest = MIN(history->oldest, history->clock);
+        *snapshot = (ArtSnapshot){ .tree = tree, .lock = lock, .stamp = history->clock };
+    }
+    if (lock) {
+        lock->unlock(lock, true);
+    }
+    return registered;
+}
+
+// Value of key as of the snapshot, taking the lock shared. The value
+// stays valid until the snapshot ends.
+void *artSnapshotGet(const ArtSnapshot *snapshot, const void *key, size_t keyLength) {
+    if (snapshot == NULL || snapshot->tree == NULL) {
+        return NULL;
+    }
+    if (snapshot->lock) {
+        snapshot->lock->lock(snapshot->lock, false);
+    }
+    void *value = artSearchAsOf(snapshot->tree, key, keyLength, snapshot->stamp);
+    if (snapshot->lock) {
+        snapshot->lock->unlock(snapshot->lock, false);
+    }
+    return value;
+}
+
+// Versions the snapshot kept go with the next write to their key, or with
+// artTrimVersions()
+void artSnapshotEnd(ArtSnapshot *snapshot) {
+    if (snapshot == NULL || snapshot->tree == NULL) {
+        return;
+    }
 
-            return *root;
+    ArtLock *lock = snapshot->lock;
+    if (lock) {
+        lock->lock(lock, true);
+    }
+    VersionHistory *history = snapshot->tree->history;
+    history->oldest = UINT64_MAX;
+    for (size_t i = 0; i < history->readerCount; i++) {
+        if (history->readers[i] == snapshot->stamp) {
+            history->readers[i--] = history->readers[--history->readerCount];
+            snapshot->stamp = UINT64_MAX;
+        } else {
+            history->oldest = MIN(history->oldest, history->readers[i]);
         }
+    }
+    if (lock) {
+        lock->unlock(lock, true);
+    }
+    snapshot->tree = NULL;
+}
 
+// Value key had as of stamp, which must be that of an open snapshot or
+// the latest. Reads nothing but the tree and its history.
+void *artSearchAsOf(ART *tree, const void *key, size_t keyLength, uint64_t stamp) {
+    if (tree == NULL || tree->history == NULL || key == NULL) {
+        return NULL;
     }
 
-    return *root;
+    const VersionChain *chain = *historySlot(tree->history, key, keyLength);
+    if (chain == NULL) {
+        LeafNode *leaf = findLeaf(tree, key, keyLength);
+        return leaf ? leafValue(tree, leaf) : NULL;
+    }
+    for (const KeyVersion *version = chain->newest; version != NULL; version = version->older) {
+        if (version->stamp <= stamp) {
+            return version->present ? version->value : NULL;
+        }
+    }
+    return NULL;
 }
 
-Node *insertInt(Node **root, int key, void *value, size_t valueLength) {
-    return insert(root, &key, sizeof(int), value, valueLength, 0, compare_ints);
+// Frees the versions of keys not written since the snapshots that needed
+// them ended, and returns how many there were
+size_t artTrimVersions(ART *tree) {
+    if (tree == NULL || tree->history == NULL) {
+        return 0;
+    }
+
+    VersionHistory *history = tree->history;
+    size_t freed = 0;
+    for (size_t i = 0; i <= history->mask; i++) {
+        VersionChain **slot = &history->buckets[i];
+        while (*slot != NULL) {
+            VersionChain *chain = *slot;
+            freed += trimVersionChain(tree, history, slot);
+            if (*slot == chain) {
+                slot = &chain->next;
+            }
+        }
+    }
+    return freed;
 }
 
-Node *insertString(Node **root, const char *key, void *value, size_t valueLength) {
-    return insert(root, key, strlen(key) + 1, value, valueLength, 0, compare_strings);
+// Calls callback for every insert, update and delete of a key starting
+// with prefix, an empty prefix watching every key, until artUnwatch().
+// Needs whole keys in leaves. Returns NULL when out of memory.
+ArtWatch *artWatchPrefix(ART *tree, const void *prefix, size_t prefixLength, ArtWatchFunc callback, void *data) {
+    if (tree == NULL || callback == NULL || (prefix == NULL && prefixLength > 0) || prefixLength > UINT32_MAX || (tree->flags & ART_LEAF_SUFFIX)) {
+        return NULL;
+    }
+
+    if (tree->watches == NULL) {
+        tree->watches = makeWatchTable();
+        if (tree->watches == NULL) {
+            return NULL;
+        }
+    }
+    WatchTable *table = tree->watches;
+    ArtWatch *watch = malloc(sizeof(ArtWatch) + prefixLength);
+    if (!watch || !watchLengthAdd(table, prefixLength)) {
+        free(watch);
+        if (table->count == 0) {
+            freeWatchTable(table);
+            tree->watches = NULL;
+        }
+        return NULL;
+    }
+    watch->callback = callback;
+    watch->data = data;
+    watch->prefixLength = prefixLength;
+    if (prefixLength > 0) {
+        memcpy(watch->prefix, prefix, prefixLength);
+    }
+
+    ArtWatch **bucket = &table->buckets[hashKey(watch->prefix, prefixLength) & table->mask];
+    watch->next = *bucket;
+    *bucket = watch;
+    if (++table->count > table->mask + 1) {
+        watchTableGrow(table);
+    }
+    return watch;
 }
 
-typedef void (*FreeValueFunc)(void *);
+// Frees watch; once nothing is watched, writes no longer look for watches
+bool artUnwatch(ART *tree, ArtWatch *watch) {
+    if (tree == NULL || tree->watches == NULL || watch == NULL) {
+        return false;
+    }
+
+    WatchTable *table = tree->watches;
+    ArtWatch **link = &table->buckets[hashKey(watch->prefix, watch->prefixLength) & table->mask];
+    while (*link != NULL && *link != watch) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return false;
+    }
+    *link = watch->next;
+    watchLengthRemove(table, watch->prefixLength);
+    free(watch);
+    if (--table->count == 0) {
+        freeWatchTable(table);
+        tree->watches = NULL;
+    }
+    return true;
+}
 
+// Frees nodes and values with free(), trees with another value policy or
+// an allocator need freeART()
 void freeNode(Node *node) {
     if (node == NULL) {
         return;
@@ -750,19 +6364,15 @@ void freeNode(Node *node) {
     switch (node->type) {
         case NODE4: {
             Node4 *node4 = (Node4 *)node;
-            for (int i = 0; i < 4; i++) {
-                if (node4->keys[i] != EMPTY_KEY) {
-                    freeNode(node4->children[i]);
-                }
+            for (int i = 0; i < node4->node.count; i++) {
+                freeNode(node4->children[i]);
             }
             break;
         }
         case NODE16: {
             Node16 *node16 = (Node16 *)node;
-            for (int i = 0; i < 16; i++) {
-                if (node16->keys[i] != EMPTY_KEY) {
-                    freeNode(node16->children[i]);
-                }
+            for (int i = 0; i < node16->node.count; i++) {
+                freeNode(node16->children[i]);
             }
             break;
         }
@@ -770,7 +6380,7 @@ void freeNode(Node *node) {
             Node48 *node48 = (Node48 *)node;
             for (int i = 0; i < 256; i++) {
                 if (node48->keys[i] != EMPTY_KEY) {
-                    freeNode(node48->children[i]);
+                    freeNode(node48->children[node48->keys[i] - 1]);
                 }
             }
             break;
@@ -787,7 +6397,17 @@ void freeNode(Node *node) {
         case LEAF: {
             LeafNode *leafNode = (LeafNode *)node;
             
-            free(leafNode->value);
+            // Logged values are released together with their log
+            if (!(leafNode->flags & LEAF_VALUE_LOGGED)) {
+                free(leafNode->value);
+            }
+            break;
+        }
+        case BUCKET: {
+            LeafBucket *bucket = (LeafBucket *)node;
+            for (int i = 0; i < bucket->node.count; i++) {
+                freeNode((Node *)bucket->leaves[i]);
+            }
             break;
         }
     }
@@ -797,7 +6417,42 @@ void freeNode(Node *node) {
 
 void freeART(ART *art) {
     if (art != NULL) {
-        freeNode(art->root);
+        // An arena takes every node with it, only owned values need a visit
+        ArtAllocator *allocator = art->allocator;
+        bool walk = !(allocator && allocator->releasesAll) || art->valuePolicy == ART_VALUE_OWN;
+
+        // Nothing needs unlinking from the index when all leaves go
+        freeHashIndex(art->hashIndex);
+        art->hashIndex = NULL;
+        freeSubtreeFilters(art->filters);
+        art->filters = NULL;
+        freeFrontCache(art->frontCache);
+        art->frontCache = NULL;
+        freeJumpTable(art->jumpTable);
+        art->jumpTable = NULL;
+        free(art->promotion);
+        art->promotion = NULL;
+        freeKeyVersions(art->versions);
+        art->versions = NULL;
+        // Past values go first, the leaves then take their own with them
+        freeVersionHistory(art, art->history);
+        art->history = NULL;
+        freeWatchTable(art->watches);
+        art->watches = NULL;
+        freeAppendPath(art->appendPath);
+
+        if (walk && art->bulkFree) {
+            ValueBatch batch = { .count = 0 };
+            freeSubtree(art, art->root, &batch);
+            flushValueBatch(art, &batch);
+        } else if (walk) {
+            freeSubtree(art, art->root, NULL);
+        }
+        freeValueLog(art->valueLog);
+        freeTimerWheel(art->timers);
+        if (allocator && allocator->destroy) {
+            allocator->destroy(allocator);
+        }
         free(art);
     }
 }
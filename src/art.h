@@ -13,17 +13,56 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
+#include <sys/types.h>
 
 #ifdef __x86_64__
     #include <emmintrin.h>
 #endif
 
 #define MAX_PREFIX_LENGTH 32
+#define MIN_BUCKET_CAPACITY 2
+#define MAX_BUCKET_CAPACITY 64
+#define VALUE_LOG_SEGMENT_SIZE (1 << 20)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6 // 64 slots per level
+#define TIMER_WHEEL_TICK_MILLIS 10
+#define ART_BATCH_GROUP 16 // Lookups interleaved by artSearchBatch()
+#define ART_MAX_INTERLEAVE 64 // Most lookups artLookupInterleaved() keeps in flight
+#define ART_FREE_BATCH 256 // Values handed to an ArtBulkFreeFunc at once
+#define ART_ARENA_CHUNK_SIZE (1 << 20)
+#define THREAD_CACHE_GRANULE 32
+#define THREAD_CACHE_CLASSES 32 // Cached block sizes up to 1 KiB
+#define THREAD_CACHE_DEPTH 256 // Blocks kept per size class and thread
+#define ART_COMBINE_LINE 64 // Bytes per ArtCombiner slot, one cache line
+#define ART_EXPORT_BUFFER (1 << 20) // Bytes artExportSorted() gathers per write
+#define HASH_INDEX_MIN_SLOTS 16
+#define FRONT_CACHE_MAX_SLOTS (1 << 24)
+#define FRONT_CACHE_MAX_HITS 15 // Misses a cached key can outlast
+#define KEY_VERSIONS_MIN_STRIPES 64
+#define KEY_VERSIONS_MAX_STRIPES (1 << 24)
+#define VERSION_HISTORY_MIN_BUCKETS 64
+#define WATCH_TABLE_MIN_BUCKETS 16
+#define SUBTREE_FILTER_BITS_PER_KEY 10
+#define SUBTREE_FILTER_HASHES 6 // Bits set per key
+#define SUBTREE_FILTER_MIN_STALE 64 // Deleted keys a filter may always carry
+#define SUBTREE_FILTER_STEPS 2 // Levels artSearch() walks before testing the filter
+#define APPEND_PATH_DEPTH 64 // Deeper right edges are not followed
+#define JUMP_TABLE_MAX_DEPTH 2 // Leading key bytes a jump table can index
+#define NODE_HEAT_SAMPLE 16 // One lookup in this many heats the nodes on its path
+#define NODE_HEAT_MIN 8 // Heat a node needs before it is promoted
 #define EMPTY_KEY '\0'
 #define INVALID -1
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// Tree flags
+#define ART_LEAF_SUFFIX 0x1 // Leaves keep only the key bytes below their parent
+
+// Leaf flags
+#define LEAF_VALUE_LOGGED 0x1 // value is a ValueLog reference, not a pointer
+
 /*** DATA STRUCTURES ***/
 
 typedef enum {
@@ -31,13 +70,39 @@ typedef enum {
     NODE16,
     NODE48,
     NODE256,
-    LEAF
+    LEAF,
+    BUCKET
 } NodeType;
 
+// What the tree does with the values passed to artInsert()
+typedef enum {
+    ART_VALUE_COPY, // Stores its own copy of valueLength bytes
+    ART_VALUE_OWN, // Keeps the pointer and destroys it when the key goes away
+    ART_VALUE_BORROW // Keeps the pointer and never frees it
+} ArtValuePolicy;
+
+typedef void (*FreeValueFunc)(void *);
+// Releases count owned values at once when the tree is freed
+typedef void (*ArtBulkFreeFunc)(void *data, void **values, size_t count);
+
+// Memory for the nodes, leaves and copied values of a tree. Sizes passed
+// to free and realloc are those of the allocation, or 0 when unknown.
+typedef struct ArtAllocator {
+    void *(*alloc)(struct ArtAllocator *allocator, size_t size);
+    void *(*realloc)(struct ArtAllocator *allocator, void *ptr, size_t oldSize, size_t newSize);
+    void (*free)(struct ArtAllocator *allocator, void *ptr, size_t size);
+    void (*destroy)(struct ArtAllocator *allocator); // Called by freeART(), may be NULL
+    bool releasesAll; // destroy() frees every block, freeART() skips the node walk
+} ArtAllocator;
+
 typedef struct Node {
     NodeType type;
+    uint16_t count; // Children of an inner node, entries of a bucket
     uint8_t prefix[MAX_PREFIX_LENGTH];
+    uint8_t heat; // Sampled lookups through an inner node, halved by artAdaptNodes()
+    bool promoted; // A Node256 grown for its lookups rather than its children
     uint32_t prefixLen;
+    uint32_t subtreeSize; // Keys below an inner node, unused by leaves and buckets
 } Node;
 
 typedef struct {
@@ -54,7 +119,7 @@ typedef struct {
 
 typedef struct {
     Node node;
-    uint8_t keys[256];
+    uint8_t keys[256]; // Index + 1 into children, EMPTY_KEY when unused
     Node *children[48];
 } Node48;
 
@@ -63,21 +128,388 @@ typedef struct {
     Node *children[256];
 } Node256;
 
+// Holds the whole key, or with ART_LEAF_SUFFIX only the bytes below the
+// depth the leaf hangs at; keyLength is the number of bytes stored.
 typedef struct {
     Node node;
     void *value;
+    uint64_t expiresAt; // Clock milliseconds, 0 when the key never expires
+    uint32_t keyLength;
+    uint32_t valueLength; // As passed to artInsert(), whatever the value policy
+    uint8_t flags;
     uint8_t key[];
 } LeafNode;
 
+// Sorted array of leaves that replaces the last inner levels of a subtree.
+// Lookups compare one fingerprint byte per entry (16 at a time with SSE2)
+// before touching any leaf, and the bucket is split into an inner node
+// only once it holds `capacity` keys.
+typedef struct {
+    Node node;
+    uint16_t capacity;
+    uint8_t fingerprints[MAX_BUCKET_CAPACITY];
+    LeafNode *leaves[];
+} LeafBucket;
+
+// Append-only arena for large values. Leaves refer to a record by its
+// segment index (high 32 bits) and byte offset (low 32 bits). Each segment
+// counts the bytes still referenced so that mostly dead segments can be
+// collected by moving their live records to the head segment.
+typedef struct {
+    uint8_t *data; // NULL once the segment has been collected
+    size_t capacity;
+    size_t used;
+    size_t liveBytes;
+} ValueLogSegment;
+
+typedef struct {
+    ValueLogSegment *segments;
+    uint32_t segmentCount;
+    uint32_t head;
+    size_t segmentSize;
+    size_t threshold; // Values of at least this many bytes are logged
+} ValueLog;
+
+// Hierarchical timer wheel of keys with a TTL. An entry only names its key
+// and the expiry it was scheduled for; when it fires, a key whose expiry
+// has since changed or that is gone is skipped, so updates and deletes
+// never have to look for the entry.
+typedef struct TimerEntry {
+    struct TimerEntry *next;
+    uint64_t expiresAt;
+    uint32_t keyLength;
+    uint8_t key[];
+} TimerEntry;
+
+typedef struct {
+    TimerEntry *slots[TIMER_WHEEL_LEVELS][1 << TIMER_WHEEL_BITS];
+    TimerEntry *due; // Fired entries waiting for artExpireStep()
+    uint64_t tick;   // Last tick the wheel was advanced to
+    uint64_t tickMillis;
+    size_t scheduled; // Entries in slots, not counting due ones
+} TimerWheel;
+
+// Open addressing table from full key hashes to leaves, kept next to the
+// tree so that point lookups can skip the descent. Deletes shift later
+// entries back instead of leaving tombstones.
+typedef struct {
+    uint64_t hash;
+    LeafNode *leaf; // NULL for a free slot
+} HashIndexSlot;
+
+typedef struct {
+    HashIndexSlot *slots;
+    size_t mask; // Slot count - 1, the count being a power of two
+    size_t count;
+} HashIndex;
+
+// Small cache from key hashes to the leaves of often found keys. Each hash
+// maps to one pair of slots sharing a cache line. A leaf leaves its slot
+// when it is freed, so entries never point at released memory.
+typedef struct {
+    LeafNode *leaf; // NULL for a free slot
+    uint32_t hash; // High half of the key hash
+    uint32_t hits; // Lookups the leaf answered, worn down by misses
+} FrontCacheSlot;
+
+typedef struct {
+    FrontCacheSlot *slots;
+    size_t mask; // Slot count - 1, the count being a power of two
+} FrontCache;
+
+// Write counters of keys hashed onto stripes. Every write to a key bumps
+// its stripe, which is how a transaction finds out that a key it read
+// has changed since.
+typedef struct {
+    uint64_t *versions;
+    size_t mask; // Stripe count - 1, the count being a power of two
+} KeyVersions;
+
+// State of a key from stamp on until the next newer version: a value, or
+// the key being absent
+typedef struct KeyVersion {
+    struct KeyVersion *older;
+    uint64_t stamp;
+    void *value; // The leaf's own while this is the newest version
+    uint32_t valueLength;
+    bool present;
+} KeyVersion;
+
+typedef struct VersionChain {
+    struct VersionChain *next; // Next chain in the bucket
+    KeyVersion *newest;
+    uint32_t keyLength;
+    uint8_t key[];
+} VersionChain;
+
+// Past states of the keys written while snapshots were open. A key with
+// no chain has been as the tree shows it since before the oldest open
+// snapshot, so with no snapshots open there are no chains to keep.
+typedef struct {
+    VersionChain **buckets;
+    size_t mask; // Bucket count - 1, the count being a power of two
+    size_t chains;
+    uint64_t clock; // Stamp of the latest write
+    uint32_t holds; // Writes under way that are to share one stamp
+    uint64_t *readers; // Stamps of the open snapshots
+    size_t readerCount;
+    size_t readerCapacity;
+    uint64_t oldest; // Smallest of readers, UINT64_MAX when there are none
+} VersionHistory;
+
+typedef enum { ART_WATCH_INSERT, ART_WATCH_UPDATE, ART_WATCH_DELETE } ArtWatchEvent;
+
+// Told of each write under a watched prefix while the write is under way,
+// with the new value or, for deletes, the old one. It must not write to
+// the tree nor change its watches.
+typedef void (*ArtWatchFunc)(void *data, ArtWatchEvent event, const uint8_t *key, size_t keyLength, void *value);
+
+typedef struct ArtWatch {
+    struct ArtWatch *next; // Next watch in the bucket
+    ArtWatchFunc callback;
+    void *data;
+    uint32_t prefixLength;
+    uint8_t prefix[];
+} ArtWatch;
+
+// Watches hashed by their prefix. A written key is looked up once for
+// each prefix length watched, whatever the number of watches.
+typedef struct {
+    ArtWatch **buckets;
+    size_t mask; // Bucket count - 1, the count being a power of two
+    size_t count;
+    uint32_t *lengths; // Prefix lengths watched, ascending
+    size_t *lengthWatches; // Watches of each of those lengths
+    size_t lengthCount;
+} WatchTable;
+
+// Blocked Bloom filter over the keys below one child of the root. Deleted
+// keys keep their bits until the filter is rebuilt.
+typedef struct {
+    uint64_t *blocks; // 512 bit blocks, NULL while the subtree is empty
+    uint32_t blockCount;
+    size_t keys; // Live keys
+    size_t stale; // Keys deleted since the last rebuild
+} SubtreeFilter;
+
+typedef struct {
+    size_t depth; // Key byte choosing the filter
+    SubtreeFilter filters[256];
+} SubtreeFilters;
+
+// Path from the root to the largest key, so that keys inserted in
+// ascending order can start where the previous one went instead of at the
+// root. refs[i + 1] is the slot of *refs[i] that leads on to the largest
+// key.
+typedef struct {
+    Node **refs[APPEND_PATH_DEPTH];
+    size_t depths[APPEND_PATH_DEPTH]; // Key depth at which *refs[i] starts
+    uint32_t length; // 0 while the path has to be found again
+    bool known; // Whether maxKey is at least as large as every key
+    uint8_t *maxKey;
+    size_t maxKeyLength;
+    size_t maxKeyCapacity;
+} AppendPath;
+
+// Child slots of the top one or two levels, indexed by the leading key
+// bytes, so that keys at least that long can skip the root and its
+// children. Slots only point into Node256s without a prefix, which keep
+// their slots in place until they are freed.
+typedef struct {
+    Node ***slots; // NULL where the walk has to start at the root
+    Node *parents[257]; // The root, then the node below each first byte
+    uint32_t depth; // Key bytes the slots stand for
+    bool stale; // A parent was freed, rebuilt by the next write
+    size_t misses; // Inserts that started at the root since the last build
+} JumpTable;
+
+// State of artSetNodePromotion()
+typedef struct {
+    size_t budget; // Promoted nodes allowed at once
+    size_t promoted;
+    uint32_t countdown; // Lookups until the next sampled one
+} NodePromotion;
+
+typedef uint64_t (*ArtClockFunc)(void);
+
 typedef struct {
     Node *root;
     size_t size;
+    uint16_t bucketCapacity; // 0 disables leaf buckets
+    uint32_t flags;
+    ValueLog *valueLog;
+    TimerWheel *timers;
+    HashIndex *hashIndex; // NULL unless enabled by artSetHashIndex()
+    SubtreeFilters *filters; // NULL unless enabled by artSetSubtreeFilters()
+    FrontCache *frontCache; // NULL unless enabled by artSetFrontCache()
+    JumpTable *jumpTable; // NULL unless enabled by artSetJumpTable()
+    NodePromotion *promotion; // NULL unless enabled by artSetNodePromotion()
+    KeyVersions *versions; // NULL unless enabled by artSetTransactions()
+    VersionHistory *history; // NULL unless enabled by artSetVersioning()
+    WatchTable *watches; // NULL while nothing is watched
+    AppendPath *appendPath; // Set up by the first artInsert()
+    ArtClockFunc clock; // Milliseconds, CLOCK_MONOTONIC when NULL
+    ArtValuePolicy valuePolicy;
+    FreeValueFunc freeValue; // Destructor of owned values, free() when NULL
+    ArtBulkFreeFunc bulkFree; // Used instead of freeValue by freeART()
+    void *bulkFreeData;
+    ArtAllocator *allocator; // malloc when NULL
 } ART;
 
+// Called with each full key in order, returning non-zero stops the walk
+typedef int (*ArtIterateFunc)(void *data, const uint8_t *key, size_t keyLength, void *value);
+
+// Record layouts written by artExportSorted()
+typedef enum {
+    ART_EXPORT_BINARY, // Little endian u32 key length, u32 value length, key, value
+    ART_EXPORT_TEXT // Key, tab, value, newline; tab, newline, backslash and non printable bytes as \xHH
+} ArtExportFormat;
+
+// Source of uniformly distributed 64 bit numbers for artSampleRandom()
+typedef uint64_t (*ArtRandomFunc)(void *state);
+
+// A lookup that advances one node per artLookupStep() call
+typedef struct {
+    const uint8_t *key;
+    size_t keyLength;
+    Node *node; // Next node to visit, NULL once finished
+    size_t depth;
+    LeafNode *leaf; // Set once the lookup found its key
+    void *context; // Caller data, passed back by artLookupInterleaved()
+} ArtLookup;
+
+// One node on the path of an ArtCursor
+typedef struct {
+    Node *node; // Inner node, or the bucket holding the current key
+    size_t depth; // Key depth at which node starts
+    int position; // Where the next child, or bucket leaf, is looked for
+} ArtCursorFrame;
+
+// Position among the keys of a tree, kept as the path of nodes down to the
+// current key. Set up with artCursorInit() and released with
+// artCursorFree(); the tree must not change while the cursor is on a key.
+typedef struct {
+    ART *tree;
+    ArtCursorFrame *frames;
+    uint32_t height; // Frames in use
+    uint32_t capacity;
+    LeafNode *leaf; // Current key, NULL when the cursor is on none
+    uint8_t *key; // Full key of leaf
+    size_t keyLength;
+    size_t keyCapacity;
+} ArtCursor;
+
+// Lock keeping the other threads of a tree out, taken exclusive by writers
+// and shared by readers. Embed it in a struct to give it data.
+typedef struct ArtLock {
+    void (*lock)(struct ArtLock *lock, bool exclusive);
+    void (*unlock)(struct ArtLock *lock, bool exclusive);
+} ArtLock;
+
+// Inserts of one writer thread held back in key order, and merged into the
+// tree with artInsertBatch() once capacity of them are pending or the
+// oldest is maxDelayMillis old. Set up with artWriteBufferInit() and
+// released with artWriteBufferFree(); a buffer belongs to one thread.
+typedef struct {
+    ART *tree;
+    ArtLock *lock; // Taken around each use of the tree, NULL when the caller does that
+    const void **keys; // Each a block with the key, then the value when the tree copies values
+    size_t *keyLengths;
+    const void **values;
+    size_t *valueLengths;
+    size_t count;
+    size_t capacity;
+    uint64_t maxDelayMillis; // 0 leaves pending inserts until the buffer fills
+    uint64_t oldest; // Clock milliseconds of the oldest pending insert
+} ArtWriteBuffer;
+
+typedef enum { ART_COMBINE_INSERT, ART_COMBINE_DELETE, ART_COMBINE_SEARCH } ArtCombineOp;
+
+// Operation one thread posted to an ArtCombiner, on a cache line of its own
+typedef struct {
+    _Alignas(ART_COMBINE_LINE) _Atomic int state; // Idle, posted or done
+    ArtCombineOp op;
+    const void *key;
+    size_t keyLength;
+    const void *value;
+    size_t valueLength;
+    void *result; // Value a search found
+    bool ok; // Whether an insert was stored or a delete found its key
+} ArtCombineSlot;
+
+// Flat combining: each thread posts its operation in its own slot, and
+// whichever thread gets to be combiner applies everything posted in one
+// sorted pass under a single exclusive lock, inserts as one batch. Set up
+// with artCombinerInit() for threads threads numbered from 0.
+typedef struct {
+    ART *tree;
+    ArtLock *lock; // Taken by the combiner, NULL when only combined calls use the tree
+    ArtCombineSlot *slots;
+    size_t threads;
+    atomic_flag busy; // Held by the combiner
+    ArtCombineSlot **pending; // Scratch of the combiner, threads entries each
+    const void **keys;
+    size_t *keyLengths;
+    const void **values;
+    size_t *valueLengths;
+    size_t passes; // Combining passes made, and operations they applied
+    size_t applied;
+} ArtCombiner;
+
+typedef struct {
+    size_t stripe;
+    uint64_t version;
+} ArtTxnRead;
+
+typedef struct {
+    const void *key; // Block with the key, then the value when the tree copies values
+    size_t keyLength;
+    const void *value;
+    size_t valueLength;
+    bool deleted;
+    bool added; // Stored as a new key by the commit under way
+} ArtTxnWrite;
+
+// Optimistic transaction. Reads go to the tree under a shared lock and
+// note the versions of their keys; writes wait in the transaction until
+// artTxnCommit() checks those versions and applies them all under one
+// exclusive lock. Started with artTxnBegin() and ended by artTxnCommit()
+// or artTxnAbort(); a transaction belongs to one thread.
+typedef struct {
+    ART *tree;
+    ArtLock *lock; // NULL when the caller keeps other threads out
+    ArtTxnRead *reads;
+    size_t readCount;
+    size_t readCapacity;
+    ArtTxnWrite *writes;
+    size_t writeCount;
+    size_t writeCapacity;
+} ArtTxn;
+
+// Body of a transaction run by artTxnRun(), returning false gives up
+typedef bool (*ArtTxnFunc)(ArtTxn *txn, void *data);
+
+// Reader that sees the tree as it was when artSnapshotBegin() stamped it,
+// whatever is written meanwhile
+typedef struct {
+    ART *tree;
+    ArtLock *lock; // Taken shared by each read, NULL when the caller does that
+    uint64_t stamp;
+} ArtSnapshot;
+
+// Feed artLookupInterleaved(): next returns false when there are no more keys
+typedef bool (*ArtLookupSource)(void *data, const void **key, size_t *keyLength, void **context);
+typedef void (*ArtLookupDone)(void *data, void *context, void *value);
+
 /*** FUNCTIONS ***/
 
 Node *createRootNode();
 ART *initializeAdaptiveRadixTree();
+ART *initializeAdaptiveRadixTreeWithAllocator(ArtAllocator *allocator);
+ArtAllocator *artMallocAllocator(void);
+ArtAllocator *artArenaAllocator(size_t chunkSize);
+ArtAllocator *artThreadCacheAllocator(void);
+void artThreadCacheFlush(void);
 
 Node *findChildSSE(Node *genericNode, char byte);
 Node *findChildBinary(Node *genericNode, char byte);
@@ -92,6 +524,7 @@ Node48 *makeNode48();
 Node256 *makeNode256();
 
 LeafNode *makeLeafNode(const char *key, const void *value, size_t keyLength, size_t valueLength);
+LeafBucket *makeLeafBucket(int capacity);
 
 int findEmptyIndexForChildren(Node48 *node48);
 
@@ -120,8 +553,79 @@ int compare_strings(const void *a, const void *b, size_t size);
 Node *insert(Node **root, const void *key, size_t keyLength, void *value, size_t valueLength, int depth, compare_func cmp);
 Node *insertInt(Node **root, int key, void *value, size_t valueLength);
 Node *insertString(Node **root, const char *key, void *value, size_t valueLength);
+void *search(Node *root, const void *key, size_t keyLength);
+
+bool artSetLeafBuckets(ART *tree, int capacity);
+bool artSetLeafSuffixes(ART *tree, bool enabled);
+bool artSetHashIndex(ART *tree, bool enabled);
+bool artSetSubtreeFilters(ART *tree, bool enabled);
+bool artSetFrontCache(ART *tree, size_t slots);
+bool artSetJumpTable(ART *tree, int depth);
+bool artSetNodePromotion(ART *tree, size_t budgetBytes);
+bool artSetTransactions(ART *tree, size_t stripes);
+bool artSetVersioning(ART *tree, bool enabled);
+bool artSetValuePolicy(ART *tree, ArtValuePolicy policy, FreeValueFunc freeValue);
+void artSetBulkFree(ART *tree, ArtBulkFreeFunc bulkFree, void *data);
+// artInsert() refuses a key that is a prefix of a stored key, or that a
+// stored key is a prefix of, keys differing only in trailing zero bytes
+// included. Terminate keys that can be prefixes of one another, as C
+// strings are by their NUL.
+bool artInsert(ART *tree, const void *key, size_t keyLength, const void *value, size_t valueLength);
+size_t artInsertBatch(ART *tree, const void *const *keys, const size_t *keyLengths, const void *const *values, const size_t *valueLengths, size_t count);
+void *artSearch(ART *tree, const void *key, size_t keyLength);
+size_t artSearchBatch(ART *tree, const void *const *keys, const size_t *keyLengths, size_t count, void **values);
+void artLookupStart(ART *tree, ArtLookup *lookup, const void *key, size_t keyLength);
+bool artLookupStep(ART *tree, ArtLookup *lookup);
+void *artLookupValue(ART *tree, const ArtLookup *lookup);
+size_t artLookupInterleaved(ART *tree, size_t width, ArtLookupSource next, ArtLookupDone done, void *data);
+bool artDelete(ART *tree, const void *key, size_t keyLength);
+size_t artDeleteRange(ART *tree, const void *lo, size_t loLength, const void *hi, size_t hiLength);
+size_t artDeletePrefix(ART *tree, const void *prefix, size_t prefixLength);
+void artSetClock(ART *tree, ArtClockFunc clock);
+bool artInsertWithTTL(ART *tree, const void *key, size_t keyLength, const void *value, size_t valueLength, uint64_t ttlMillis);
+bool artExpire(ART *tree, const void *key, size_t keyLength, uint64_t ttlMillis);
+size_t artExpireStep(ART *tree, size_t budget);
+size_t artAdaptNodes(ART *tree);
+bool artSetValueLog(ART *tree, size_t threshold, size_t segmentSize);
+size_t artValueLogCollect(ART *tree, double maxLiveRatio);
+int artIterate(ART *tree, ArtIterateFunc callback, void *data);
+int artIterateRange(ART *tree, const void *lo, size_t loLength, const void *hi, size_t hiLength, ArtIterateFunc callback, void *data);
+int artIteratePrefix(ART *tree, const void *prefix, size_t prefixLength, ArtIterateFunc callback, void *data);
+int artSampleRandom(ART *tree, ArtRandomFunc random, void *state, ArtIterateFunc callback, void *data);
+int artApproxQuantile(ART *tree, double q, ArtIterateFunc callback, void *data);
+ssize_t artExportSorted(ART *tree, int fd, ArtExportFormat format);
+void artCursorInit(ArtCursor *cursor, ART *tree);
+void artCursorFree(ArtCursor *cursor);
+bool artCursorSeek(ArtCursor *cursor, const void *key, size_t keyLength);
+bool artCursorNext(ArtCursor *cursor);
+const uint8_t *artCursorKey(const ArtCursor *cursor, size_t *keyLength);
+void *artCursorValue(const ArtCursor *cursor);
+bool artWriteBufferInit(ArtWriteBuffer *buffer, ART *tree, size_t capacity, uint64_t maxDelayMillis, ArtLock *lock);
+void artWriteBufferFree(ArtWriteBuffer *buffer);
+bool artBufferedInsert(ArtWriteBuffer *buffer, const void *key, size_t keyLength, const void *value, size_t valueLength);
+bool artBufferedDelete(ArtWriteBuffer *buffer, const void *key, size_t keyLength);
+void *artBufferedSearch(ArtWriteBuffer *buffer, const void *key, size_t keyLength);
+size_t artWriteBufferFlush(ArtWriteBuffer *buffer);
+bool artCombinerInit(ArtCombiner *combiner, ART *tree, size_t threads, ArtLock *lock);
+void artCombinerFree(ArtCombiner *combiner);
+bool artCombinedInsert(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength, const void *value, size_t valueLength);
+bool artCombinedDelete(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength);
+void *artCombinedSearch(ArtCombiner *combiner, size_t thread, const void *key, size_t keyLength);
+bool artTxnBegin(ArtTxn *txn, ART *tree, ArtLock *lock);
+void *artTxnGet(ArtTxn *txn, const void *key, size_t keyLength);
+bool artTxnPut(ArtTxn *txn, const void *key, size_t keyLength, const void *value, size_t valueLength);
+bool artTxnDelete(ArtTxn *txn, const void *key, size_t keyLength);
+bool artTxnCommit(ArtTxn *txn);
+void artTxnAbort(ArtTxn *txn);
+bool artTxnRun(ART *tree, ArtLock *lock, ArtTxnFunc body, void *data, int attempts);
+bool artSnapshotBegin(ArtSnapshot *snapshot, ART *tree, ArtLock *lock);
+void *artSnapshotGet(const ArtSnapshot *snapshot, const void *key, size_t keyLength);
+void artSnapshotEnd(ArtSnapshot *snapshot);
+void *artSearchAsOf(ART *tree, const void *key, size_t keyLength, uint64_t stamp);
+size_t artTrimVersions(ART *tree);
+ArtWatch *artWatchPrefix(ART *tree, const void *prefix, size_t prefixLength, ArtWatchFunc callback, void *data);
+bool artUnwatch(ART *tree, ArtWatch *watch);
 
-typedef void (*FreeValueFunc)(void *);
 void freeNode(Node *node);
 void freeART(ART *art);
 
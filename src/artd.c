@@ -0,0 +1,771 @@
+// artd - serves one adaptive radix tree to local clients over a
+// Redis-compatible (RESP) protocol on a Unix domain or loopback TCP socket.
+//
+//     cc -O2 -pthread -o artd src/artd.c src/art.c
+//     ./artd -s /tmp/artd.sock      or      ./artd -p 6380 [-t threads] [-H]
+//
+// -H keeps a hash index next to the tree so that GETs skip the descent.
+//
+// Supported commands: PING, GET key, SET key value [PX ms], DEL key [key ...],
+// SCAN start count (key/value pairs from start on, in key order),
+// PREFIX prefix count, DBSIZE and COMMAND.
+//
+// Each thread runs its own epoll loop and accepts from the shared listening
+// socket. Pipelined commands are executed in batches: runs of GETs go
+// through artSearchBatch() under a shared lock, runs of writes share one
+// exclusive lock. Linux only.
+
+#define _GNU_SOURCE
+#include "art.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define READ_CHUNK 65536
+#define MAX_BATCH_COMMANDS 256
+#define MAX_BATCH_ARGS 4096
+#define MAX_SCAN_COUNT 100000
+#define MAX_BULK_LENGTH (512LL << 20) // Largest argument accepted, as Redis' proto-max-bulk-len
+#define OUTPUT_HIGH_WATER (4 << 20) // Stop reading a client with this much unsent output
+#define MAX_EVENTS 128
+#define EXPIRE_BUDGET 10000 // Keys expired per pass of the main thread
+
+/*** BUFFERS ***/
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static bool bufferReserve(Buffer *buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) {
+        return true;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (!data) {
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static bool bufferAppend(Buffer *buffer, const void *data, size_t length) {
+    if (!bufferReserve(buffer, length)) {
+        return false;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static void bufferConsume(Buffer *buffer, size_t length) {
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+static bool replyStatus(Buffer *out, const char *status) {
+    return bufferAppend(out, status, strlen(status));
+}
+
+static bool replyHeader(Buffer *out, char type, long long value) {
+    char header[32];
+    int length = snprintf(header, sizeof(header), "%c%lld\r\n", type, value);
+    return bufferAppend(out, header, length);
+}
+
+static bool replyBulk(Buffer *out, const void *data, size_t length) {
+    return replyHeader(out, '$', length) && bufferAppend(out, data, length) && bufferAppend(out, "\r\n", 2);
+}
+
+/*** KEY ENCODING ***/
+
+// Tree keys must not be prefixes of each other, so client keys are stored
+// escaped: 0x00 becomes 00 FF and the key ends with 00 01. The encoding
+// keeps the byte order of the original keys, and the escaped form of a
+// prefix is a prefix of the escaped keys that start with it.
+static bool encodeKey(Buffer *buffer, const char *key, size_t length, bool terminate) {
+    if (!bufferReserve(buffer, length * 2 + 2)) {
+        return false;
+    }
+
+    uint8_t *out = (uint8_t *)buffer->data + buffer->length;
+    size_t written = 0;
+    for (size_t i = 0; i < length; i++) {
+        out[written++] = key[i];
+        if (key[i] == 0) {
+            out[written++] = 0xFF;
+        }
+    }
+    if (terminate) {
+        out[written++] = 0x00;
+        out[written++] = 0x01;
+    }
+    buffer->length += written;
+    return true;
+}
+
+static bool replyDecodedKey(Buffer *out, const uint8_t *key, size_t length) {
+    // Drop the terminator and undo the escaping
+    length -= 2;
+    size_t decodedLength = 0;
+    for (size_t i = 0; i < length; i++) {
+        decodedLength++;
+        i += key[i] == 0;
+    }
+
+    if (!replyHeader(out, '$', decodedLength) || !bufferReserve(out, decodedLength + 2)) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        out->data[out->length++] = key[i];
+        i += key[i] == 0;
+    }
+    return bufferAppend(out, "\r\n", 2);
+}
+
+// Stored values carry their own length, the tree does not keep one
+typedef struct {
+    uint32_t length;
+    char data[];
+} StoredValue;
+
+/*** PROTOCOL ***/
+
+typedef struct {
+    const char *data;
+    size_t length;
+} Arg;
+
+typedef struct {
+    Arg *args;
+    int argc;
+} Command;
+
+// First '\r' of data with a byte after it, NULL while there is none. Lines
+// end in "\r\n", so callers refuse a '\r' followed by anything else.
+static const char *findLineEnd(const char *data, size_t length) {
+    const char *end = memchr(data, '\r', length);
+    return end && end + 1 < data + length ? end : NULL;
+}
+
+static bool parseNumber(const char *data, const char *end, long long *value) {
+    if (data == end) {
+        return false;
+    }
+    *value = 0;
+    for (; data < end; data++) {
+        if (*data < '0' || *data > '9' || *value > (1LL << 40)) {
+            return false;
+        }
+        *value = *value * 10 + (*data - '0');
+    }
+    return true;
+}
+
+// Parses one command from data. Returns the number of bytes it used, 0 if
+// the command is incomplete and INVALID on a protocol error.
+static long parseCommand(const char *data, size_t length, Arg *args, int maxArgs, int *argc) {
+    const char *end = findLineEnd(data, length);
+    if (!end) {
+        return length > READ_CHUNK ? INVALID : 0;
+    }
+    if (end[1] != '\n') {
+        return INVALID;
+    }
+
+    // Inline commands, as typed into telnet or nc
+    if (data[0] != '*') {
+        *argc = 0;
+        for (const char *p = data; p < end; ) {
+            while (p < end && *p == ' ') {
+                p++;
+            }
+            const char *word = p;
+            while (p < end && *p != ' ') {
+                p++;
+            }
+            if (p > word) {
+                if (*argc == maxArgs) {
+                    return INVALID;
+                }
+                args[(*argc)++] = (Arg){ word, p - word };
+            }
+        }
+        return end + 2 - data;
+    }
+
+    long long count;
+    if (!parseNumber(data + 1, end, &count) || count > maxArgs) {
+        return INVALID;
+    }
+
+    const char *p = end + 2;
+    const char *limit = data + length;
+    for (int i = 0; i < count; i++) {
+        end = findLineEnd(p, limit - p);
+        if (!end) {
+            return 0;
+        }
+        if (end[1] != '\n') {
+            return INVALID;
+        }
+        long long argLength;
+        if (*p != '$' || !parseNumber(p + 1, end, &argLength) || argLength > MAX_BULK_LENGTH) {
+            return INVALID;
+        }
+        p = end + 2;
+        if (limit - p < argLength + 2) {
+            return 0;
+        }
+        if (p[argLength] != '\r' || p[argLength + 1] != '\n') {
+            return INVALID;
+        }
+        args[i] = (Arg){ p, argLength };
+        p += argLength + 2;
+    }
+
+    *argc = count;
+    return p - data;
+}
+
+/*** COMMANDS ***/
+
+typedef enum { CMD_GET, CMD_SET, CMD_DEL, CMD_SCAN, CMD_PREFIX, CMD_DBSIZE, CMD_PING, CMD_COMMAND, CMD_UNKNOWN, CMD_ARITY } CommandKind;
+
+typedef struct {
+    const char *name;
+    CommandKind kind;
+    int minArgs;
+    int maxArgs;
+} CommandSpec;
+
+static const CommandSpec commandSpecs[] = {
+    { "GET", CMD_GET, 2, 2 },
+    { "SET", CMD_SET, 3, 5 },
+    { "DEL", CMD_DEL, 2, MAX_BATCH_ARGS },
+    { "SCAN", CMD_SCAN, 3, 3 },
+    { "PREFIX", CMD_PREFIX, 3, 3 },
+    { "DBSIZE", CMD_DBSIZE, 1, 1 },
+    { "PING", CMD_PING, 1, 2 },
+    { "COMMAND", CMD_COMMAND, 1, MAX_BATCH_ARGS },
+};
+
+static CommandKind commandKind(const Command *command) {
+    if (command->argc == 0) {
+        return CMD_UNKNOWN;
+    }
+    const Arg *name = &command->args[0];
+    for (size_t i = 0; i < sizeof(commandSpecs) / sizeof(commandSpecs[0]); i++) {
+        const CommandSpec *spec = &commandSpecs[i];
+        if (strlen(spec->name) == name->length && strncasecmp(spec->name, name->data, name->length) == 0) {
+            return command->argc < spec->minArgs || command->argc > spec->maxArgs ? CMD_ARITY : spec->kind;
+        }
+    }
+    return CMD_UNKNOWN;
+}
+
+static ART *tree;
+static pthread_rwlock_t treeLock = PTHREAD_RWLOCK_INITIALIZER;
+static atomic_bool stopping;
+
+typedef struct {
+    Buffer keys; // Encoded keys of the current command run
+    Buffer items; // SCAN replies are built here before their count is known
+    Command commands[MAX_BATCH_COMMANDS];
+    Arg args[MAX_BATCH_ARGS];
+    const void *keyPointers[MAX_BATCH_COMMANDS];
+    size_t keyLengths[MAX_BATCH_COMMANDS];
+    void *values[MAX_BATCH_COMMANDS];
+} Worker;
+
+// Runs the GETs in commands[0, count) as one batch lookup
+static bool executeGets(Worker *worker, Command *commands, int count, Buffer *out) {
+    size_t offsets[MAX_BATCH_COMMANDS];
+    worker->keys.length = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = worker->keys.length;
+        if (!encodeKey(&worker->keys, commands[i].args[1].data, commands[i].args[1].length, true)) {
+            return false;
+        }
+        worker->keyLengths[i] = worker->keys.length - offsets[i];
+    }
+    for (int i = 0; i < count; i++) {
+        worker->keyPointers[i] = worker->keys.data + offsets[i];
+    }
+
+    bool ok = true;
+    pthread_rwlock_rdlock(&treeLock);
+    artSearchBatch(tree, worker->keyPointers, worker->keyLengths, count, worker->values);
+    // Values can be freed by a writer as soon as the lock is released
+    for (int i = 0; i < count && ok; i++) {
+        StoredValue *value = worker->values[i];
+        ok = value ? replyBulk(out, value->data, value->length) : replyStatus(out, "$-1\r\n");
+    }
+    pthread_rwlock_unlock(&treeLock);
+    return ok;
+}
+
+static bool executeSet(Worker *worker, const Command *command, Buffer *out) {
+    long long ttl = 0;
+    if (command->argc != 3) {
+        const Arg *option = &command->args[3];
+        if (command->argc != 5 || option->length != 2 || strncasecmp(option->data, "PX", 2) != 0 ||
+            !parseNumber(command->args[4].data, command->args[4].data + command->args[4].length, &ttl) || ttl == 0) {
+            return replyStatus(out, "-ERR syntax error\r\n");
+        }
+    }
+
+    const Arg *key = &command->args[1];
+    const Arg *value = &command->args[2];
+    if (value->length > UINT32_MAX) {
+        return replyStatus(out, "-ERR value too large\r\n");
+    }
+
+    // The stored value is laid out in the key buffer after the key
+    worker->keys.length = 0;
+    if (!encodeKey(&worker->keys, key->data, key->length, true) ||
+        !bufferReserve(&worker->keys, sizeof(StoredValue) + value->length)) {
+        return false;
+    }
+    size_t keyLength = worker->keys.length;
+    StoredValue *stored = (StoredValue *)(worker->keys.data + keyLength);
+    stored->length = value->length;
+    memcpy(stored->data, value->data, value->length);
+
+    bool inserted = ttl ? artInsertWithTTL(tree, worker->keys.data, keyLength, stored, sizeof(StoredValue) + value->length, ttl)
+                        : artInsert(tree, worker->keys.data, keyLength, stored, sizeof(StoredValue) + value->length);
+    return replyStatus(out, inserted ? "+OK\r\n" : "-ERR out of memory\r\n");
+}
+
+static bool executeDel(Worker *worker, const Command *command, Buffer *out) {
+    long long deleted = 0;
+    for (int i = 1; i < command->argc; i++) {
+        worker->keys.length = 0;
+        if (!encodeKey(&worker->keys, command->args[i].data, command->args[i].length, true)) {
+            return false;
+        }
+        deleted += artDelete(tree, worker->keys.data, worker->keys.length);
+    }
+    return replyHeader(out, ':', deleted);
+}
+
+typedef struct {
+    Buffer *items;
+    long long remaining;
+    long long count;
+    bool failed;
+} ScanState;
+
+static int scanKey(void *data, const uint8_t *key, size_t keyLength, void *value) {
+    ScanState *scan = data;
+    StoredValue *stored = value;
+    if (!replyDecodedKey(scan->items, key, keyLength) || !replyBulk(scan->items, stored->data, stored->length)) {
+        scan->failed = true;
+        return 1;
+    }
+    scan->count++;
+    return --scan->remaining == 0;
+}
+
+// SCAN returns the pairs with keys >= start, PREFIX those starting with it
+static bool executeScan(Worker *worker, const Command *command, CommandKind kind, Buffer *out) {
+    const Arg *start = &command->args[1];
+    const Arg *count = &command->args[2];
+    ScanState scan = { .items = &worker->items };
+    if (!parseNumber(count->data, count->data + count->length, &scan.remaining) || scan.remaining > MAX_SCAN_COUNT) {
+        return replyStatus(out, "-ERR invalid count\r\n");
+    }
+    if (scan.remaining == 0) {
+        return replyStatus(out, "*0\r\n");
+    }
+
+    worker->keys.length = 0;
+    worker->items.length = 0;
+    if (!encodeKey(&worker->keys, start->data, start->length, kind == CMD_SCAN)) {
+        return false;
+    }
+
+    pthread_rwlock_rdlock(&treeLock);
+    if (kind == CMD_SCAN) {
+        artIterateRange(tree, worker->keys.data, worker->keys.length, NULL, 0, scanKey, &scan);
+    } else {
+        artIteratePrefix(tree, worker->keys.data, worker->keys.length, scanKey, &scan);
+    }
+    pthread_rwlock_unlock(&treeLock);
+
+    return !scan.failed && replyHeader(out, '*', scan.count * 2) && bufferAppend(out, worker->items.data, worker->items.length);
+}
+
+static bool executeOther(Worker *worker, const Command *command, CommandKind kind, Buffer *out) {
+    switch (kind) {
+        case CMD_SCAN:
+        case CMD_PREFIX:
+            return executeScan(worker, command, kind, out);
+        case CMD_DBSIZE: {
+            pthread_rwlock_rdlock(&treeLock);
+            size_t size = tree->size;
+            pthread_rwlock_unlock(&treeLock);
+            return replyHeader(out, ':', size);
+        }
+        case CMD_PING:
+            return command->argc == 2 ? replyBulk(out, command->args[1].data, command->args[1].length) : replyStatus(out, "+PONG\r\n");
+        case CMD_COMMAND:
+            return replyStatus(out, "*0\r\n");
+        case CMD_ARITY:
+            return replyStatus(out, "-ERR wrong number of arguments\r\n");
+        default:
+            return replyStatus(out, "-ERR unknown command\r\n");
+    }
+}
+
+// Executes parsed commands in order, sharing one lock acquisition between
+// consecutive reads and between consecutive writes
+static bool executeBatch(Worker *worker, int count, Buffer *out) {
+    Command *commands = worker->commands;
+    for (int i = 0; i < count; ) {
+        CommandKind kind = commandKind(&commands[i]);
+        int end = i + 1;
+
+        if (kind == CMD_GET) {
+            while (end < count && commandKind(&commands[end]) == CMD_GET) {
+                end++;
+            }
+            if (!executeGets(worker, commands + i, end - i, out)) {
+                return false;
+            }
+        } else if (kind == CMD_SET || kind == CMD_DEL) {
+            for (CommandKind next; end < count && ((next = commandKind(&commands[end])) == CMD_SET || next == CMD_DEL); ) {
+                end++;
+            }
+            bool ok = true;
+            pthread_rwlock_wrlock(&treeLock);
+            for (int j = i; j < end && ok; j++) {
+                ok = commandKind(&commands[j]) == CMD_SET ? executeSet(worker, &commands[j], out) : executeDel(worker, &commands[j], out);
+            }
+            pthread_rwlock_unlock(&treeLock);
+            if (!ok) {
+                return false;
+            }
+        } else if (!executeOther(worker, &commands[i], kind, out)) {
+            return false;
+        }
+
+        i = end;
+    }
+    return true;
+}
+
+/*** CONNECTIONS ***/
+
+typedef struct {
+    int fd;
+    Buffer in;
+    Buffer out;
+    size_t sent;
+    bool closing; // Close once the output has been sent
+    uint32_t events; // Events currently registered with epoll
+} Connection;
+
+static void closeConnection(int epoll, Connection *connection) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
+}
+
+// Parses and executes every complete command in the input buffer
+static bool processInput(Worker *worker, Connection *connection) {
+    size_t offset = 0;
+    while (!connection->closing) {
+        int count = 0;
+        int argsUsed = 0;
+        while (count < MAX_BATCH_COMMANDS && offset < connection->in.length) {
+            Command *command = &worker->commands[count];
+            command->args = worker->args + argsUsed;
+            long used = parseCommand(connection->in.data + offset, connection->in.length - offset,
+                                     command->args, MAX_BATCH_ARGS - argsUsed, &command->argc);
+            if (used == INVALID && argsUsed > 0) {
+                break; // Out of argument slots, retry with the next batch
+            }
+            if (used == INVALID) {
+                connection->closing = true;
+                break;
+            }
+            if (used == 0) {
+                break;
+            }
+            offset += used;
+            argsUsed += command->argc;
+            count += command->argc > 0;
+        }
+
+        if (count == 0 && !connection->closing) {
+            break;
+        }
+        if (!executeBatch(worker, count, &connection->out)) {
+            return false;
+        }
+        if (connection->closing) {
+            replyStatus(&connection->out, "-ERR Protocol error\r\n");
+        }
+    }
+
+    bufferConsume(&connection->in, offset);
+    return true;
+}
+
+// Writes pending output. Returns false once the connection should be closed.
+static bool flushOutput(int epoll, Connection *connection) {
+    while (connection->sent < connection->out.length) {
+        ssize_t written = send(connection->fd, connection->out.data + connection->sent,
+                               connection->out.length - connection->sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return false;
+            }
+            break;
+        }
+        connection->sent += written;
+    }
+
+    if (connection->sent == connection->out.length) {
+        connection->out.length = 0;
+        connection->sent = 0;
+        if (connection->closing) {
+            return false;
+        }
+    }
+
+    // Stop reading from clients that do not keep up with their replies
+    size_t pending = connection->out.length - connection->sent;
+    uint32_t events = pending > OUTPUT_HIGH_WATER ? EPOLLOUT : pending > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if (events != connection->events) {
+        struct epoll_event event = { .events = events, .data.ptr = connection };
+        epoll_ctl(epoll, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+    return true;
+}
+
+static bool readInput(Worker *worker, Connection *connection) {
+    if (!bufferReserve(&connection->in, READ_CHUNK)) {
+        return false;
+    }
+    ssize_t received = recv(connection->fd, connection->in.data + connection->in.length, READ_CHUNK, 0);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) {
+        return false;
+    }
+    if (received > 0) {
+        connection->in.length += received;
+        return processInput(worker, connection);
+    }
+    return true;
+}
+
+/*** EVENT LOOP ***/
+
+static int listenSocket = -1;
+
+static void acceptConnections(int epoll) {
+    for (;;) {
+        int fd = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Connection *connection = calloc(1, sizeof(Connection));
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(connection);
+        }
+    }
+}
+
+static void *runWorker(void *arg) {
+    (void)arg;
+    Worker *worker = calloc(1, sizeof(Worker));
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (!worker || epoll < 0) {
+        perror("artd: worker");
+        exit(1);
+    }
+
+    // The listening socket is in every loop, EPOLLEXCLUSIVE wakes only one
+    struct epoll_event listenEvent = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listenSocket, &listenEvent);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int ready = epoll_wait(epoll, events, MAX_EVENTS, 200);
+        for (int i = 0; i < ready; i++) {
+            Connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                acceptConnections(epoll);
+                continue;
+            }
+
+            bool open = true;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                open = false;
+            } else if (events[i].events & EPOLLIN) {
+                open = readInput(worker, connection);
+            }
+            if (open) {
+                open = flushOutput(epoll, connection);
+            }
+            if (!open) {
+                closeConnection(epoll, connection);
+            }
+        }
+    }
+
+    // Connections still open at shutdown are left to process exit
+    close(epoll);
+    free(worker->keys.data);
+    free(worker->items.data);
+    free(worker);
+    return NULL;
+}
+
+static int openListenSocket(const char *path, int port) {
+    int fd;
+    if (path) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(address.sun_path)) {
+            fprintf(stderr, "artd: socket path too long\n");
+            return -1;
+        }
+        strcpy(address.sun_path, path);
+        unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("artd: bind");
+            return -1;
+        }
+    } else {
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("artd: bind");
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("artd: listen");
+        return -1;
+    }
+    return fd;
+}
+
+static void handleSignal(int signal) {
+    (void)signal;
+    stopping = true;
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    int port = 6380;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool hashIndex = false;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:p:t:H")) != -1) {
+        switch (option) {
+            case 's': path = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 't': threads = atol(optarg); break;
+            case 'H': hashIndex = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-s socket-path | -p port] [-t threads] [-H]\n", argv[0]);
+                return 1;
+        }
+    }
+    threads = threads < 1 ? 1 : threads;
+
+    tree = initializeAdaptiveRadixTree();
+    if (tree && hashIndex && !artSetHashIndex(tree, true)) {
+        return 1;
+    }
+    listenSocket = openListenSocket(path, port);
+    if (!tree || listenSocket < 0) {
+        return 1;
+    }
+
+    struct sigaction action = { .sa_handler = handleSignal };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    for (long i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, runWorker, NULL) != 0) {
+            perror("artd: pthread_create");
+            return 1;
+        }
+    }
+    if (path) {
+        fprintf(stderr, "artd: listening on %s with %ld threads\n", path, threads);
+    } else {
+        fprintf(stderr, "artd: listening on 127.0.0.1:%d with %ld threads\n", port, threads);
+    }
+
+    // Keys written with a TTL are reclaimed here, lookups never modify the tree
+    while (!stopping) {
+        usleep(100 * 1000);
+        pthread_rwlock_wrlock(&treeLock);
+        if (tree->timers) {
+            artExpireStep(tree, EXPIRE_BUDGET);
+        }
+        pthread_rwlock_unlock(&treeLock);
+    }
+
+    for (long i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    close(listenSocket);
+    if (path) {
+        unlink(path);
+    }
+    free(workers);
+    freeART(tree);
+    return 0;
+}
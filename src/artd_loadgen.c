@@ -0,0 +1,339 @@
+// artd_loadgen - drives artd with pipelined GET/SET traffic and reports
+// throughput and per-pipeline round trip latency.
+//
+//     cc -O2 -pthread -o artd_loadgen src/artd_loadgen.c
+//     ./artd_loadgen -s /tmp/artd.sock -c 8 -n 1000000 -P 32
+//
+// Options: -s socket path or -p port, -c connections (one thread each),
+// -n total requests, -P pipeline depth, -k key space, -r GET ratio,
+// -d value size in bytes, -f keys to SET before measuring.
+
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *path;
+    int port;
+    int connections;
+    long requests;
+    int pipeline;
+    long keySpace;
+    double getRatio;
+    int valueSize;
+    long prefill;
+} Options;
+
+typedef struct {
+    const Options *options;
+    int index;
+    pthread_barrier_t *start;
+    uint64_t seed;
+    long requests;
+    long gets;
+    long hits;
+    uint64_t *latencies; // Nanoseconds per pipeline round trip
+    long batches;
+    bool failed;
+} Client;
+
+static uint64_t nowNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t nextRandom(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static int connectServer(const Options *options) {
+    int fd;
+    if (options->path) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        strncpy(address.sun_path, options->path, sizeof(address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(options->port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/*** REQUESTS ***/
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void bufferReserve(Buffer *buffer, size_t extra) {
+    if (buffer->length + extra > buffer->capacity) {
+        buffer->capacity = (buffer->length + extra) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (!buffer->data) {
+            perror("artd_loadgen");
+            exit(1);
+        }
+    }
+}
+
+static void appendCommand(Buffer *buffer, long key, const char *value, int valueSize) {
+    char keyText[32];
+    int keyLength = snprintf(keyText, sizeof(keyText), "key:%010ld", key);
+    bufferReserve(buffer, 64 + keyLength + valueSize);
+    if (value) {
+        buffer->length += sprintf(buffer->data + buffer->length, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$%d\r\n", keyLength, keyText, valueSize);
+        memcpy(buffer->data + buffer->length, value, valueSize);
+        buffer->length += valueSize;
+        memcpy(buffer->data + buffer->length, "\r\n", 2);
+        buffer->length += 2;
+    } else {
+        buffer->length += sprintf(buffer->data + buffer->length, "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", keyLength, keyText);
+    }
+}
+
+// Returns the size of the reply at the start of data, 0 if it is
+// incomplete. *hit is cleared for nil replies.
+static size_t replyLength(const char *data, size_t length, bool *hit) {
+    const char *end = memchr(data, '\n', length);
+    if (!end) {
+        return 0;
+    }
+    size_t header = end + 1 - data;
+    long value = atol(data + 1);
+
+    switch (data[0]) {
+        case '$':
+            if (value < 0) {
+                *hit = false;
+                return header;
+            }
+            return length >= header + value + 2 ? header + value + 2 : 0;
+        case '*': {
+            size_t used = header;
+            for (long i = 0; i < value; i++) {
+                size_t item = replyLength(data + used, length - used, hit);
+                if (item == 0) {
+                    return 0;
+                }
+                used += item;
+            }
+            return used;
+        }
+        default:
+            return header;
+    }
+}
+
+static bool sendAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// Reads count replies, counting the GET hits among them
+static bool readReplies(int fd, Buffer *in, int count, long *hits) {
+    size_t offset = 0;
+    while (count > 0) {
+        bool hit = true;
+        size_t used = offset < in->length ? replyLength(in->data + offset, in->length - offset, &hit) : 0;
+        if (used > 0) {
+            offset += used;
+            *hits += hit;
+            count--;
+            continue;
+        }
+
+        memmove(in->data, in->data + offset, in->length - offset);
+        in->length -= offset;
+        offset = 0;
+        bufferReserve(in, 65536);
+        ssize_t received = recv(fd, in->data + in->length, in->capacity - in->length, 0);
+        if (received <= 0) {
+            return false;
+        }
+        in->length += received;
+    }
+
+    memmove(in->data, in->data + offset, in->length - offset);
+    in->length -= offset;
+    return true;
+}
+
+static void *runClient(void *arg) {
+    Client *client = arg;
+    const Options *options = client->options;
+    int fd = connectServer(options);
+    char *value = malloc(options->valueSize + 1);
+    Buffer out = { 0 };
+    Buffer in = { 0 };
+    long ignored = 0;
+
+    if (fd < 0 || !value) {
+        fprintf(stderr, "artd_loadgen: cannot connect\n");
+        client->failed = true;
+        pthread_barrier_wait(client->start);
+        return NULL;
+    }
+    memset(value, 'v', options->valueSize);
+
+    // Each client fills its own slice of the prefilled keys
+    long first = options->prefill * client->index / options->connections;
+    long last = options->prefill * (client->index + 1) / options->connections;
+    for (long key = first; key < last && !client->failed; ) {
+        out.length = 0;
+        int count = 0;
+        for (; count < options->pipeline && key < last; count++, key++) {
+            appendCommand(&out, key, value, options->valueSize);
+        }
+        client->failed = !sendAll(fd, out.data, out.length) || !readReplies(fd, &in, count, &ignored);
+    }
+
+    pthread_barrier_wait(client->start);
+
+    for (long done = 0; done < client->requests && !client->failed; ) {
+        out.length = 0;
+        int count = 0;
+        long gets = 0;
+        for (; count < options->pipeline && done < client->requests; count++, done++) {
+            long key = nextRandom(&client->seed) % options->keySpace;
+            bool get = (nextRandom(&client->seed) >> 11) * 0x1.0p-53 < options->getRatio;
+            appendCommand(&out, key, get ? NULL : value, options->valueSize);
+            gets += get;
+        }
+
+        uint64_t started = nowNanos();
+        long hits = 0;
+        client->failed = !sendAll(fd, out.data, out.length) || !readReplies(fd, &in, count, &hits);
+        client->latencies[client->batches++] = nowNanos() - started;
+        client->gets += gets;
+        // SET replies are never nil, so every miss is a GET
+        client->hits += gets - (count - hits);
+    }
+
+    close(fd);
+    free(value);
+    free(out.data);
+    free(in.data);
+    return NULL;
+}
+
+static int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    Options options = { .port = 6380, .connections = 4, .requests = 1000000, .pipeline = 16,
+                        .keySpace = 100000, .getRatio = 0.9, .valueSize = 32, .prefill = 100000 };
+    int option;
+
+    while ((option = getopt(argc, argv, "s:p:c:n:P:k:r:d:f:")) != -1) {
+        switch (option) {
+            case 's': options.path = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'n': options.requests = atol(optarg); break;
+            case 'P': options.pipeline = atoi(optarg); break;
+            case 'k': options.keySpace = atol(optarg); break;
+            case 'r': options.getRatio = atof(optarg); break;
+            case 'd': options.valueSize = atoi(optarg); break;
+            case 'f': options.prefill = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s path | -p port] [-c connections] [-n requests] [-P pipeline] "
+                                "[-k keyspace] [-r get-ratio] [-d value-size] [-f prefill]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (options.connections < 1 || options.pipeline < 1 || options.keySpace < 1 || options.valueSize < 0) {
+        fprintf(stderr, "artd_loadgen: invalid options\n");
+        return 1;
+    }
+
+    Client *clients = calloc(options.connections, sizeof(Client));
+    pthread_t *threads = calloc(options.connections, sizeof(pthread_t));
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, options.connections + 1);
+
+    for (int i = 0; i < options.connections; i++) {
+        Client *client = &clients[i];
+        client->options = &options;
+        client->index = i;
+        client->start = &start;
+        client->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        client->requests = options.requests / options.connections + (i < options.requests % options.connections);
+        client->latencies = malloc(sizeof(uint64_t) * (client->requests / options.pipeline + 1));
+        pthread_create(&threads[i], NULL, runClient, client);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t started = nowNanos();
+    for (int i = 0; i < options.connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (nowNanos() - started) / 1e9;
+
+    long requests = 0, gets = 0, hits = 0, batches = 0;
+    bool failed = false;
+    for (int i = 0; i < options.connections; i++) {
+        requests += clients[i].requests;
+        gets += clients[i].gets;
+        hits += clients[i].hits;
+        batches += clients[i].batches;
+        failed = failed || clients[i].failed;
+    }
+
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (batches + 1));
+    for (int i = 0, used = 0; i < options.connections; i++) {
+        memcpy(latencies + used, clients[i].latencies, sizeof(uint64_t) * clients[i].batches);
+        used += clients[i].batches;
+    }
+    qsort(latencies, batches, sizeof(uint64_t), compareLatencies);
+
+    printf("%ld requests over %d connections, pipeline %d: %.0f ops/s\n", requests, options.connections, options.pipeline, requests / seconds);
+    printf("GET hit rate %.1f%%\n", gets ? 100.0 * hits / gets : 0.0);
+    if (batches > 0) {
+        printf("pipeline round trip p50 %.1f us, p99 %.1f us\n", latencies[batches / 2] / 1e3, latencies[batches * 99 / 100] / 1e3);
+    }
+
+    for (int i = 0; i < options.connections; i++) {
+        free(clients[i].latencies);
+    }
+    free(latencies);
+    free(clients);
+    free(threads);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,338 @@
+// art_microbench - times the node primitives one at a time, away from the
+// rest of the tree, and reports cycles per operation.
+//
+//     cc -O2 -o art_microbench tests/art_microbench.c src/art.c
+//     ./art_microbench [filter]
+//
+// Only benchmarks whose name contains filter are run. Each result is the
+// best of several rounds; on x86 cycles are read from the time stamp
+// counter, elsewhere nanoseconds are reported instead.
+
+#include "../src/art.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define CYCLE_UNIT "cycles"
+#else
+    #define CYCLE_UNIT "ns"
+#endif
+
+#define ROUNDS 7
+#define LOOKUPS 4096 // Lookups per findChild round
+#define BATCH 1024 // Nodes prepared per addChild and grow round
+
+static const char *filter;
+static Node *leaves[256]; // Distinct children to hang below test nodes
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static uint64_t nextRandom(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool selected(const char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report(const char *name, const char *variant, double perOp) {
+    printf("%-24s %-28s %8.2f %s/op\n", name, variant, perOp, CYCLE_UNIT);
+}
+
+// A result the compiler has to compute
+static volatile uintptr_t sink;
+
+/*** NODES ***/
+
+static Node *makeNode(NodeType type) {
+    switch (type) {
+        case NODE4:
+            return (Node *)makeNode4();
+        case NODE16:
+            return (Node *)makeNode16();
+        case NODE48:
+            return (Node *)makeNode48();
+        default:
+            return (Node *)makeNode256();
+    }
+}
+
+static size_t nodeBytes(NodeType type) {
+    switch (type) {
+        case NODE4:
+            return sizeof(Node4);
+        case NODE16:
+            return sizeof(Node16);
+        case NODE48:
+            return sizeof(Node48);
+        default:
+            return sizeof(Node256);
+    }
+}
+
+static int capacityOf(NodeType type) {
+    static const int capacities[] = { 4, 16, 48, 256 };
+    return capacities[type];
+}
+
+static const char *typeName(NodeType type) {
+    static const char *names[] = { "Node4", "Node16", "Node48", "Node256" };
+    return names[type];
+}
+
+// Node of the given type holding count children on bytes spread evenly
+// over 1..255, written in *bytes
+static Node *makeFilledNode(NodeType type, int count, uint8_t *bytes) {
+    Node *node = makeNode(type);
+    for (int i = 0; i < count; i++) {
+        bytes[i] = 1 + i * 254 / (count > 1 ? count - 1 : 1);
+        node = addChild(node, &bytes[i], leaves[bytes[i]]);
+    }
+    return node;
+}
+
+/*** FINDCHILD ***/
+
+typedef Node *(*FindFunc)(Node *node, char byte);
+
+static double timeFind(FindFunc find, Node *node, const uint8_t *probes) {
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < ROUNDS; round++) {
+        uintptr_t found = 0;
+        uint64_t start = cycles();
+        for (int i = 0; i < LOOKUPS; i++) {
+            found += (uintptr_t)find(node, probes[i]);
+        }
+        uint64_t elapsed = cycles() - start;
+        sink = found;
+        best = elapsed < best ? elapsed : best;
+    }
+    return (double)best / LOOKUPS;
+}
+
+static void benchFindChild(void) {
+    if (!selected("findChild")) {
+        return;
+    }
+
+    static uint8_t hits[LOOKUPS];
+    static uint8_t misses[LOOKUPS];
+    for (NodeType type = NODE4; type <= NODE256; type++) {
+        int capacity = capacityOf(type);
+        // Byte 0 is kept free for misses, so a Node256 holds at most 255
+        int fills[] = { 1, capacity / 2, type == NODE256 ? capacity - 1 : capacity };
+        for (int f = 0; f < 3; f++) {
+            uint8_t bytes[256];
+            Node *node = makeFilledNode(type, fills[f], bytes);
+            uint64_t seed = 42;
+            for (int i = 0; i < LOOKUPS; i++) {
+                hits[i] = bytes[nextRandom(&seed) % fills[f]];
+                misses[i] = 0;
+            }
+
+            char variant[64];
+            snprintf(variant, sizeof(variant), "%s %d/%d hit", typeName(type), fills[f], capacity);
+            report("findChildBinary", variant, timeFind(findChildBinary, node, hits));
+#ifdef __SSE2__
+            report("findChildSSE", variant, timeFind(findChildSSE, node, hits));
+#endif
+            snprintf(variant, sizeof(variant), "%s %d/%d miss", typeName(type), fills[f], capacity);
+            report("findChildBinary", variant, timeFind(findChildBinary, node, misses));
+#ifdef __SSE2__
+            report("findChildSSE", variant, timeFind(findChildSSE, node, misses));
+#endif
+            free(node);
+        }
+    }
+}
+
+/*** ADDCHILD ***/
+
+// Takes out the child at position (the slot for Node48, the byte for
+// Node256) and returns its byte
+static uint8_t removeChildAt(Node *node, int position) {
+    uint8_t byte = 0;
+    switch (node->type) {
+        case NODE4:
+        case NODE16: {
+            uint8_t *keys = node->type == NODE4 ? ((Node4 *)node)->keys : ((Node16 *)node)->keys;
+            Node **children = node->type == NODE4 ? ((Node4 *)node)->children : ((Node16 *)node)->children;
+            byte = keys[position];
+            memmove(keys + position, keys + position + 1, node->count - position - 1);
+            memmove(children + position, children + position + 1, sizeof(Node *) * (node->count - position - 1));
+            break;
+        }
+        case NODE48: {
+            Node48 *node48 = (Node48 *)node;
+            while (node48->keys[byte] != position + 1) {
+                byte++;
+            }
+            node48->keys[byte] = EMPTY_KEY;
+            node48->children[position] = NULL;
+            break;
+        }
+        default:
+            byte = position;
+            ((Node256 *)node)->children[byte] = NULL;
+            break;
+    }
+    node->count--;
+    return byte;
+}
+
+// Adds one child to each of BATCH copies of a node one child short of
+// full, so that no grow happens. The free position is where a Node4 or
+// Node16 has to shift from and where a Node48 finds its free slot.
+static void benchAddChild(void) {
+    if (!selected("addChild")) {
+        return;
+    }
+
+    static const char *positions[] = { "front", "middle", "back" };
+    for (NodeType type = NODE4; type <= NODE256; type++) {
+        int capacity = capacityOf(type);
+        size_t size = nodeBytes(type);
+        uint8_t *copies = malloc(size * BATCH);
+
+        for (int p = 0; p < 3; p++) {
+            Node *template = makeNode(type);
+            for (int i = 0; i < capacity; i++) {
+                uint8_t byte = type == NODE256 ? i : 2 + 2 * i;
+                template = addChild(template, &byte, leaves[byte]);
+            }
+            uint8_t byte = removeChildAt(template, p == 0 ? 0 : p == 1 ? (capacity - 1) / 2 : capacity - 1);
+
+            uint64_t best = UINT64_MAX;
+            for (int round = 0; round < ROUNDS; round++) {
+                for (int i = 0; i < BATCH; i++) {
+                    memcpy(copies + i * size, template, size);
+                }
+                uint64_t start = cycles();
+                for (int i = 0; i < BATCH; i++) {
+                    addChild((Node *)(copies + i * size), &byte, leaves[byte]);
+                }
+                uint64_t elapsed = cycles() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+
+            char name[32];
+            snprintf(name, sizeof(name), "addChildTo%s", typeName(type));
+            report(name, positions[p], (double)best / BATCH);
+            free(template);
+        }
+        free(copies);
+    }
+}
+
+/*** GROW ***/
+
+static void benchGrow(void) {
+    if (!selected("grow")) {
+        return;
+    }
+
+    static const char *names[] = { "growFromNode4toNode16", "growFromNode16toNode48", "growFromNode48toNode256" };
+    static Node *(*const grows[])(Node **) = { growFromNode4toNode16, growFromNode16toNode48, growFromNode48toNode256 };
+    Node **nodes = malloc(sizeof(Node *) * BATCH);
+
+    for (NodeType type = NODE4; type <= NODE48; type++) {
+        uint8_t bytes[256];
+        Node *template = makeFilledNode(type, capacityOf(type), bytes);
+        size_t size = nodeBytes(type);
+
+        uint64_t best = UINT64_MAX;
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < BATCH; i++) {
+                nodes[i] = malloc(size);
+                memcpy(nodes[i], template, size);
+            }
+            // Includes allocating the bigger node and freeing the old one
+            uint64_t start = cycles();
+            for (int i = 0; i < BATCH; i++) {
+                grows[type](&nodes[i]);
+            }
+            uint64_t elapsed = cycles() - start;
+            best = elapsed < best ? elapsed : best;
+            for (int i = 0; i < BATCH; i++) {
+                free(nodes[i]);
+            }
+        }
+
+        report(names[type], "full", (double)best / BATCH);
+        free(template);
+    }
+    free(nodes);
+}
+
+/*** CHECKPREFIX ***/
+
+static void benchCheckPrefix(void) {
+    if (!selected("checkPrefix")) {
+        return;
+    }
+
+    static const int lengths[] = { 0, 4, 8, 16, MAX_PREFIX_LENGTH };
+    char key[MAX_PREFIX_LENGTH + 17];
+    memset(key, 'p', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+
+    for (int l = 0; l < 5; l++) {
+        Node *node = (Node *)makeNode4();
+        setPrefix(node, key, lengths[l]);
+
+        // A full match, then a mismatch on the last prefix byte
+        for (int mismatch = 0; mismatch < 2; mismatch++) {
+            if (mismatch) {
+                if (lengths[l] == 0) {
+                    break;
+                }
+                node->prefix[lengths[l] - 1] ^= 1;
+            }
+
+            uint64_t best = UINT64_MAX;
+            for (int round = 0; round < ROUNDS; round++) {
+                uintptr_t matched = 0;
+                uint64_t start = cycles();
+                for (int i = 0; i < LOOKUPS; i++) {
+                    matched += checkPrefix(node, key, 0);
+                }
+                uint64_t elapsed = cycles() - start;
+                sink = matched;
+                best = elapsed < best ? elapsed : best;
+            }
+
+            char variant[64];
+            snprintf(variant, sizeof(variant), "prefix %d, %s", lengths[l], mismatch ? "mismatch" : "match");
+            report("checkPrefix", variant, (double)best / LOOKUPS);
+        }
+        free(node);
+    }
+}
+
+int main(int argc, char **argv) {
+    filter = argc > 1 ? argv[1] : NULL;
+    for (int i = 0; i < 256; i++) {
+        leaves[i] = (Node *)makeLeafNode("leaf", NULL, 5, 0);
+    }
+
+    benchFindChild();
+    benchAddChild();
+    benchGrow();
+    benchCheckPrefix();
+
+    for (int i = 0; i < 256; i++) {
+        free(leaves[i]);
+    }
+    return 0;
+}
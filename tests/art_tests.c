@@ -121,21 +121,1504 @@ void test_integratedARTExpansion(void) {
         insertString(&tree->root, keys[i], values[i], strlen(values[i]) + 1);
     }
 
-    // Verifica se l'albero si è espanso a NODE48 o a un altro tipo di nodo appropriato.
-    TEST_ASSERT_MESSAGE(tree->root->type == NODE48, "Root should have expanded to a NODE48 type.");
+    // Le chiavi condividono "key" e differiscono solo in una cifra dopo di esso:
+    // il prefisso resta nella radice, che ha 9 figli ('1'..'9') e rimane NODE16.
+    TEST_ASSERT_MESSAGE(tree->root->type == NODE16, "Root should stay a NODE16 under the shared prefix.");
+    TEST_ASSERT_EQUAL_UINT(3, tree->root->prefixLen);
+    TEST_ASSERT_EQUAL_MEMORY("key", tree->root->prefix, 3);
+    TEST_ASSERT_EQUAL_UINT(9, tree->root->count);
 
     // Effettua una ricerca per verificare che i valori possano essere correttamente recuperati dopo l'espansione.
-    for (int i = 0; i < 20; i++) {  
-        Node *found = findChild(tree->root, keys[i][0]);
-        TEST_ASSERT_NOT_NULL(found);
-        // Assumi che 'found' sia un LeafNode e verifica che il valore sia corretto.
-        LeafNode *leaf = (LeafNode *)found;
-        TEST_ASSERT_EQUAL_STRING(values[i], leaf->value);
+    for (int i = 0; i < 18; i++) {
+        TEST_ASSERT_EQUAL_STRING(values[i], artSearch(tree, keys[i], strlen(keys[i]) + 1));
     }
+    TEST_ASSERT_NULL(artSearch(tree, keys[18], strlen(keys[18]) + 1));
 
     freeART(tree);
 }
 
+void test_artInsertAndSearch(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+
+    // Enough keys to push inner nodes through every node type
+    for (int i = 0; i < 5000; i++) {
+        int value = i * 2;
+        TEST_ASSERT_TRUE(artInsert(tree, &i, sizeof(i), &value, sizeof(value)));
+    }
+    TEST_ASSERT_EQUAL_UINT(5000, tree->size);
+
+    for (int i = 0; i < 5000; i++) {
+        int *value = artSearch(tree, &i, sizeof(i));
+        TEST_ASSERT_NOT_NULL(value);
+        TEST_ASSERT_EQUAL_INT(i * 2, *value);
+    }
+
+    int missing = 5000;
+    TEST_ASSERT_NULL(artSearch(tree, &missing, sizeof(missing)));
+
+    // Inserting an existing key replaces its value
+    int key = 42, value = -1;
+    TEST_ASSERT_TRUE(artInsert(tree, &key, sizeof(key), &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_UINT(5000, tree->size);
+    TEST_ASSERT_EQUAL_INT(-1, *(int *)artSearch(tree, &key, sizeof(key)));
+    freeART(tree);
+
+    // Prefix keys are refused wherever they end, above an inner node too
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artInsert(tree, "abc", 3, &value, sizeof(value)));
+    TEST_ASSERT_TRUE(artInsert(tree, "abd", 3, &value, sizeof(value)));
+    TEST_ASSERT_FALSE(artInsert(tree, "ab", 2, &value, sizeof(value)));
+    TEST_ASSERT_FALSE(artInsert(tree, "a", 1, &value, sizeof(value)));
+    TEST_ASSERT_FALSE(artInsert(tree, "abc\0", 4, &value, sizeof(value)));
+    TEST_ASSERT_TRUE(artInsert(tree, "abe", 3, &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_UINT(3, tree->size);
+    TEST_ASSERT_NULL(artSearch(tree, "ab", 2));
+    freeART(tree);
+}
+
+void test_leafBuckets(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_FALSE(artSetLeafBuckets(tree, MAX_BUCKET_CAPACITY + 1));
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, 16));
+
+    char key[32];
+    for (int i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "user:%d", i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+    // Ten keys fit in a single bucket, no inner node is needed yet
+    TEST_ASSERT_EQUAL(BUCKET, tree->root->type);
+    TEST_ASSERT_EQUAL(10, tree->root->count);
+
+    for (int i = 10; i < 3000; i++) {
+        snprintf(key, sizeof(key), "user:%d", i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+    TEST_ASSERT_NOT_EQUAL(BUCKET, tree->root->type);
+    TEST_ASSERT_EQUAL_UINT(3000, tree->size);
+
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "user:%d", i);
+        int *value = artSearch(tree, key, strlen(key) + 1);
+        TEST_ASSERT_NOT_NULL(value);
+        TEST_ASSERT_EQUAL_INT(i, *value);
+    }
+    TEST_ASSERT_NULL(artSearch(tree, "user:3000", strlen("user:3000") + 1));
+    freeART(tree);
+
+    // A key that is a prefix of another is refused as a single leaf
+    // would refuse it, so a full bucket can always be split
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, 4));
+    TEST_ASSERT_TRUE(artInsert(tree, "ab", 2, key, 1));
+    TEST_ASSERT_TRUE(artInsert(tree, "ac", 2, key, 1));
+    TEST_ASSERT_EQUAL(BUCKET, tree->root->type);
+    TEST_ASSERT_FALSE(artInsert(tree, "ab\0", 3, key, 1));
+    TEST_ASSERT_FALSE(artInsert(tree, "abc", 3, key, 1));
+    TEST_ASSERT_FALSE(artInsert(tree, "a", 1, key, 1));
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "b%d", i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, key, 1));
+    }
+    TEST_ASSERT_EQUAL_UINT(22, tree->size);
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "ab", 2));
+    TEST_ASSERT_NULL(artSearch(tree, "ab\0", 3));
+    freeART(tree);
+}
+
+typedef struct {
+    int visited;
+    char previous[128];
+    bool ordered;
+    bool keysMatchValues;
+} IterateCheck;
+
+static int checkIteratedKey(void *data, const uint8_t *key, size_t keyLength, void *value) {
+    IterateCheck *check = data;
+    if (check->visited > 0 && strcmp(check->previous, (const char *)key) >= 0) {
+        check->ordered = false;
+    }
+    // Every value is a copy of its own key
+    if (keyLength != strlen(value) + 1 || memcmp(key, value, keyLength) != 0) {
+        check->keysMatchValues = false;
+    }
+    memcpy(check->previous, key, keyLength);
+    check->visited++;
+    return 0;
+}
+
+static void insertUrls(ART *tree, int count) {
+    char url[128];
+    for (int i = 0; i < count; i++) {
+        snprintf(url, sizeof(url), "https://example.com/catalog/electronics/computers/laptops/item-%05d?ref=%d", (i * 7919) % count, i % 3);
+        TEST_ASSERT_TRUE(artInsert(tree, url, strlen(url) + 1, url, strlen(url) + 1));
+    }
+}
+
+void test_leafSuffixes(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, true));
+    insertUrls(tree, 2000);
+
+    // Leaves no longer hold the shared part of the URL
+    Node *node = tree->root;
+    while (node->type != LEAF) {
+        node = findChild(node, (char)((Node4 *)node)->keys[0]);
+    }
+    TEST_ASSERT_TRUE(((LeafNode *)node)->keyLength < 16);
+
+    char url[128];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(url, sizeof(url), "https://example.com/catalog/electronics/computers/laptops/item-%05d?ref=%d", (i * 7919) % 2000, i % 3);
+        char *value = artSearch(tree, url, strlen(url) + 1);
+        TEST_ASSERT_NOT_NULL(value);
+        TEST_ASSERT_EQUAL_STRING(url, value);
+    }
+    TEST_ASSERT_NULL(artSearch(tree, "https://example.com/", strlen("https://example.com/") + 1));
+
+    IterateCheck check = { .ordered = true, .keysMatchValues = true };
+    TEST_ASSERT_EQUAL_INT(0, artIterate(tree, checkIteratedKey, &check));
+    TEST_ASSERT_EQUAL_INT(2000, check.visited);
+    TEST_ASSERT_TRUE(check.ordered);
+    TEST_ASSERT_TRUE(check.keysMatchValues);
+
+    // The layout cannot change once the tree holds keys
+    TEST_ASSERT_FALSE(artSetLeafSuffixes(tree, false));
+
+    freeART(tree);
+}
+
+void test_leafSuffixesWithBuckets(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, true));
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, 32));
+    insertUrls(tree, 2000);
+
+    IterateCheck check = { .ordered = true, .keysMatchValues = true };
+    TEST_ASSERT_EQUAL_INT(0, artIterate(tree, checkIteratedKey, &check));
+    TEST_ASSERT_EQUAL_INT(2000, check.visited);
+    TEST_ASSERT_TRUE(check.ordered);
+    TEST_ASSERT_TRUE(check.keysMatchValues);
+
+    freeART(tree);
+}
+
+void test_valueLog(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetValueLog(tree, 256, 16 * 1024));
+
+    char payload[1024];
+    char key[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "blob:%d", i);
+        memset(payload, 'a' + i % 26, sizeof(payload));
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, payload, sizeof(payload)));
+    }
+    // Small values are still allocated next to their leaf
+    int small = 7;
+    TEST_ASSERT_TRUE(artInsert(tree, "small", 6, &small, sizeof(small)));
+    TEST_ASSERT_EQUAL_INT(7, *(int *)artSearch(tree, "small", 6));
+
+    size_t segmentsBefore = 0;
+    for (uint32_t i = 0; i < tree->valueLog->segmentCount; i++) {
+        segmentsBefore += tree->valueLog->segments[i].data != NULL;
+    }
+    TEST_ASSERT_TRUE(segmentsBefore > 1);
+
+    // Rewriting all but a few values leaves the old segments mostly dead
+    for (int i = 0; i < 200; i++) {
+        if (i % 50 == 0) {
+            continue;
+        }
+        snprintf(key, sizeof(key), "blob:%d", i);
+        memset(payload, 'A' + i % 26, sizeof(payload));
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, payload, sizeof(payload)));
+    }
+    TEST_ASSERT_TRUE(artValueLogCollect(tree, 0.5) > 0);
+
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "blob:%d", i);
+        char *value = artSearch(tree, key, strlen(key) + 1);
+        TEST_ASSERT_NOT_NULL(value);
+        TEST_ASSERT_EQUAL_CHAR((i % 50 == 0 ? 'a' : 'A') + i % 26, value[0]);
+        TEST_ASSERT_EQUAL_CHAR(value[0], value[sizeof(payload) - 1]);
+    }
+
+    freeART(tree);
+}
+
+void test_artDelete(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    for (int i = 0; i < 5000; i++) {
+        TEST_ASSERT_TRUE(artInsert(tree, &i, sizeof(i), &i, sizeof(i)));
+    }
+
+    for (int i = 0; i < 5000; i += 2) {
+        TEST_ASSERT_TRUE(artDelete(tree, &i, sizeof(i)));
+    }
+    int missing = 5000;
+    TEST_ASSERT_FALSE(artDelete(tree, &missing, sizeof(missing)));
+    TEST_ASSERT_EQUAL_UINT(2500, tree->size);
+
+    for (int i = 0; i < 5000; i++) {
+        int *value = artSearch(tree, &i, sizeof(i));
+        if (i % 2 == 0) {
+            TEST_ASSERT_NULL(value);
+        } else {
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT(i, *value);
+        }
+    }
+
+    for (int i = 1; i < 5000; i += 2) {
+        TEST_ASSERT_TRUE(artDelete(tree, &i, sizeof(i)));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, tree->size);
+    TEST_ASSERT_NULL(tree->root);
+
+    freeART(tree);
+}
+
+static int countKeys(void *data, const uint8_t *key, size_t keyLength, void *value) {
+    (void)key;
+    (void)keyLength;
+    (void)value;
+    (*(int *)data)++;
+    return 0;
+}
+
+static void checkRangeDelete(bool buckets, bool suffixes) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, buckets ? 16 : 0));
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, suffixes));
+
+    char key[48];
+    for (int tenant = 0; tenant < 20; tenant++) {
+        for (int i = 0; i < 300; i++) {
+            snprintf(key, sizeof(key), "tenant:%02d:row:%04d", tenant, i);
+            TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+        }
+    }
+
+    TEST_ASSERT_EQUAL_UINT(300, artDeletePrefix(tree, "tenant:07:", strlen("tenant:07:")));
+    TEST_ASSERT_EQUAL_UINT(0, artDeletePrefix(tree, "tenant:07:", strlen("tenant:07:")));
+    TEST_ASSERT_EQUAL_UINT(19 * 300, tree->size);
+    TEST_ASSERT_NULL(artSearch(tree, "tenant:07:row:0005", strlen("tenant:07:row:0005") + 1));
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "tenant:06:row:0299", strlen("tenant:06:row:0299") + 1));
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "tenant:08:row:0000", strlen("tenant:08:row:0000") + 1));
+
+    // From the middle of tenant 2 up to, not including, row 150 of tenant 4
+    const char *lo = "tenant:02:row:0100";
+    const char *hi = "tenant:04:row:0150";
+    TEST_ASSERT_EQUAL_UINT(200 + 300 + 150, artDeleteRange(tree, lo, strlen(lo) + 1, hi, strlen(hi) + 1));
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "tenant:02:row:0099", strlen("tenant:02:row:0099") + 1));
+    TEST_ASSERT_NULL(artSearch(tree, lo, strlen(lo) + 1));
+    TEST_ASSERT_NULL(artSearch(tree, "tenant:04:row:0149", strlen("tenant:04:row:0149") + 1));
+    TEST_ASSERT_NOT_NULL(artSearch(tree, hi, strlen(hi) + 1));
+
+    // Open ended ranges
+    TEST_ASSERT_EQUAL_UINT(300, artDeleteRange(tree, "tenant:19", strlen("tenant:19"), NULL, 0));
+    TEST_ASSERT_EQUAL_UINT(100, artDeleteRange(tree, NULL, 0, "tenant:00:row:0100", strlen("tenant:00:row:0100")));
+
+    size_t expected = 19 * 300 - 650 - 300 - 100;
+    TEST_ASSERT_EQUAL_UINT(expected, tree->size);
+    int visited = 0;
+    artIterate(tree, countKeys, &visited);
+    TEST_ASSERT_EQUAL_INT(expected, visited);
+
+    TEST_ASSERT_EQUAL_UINT(expected, artDeletePrefix(tree, "", 0));
+    TEST_ASSERT_NULL(tree->root);
+
+    freeART(tree);
+}
+
+void test_artDeleteRangeAndPrefix(void) {
+    checkRangeDelete(false, false);
+    checkRangeDelete(true, false);
+    checkRangeDelete(false, true);
+    checkRangeDelete(true, true);
+}
+
+static void checkRangeIteration(bool buckets, bool suffixes) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, buckets ? 16 : 0));
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, suffixes));
+
+    char key[48];
+    for (int tenant = 0; tenant < 10; tenant++) {
+        for (int i = 0; i < 200; i++) {
+            snprintf(key, sizeof(key), "tenant:%02d:row:%04d", tenant, i);
+            TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, key, strlen(key) + 1));
+        }
+    }
+
+    IterateCheck check = { .ordered = true, .keysMatchValues = true };
+    TEST_ASSERT_EQUAL_INT(0, artIteratePrefix(tree, "tenant:03:", strlen("tenant:03:"), checkIteratedKey, &check));
+    TEST_ASSERT_EQUAL_INT(200, check.visited);
+    TEST_ASSERT_EQUAL_STRING("tenant:03:row:0199", check.previous);
+    TEST_ASSERT_TRUE(check.ordered);
+    TEST_ASSERT_TRUE(check.keysMatchValues);
+
+    const char *lo = "tenant:02:row:0150";
+    const char *hi = "tenant:05:row:0010";
+    check = (IterateCheck){ .ordered = true, .keysMatchValues = true };
+    TEST_ASSERT_EQUAL_INT(0, artIterateRange(tree, lo, strlen(lo) + 1, hi, strlen(hi) + 1, checkIteratedKey, &check));
+    TEST_ASSERT_EQUAL_INT(50 + 400 + 10, check.visited);
+    TEST_ASSERT_EQUAL_STRING("tenant:05:row:0009", check.previous);
+    TEST_ASSERT_TRUE(check.ordered);
+
+    int visited = 0;
+    artIterateRange(tree, "tenant:09", strlen("tenant:09"), NULL, 0, countKeys, &visited);
+    TEST_ASSERT_EQUAL_INT(200, visited);
+    visited = 0;
+    artIterateRange(tree, NULL, 0, NULL, 0, countKeys, &visited);
+    TEST_ASSERT_EQUAL_INT(2000, visited);
+    visited = 0;
+    artIteratePrefix(tree, "tenant:1", strlen("tenant:1"), countKeys, &visited);
+    TEST_ASSERT_EQUAL_INT(0, visited);
+
+    freeART(tree);
+}
+
+void test_artIterateRangeAndPrefix(void) {
+    checkRangeIteration(false, false);
+    checkRangeIteration(true, false);
+    checkRangeIteration(false, true);
+    checkRangeIteration(true, true);
+}
+
+void test_artSearchBatch(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    char urls[100][128];
+    const void *keys[100];
+    size_t keyLengths[100];
+    void *values[100];
+
+    // Only every other key is inserted
+    for (int i = 0; i < 100; i++) {
+        snprintf(urls[i], sizeof(urls[i]), "https://example.com/catalog/electronics/computers/laptops/item-%05d", i * 37);
+        keys[i] = urls[i];
+        keyLengths[i] = strlen(urls[i]) + 1;
+        if (i % 2 == 0) {
+            TEST_ASSERT_TRUE(artInsert(tree, urls[i], keyLengths[i], &i, sizeof(i)));
+        }
+    }
+
+    TEST_ASSERT_EQUAL_UINT(50, artSearchBatch(tree, keys, keyLengths, 100, values));
+    for (int i = 0; i < 100; i++) {
+        if (i % 2 == 0) {
+            TEST_ASSERT_NOT_NULL(values[i]);
+            TEST_ASSERT_EQUAL_INT(i, *(int *)values[i]);
+        } else {
+            TEST_ASSERT_NULL(values[i]);
+        }
+    }
+
+    freeART(tree);
+}
+
+void test_hashIndex(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, 8));
+    static char urls[3000][96];
+    const void *keys[3000];
+    size_t keyLengths[3000];
+    void *values[3000];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(urls[i], sizeof(urls[i]), "https://example.com/catalog/electronics/item-%05d", i);
+        keys[i] = urls[i];
+        keyLengths[i] = strlen(urls[i]) + 1;
+    }
+
+    // The index picks up the keys already in the tree, then follows inserts
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_TRUE(artInsert(tree, urls[i], keyLengths[i], &i, sizeof(i)));
+    }
+    TEST_ASSERT_TRUE(artSetHashIndex(tree, true));
+    TEST_ASSERT_FALSE(artSetLeafSuffixes(tree, true));
+    for (int i = 1000; i < 3000; i++) {
+        TEST_ASSERT_TRUE(artInsert(tree, urls[i], keyLengths[i], &i, sizeof(i)));
+    }
+    TEST_ASSERT_EQUAL_UINT(3000, tree->hashIndex->count);
+
+    // Single deletes and a range delete both leave the index
+    for (int i = 0; i < 3000; i += 3) {
+        TEST_ASSERT_TRUE(artDelete(tree, urls[i], keyLengths[i]));
+    }
+    TEST_ASSERT_EQUAL_UINT(67, artDeletePrefix(tree, "https://example.com/catalog/electronics/item-020", strlen("https://example.com/catalog/electronics/item-020")));
+    TEST_ASSERT_EQUAL_UINT(tree->size, tree->hashIndex->count);
+
+    size_t found = artSearchBatch(tree, keys, keyLengths, 3000, values);
+    TEST_ASSERT_EQUAL_UINT(tree->size, found);
+    for (int i = 0; i < 3000; i++) {
+        bool present = i % 3 != 0 && (i < 2000 || i >= 2100);
+        void *value = artSearch(tree, urls[i], keyLengths[i]);
+        TEST_ASSERT_EQUAL(present, value != NULL);
+        TEST_ASSERT_EQUAL_PTR(value, values[i]);
+        if (present) {
+            TEST_ASSERT_EQUAL_INT(i, *(int *)value);
+        }
+    }
+
+    TEST_ASSERT_TRUE(artSetHashIndex(tree, false));
+    TEST_ASSERT_NULL(tree->hashIndex);
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artSearch(tree, urls[1], keyLengths[1]));
+    freeART(tree);
+}
+
+void test_subtreeFilters(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    char key[48];
+    for (int i = 0; i < 4000; i++) {
+        snprintf(key, sizeof(key), "tenant/%c/user-%05d", 'a' + i % 8, i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+
+    // Filters split on the byte below the root's "tenant/" prefix
+    TEST_ASSERT_TRUE(artSetSubtreeFilters(tree, true));
+    TEST_ASSERT_EQUAL_UINT(7, tree->filters->depth);
+    TEST_ASSERT_EQUAL_UINT(500, tree->filters->filters['c'].keys);
+    for (int i = 4000; i < 8000; i++) {
+        snprintf(key, sizeof(key), "tenant/%c/user-%05d", 'a' + i % 8, i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+    TEST_ASSERT_EQUAL_UINT(1000, tree->filters->filters['c'].keys);
+
+    // Absent keys in filtered subtrees, and in subtrees without keys
+    for (int i = 0; i < 16000; i++) {
+        snprintf(key, sizeof(key), "tenant/%c/user-%05d", 'a' + i % 16, i);
+        int *value = artSearch(tree, key, strlen(key) + 1);
+        if (i < 8000 && i % 16 < 8) {
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT(i, *value);
+        } else {
+            TEST_ASSERT_NULL(value);
+        }
+    }
+
+    // An emptied subtree loses its filter, deletes elsewhere keep working
+    TEST_ASSERT_EQUAL_UINT(1000, artDeletePrefix(tree, "tenant/b/", strlen("tenant/b/")));
+    TEST_ASSERT_NULL(tree->filters->filters['b'].blocks);
+    for (int i = 2; i < 8000; i += 8) {
+        snprintf(key, sizeof(key), "tenant/c/user-%05d", i);
+        TEST_ASSERT_TRUE(artDelete(tree, key, strlen(key) + 1));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, tree->filters->filters['c'].keys);
+    TEST_ASSERT_NULL(tree->filters->filters['c'].blocks);
+    snprintf(key, sizeof(key), "tenant/d/user-%05d", 3);
+    TEST_ASSERT_EQUAL_INT(3, *(int *)artSearch(tree, key, strlen(key) + 1));
+    const void *keys[3] = { key, "tenant/b/user-00001", "tenant/d/user-00004" };
+    size_t keyLengths[3] = { strlen(key) + 1, 20, 20 };
+    void *values[3];
+    TEST_ASSERT_EQUAL_UINT(1, artSearchBatch(tree, keys, keyLengths, 3, values));
+    TEST_ASSERT_EQUAL_INT(3, *(int *)values[0]);
+
+    TEST_ASSERT_FALSE(artSetLeafSuffixes(tree, true));
+    freeART(tree);
+}
+
+void test_insertBatch(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    static char keys[600][16];
+    static int numbers[600];
+    const void *keyPointers[600];
+    const void *values[600];
+    size_t keyLengths[600];
+    size_t valueLengths[600];
+    // 300 distinct keys in reverse order, then the first 300 again with new values
+    for (int i = 0; i < 600; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "%c%03d", 0x20 + (299 - i % 300) % 100, 299 - i % 300);
+        numbers[i] = i;
+        keyPointers[i] = keys[i];
+        keyLengths[i] = strlen(keys[i]) + 1;
+        values[i] = &numbers[i];
+        valueLengths[i] = sizeof(int);
+    }
+
+    TEST_ASSERT_EQUAL_UINT(600, artInsertBatch(tree, keyPointers, keyLengths, values, valueLengths, 600));
+    TEST_ASSERT_EQUAL_UINT(300, tree->size);
+    TEST_ASSERT_EQUAL_UINT(300, tree->root->subtreeSize);
+    // 100 first bytes make the root a Node256 at once
+    TEST_ASSERT_EQUAL_INT(NODE256, tree->root->type);
+    for (int i = 0; i < 300; i++) {
+        TEST_ASSERT_EQUAL_INT(i + 300, *(int *)artSearch(tree, keys[i], keyLengths[i]));
+    }
+
+    // Keys next to existing ones, a prefix key is refused
+    const void *sortedKeys[3] = { "!000", "!0001", "~new" };
+    size_t sortedLengths[3] = { 4, 6, 5 };
+    TEST_ASSERT_EQUAL_UINT(2, artInsertBatch(tree, sortedKeys, sortedLengths, values, valueLengths, 3));
+    TEST_ASSERT_EQUAL_UINT(302, tree->size);
+    TEST_ASSERT_EQUAL_INT(2, *(int *)artSearch(tree, "~new", 5));
+    freeART(tree);
+}
+
+void test_appendPath(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    uint8_t key[8];
+    // Big endian counters, the last byte fans out over 256 children
+    for (uint64_t i = 0; i < 3 * 256 + 10; i++) {
+        for (int b = 0; b < 8; b++) {
+            key[b] = (uint8_t)((i + 0x100000000) >> (56 - 8 * b));
+        }
+        TEST_ASSERT_TRUE(artInsert(tree, key, 8, &i, sizeof(i)));
+    }
+    AppendPath *path = tree->appendPath;
+    TEST_ASSERT_NOT_NULL(path);
+    TEST_ASSERT_TRUE(path->known);
+    TEST_ASSERT_EQUAL_MEMORY(key, path->maxKey, 8);
+    TEST_ASSERT_EQUAL_INT(LEAF, (*path->refs[path->length - 1])->type);
+    // The last node was sized like its full left sibling right away
+    TEST_ASSERT_EQUAL_INT(NODE256, (*path->refs[path->length - 2])->type);
+    TEST_ASSERT_EQUAL_UINT(3 * 256 + 10, tree->root->subtreeSize);
+
+    // A smaller key and a delete drop the path, the next append finds it again
+    TEST_ASSERT_TRUE(artInsert(tree, "\x00\x00\x00\x00\x00", 5, key, 1));
+    TEST_ASSERT_EQUAL_UINT(0, path->length);
+    TEST_ASSERT_TRUE(artDelete(tree, key, 8));
+    TEST_ASSERT_FALSE(path->known);
+    key[7]++;
+    TEST_ASSERT_TRUE(artInsert(tree, key, 8, key, 1));
+    TEST_ASSERT_TRUE(path->known);
+    TEST_ASSERT_EQUAL_MEMORY(key, path->maxKey, 8);
+    TEST_ASSERT_EQUAL_UINT(3 * 256 + 11, tree->size);
+    TEST_ASSERT_EQUAL_UINT(3 * 256 + 11, tree->root->subtreeSize);
+    freeART(tree);
+
+    // A range that deletes nothing can still shrink the presized node
+    // under the path, the next append must not walk into it
+    tree = initializeAdaptiveRadixTree();
+    uint8_t small[3];
+    for (int a = 0; a < 2; a++) {
+        for (int b = 0; b < (a ? 4 : 40); b++) {
+            for (int c = 0; c < 2; c++) {
+                small[0] = (uint8_t)a, small[1] = (uint8_t)b, small[2] = (uint8_t)c;
+                TEST_ASSERT_TRUE(artInsert(tree, small, 3, small, 1));
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT(0, artDeleteRange(tree, "\x01\x03\x05", 3, "\x01\x03\x06", 3));
+    TEST_ASSERT_TRUE(artInsert(tree, "\x01\x03\x09", 3, small, 1));
+    TEST_ASSERT_EQUAL_UINT(89, tree->size);
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "\x01\x03\x09", 3));
+    freeART(tree);
+}
+
+void test_cursorSeek(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "k%04d", i * 2);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, key, 1));
+    }
+
+    ArtCursor cursor;
+    artCursorInit(&cursor, tree);
+    size_t keyLength;
+    // Exact hits and keys in between land on the next key at or above
+    for (int i = 0; i < 1999; i += 37) {
+        snprintf(key, sizeof(key), "k%04d", i);
+        TEST_ASSERT_TRUE(artCursorSeek(&cursor, key, strlen(key) + 1));
+        snprintf(key, sizeof(key), "k%04d", i + i % 2);
+        TEST_ASSERT_EQUAL_STRING(key, (const char *)artCursorKey(&cursor, &keyLength));
+        TEST_ASSERT_EQUAL_UINT(strlen(key) + 1, keyLength);
+        TEST_ASSERT_EQUAL_PTR(artSearch(tree, key, keyLength), artCursorValue(&cursor));
+    }
+
+    // Backwards, then stepping on to the end
+    TEST_ASSERT_TRUE(artCursorSeek(&cursor, "k1990", 6));
+    TEST_ASSERT_EQUAL_STRING("k1990", (const char *)artCursorKey(&cursor, &keyLength));
+    int steps = 0;
+    while (artCursorNext(&cursor)) {
+        steps++;
+    }
+    TEST_ASSERT_EQUAL_INT(4, steps);
+    TEST_ASSERT_NULL(artCursorKey(&cursor, &keyLength));
+
+    TEST_ASSERT_TRUE(artCursorSeek(&cursor, "", 0));
+    TEST_ASSERT_EQUAL_STRING("k0000", (const char *)artCursorKey(&cursor, &keyLength));
+    TEST_ASSERT_FALSE(artCursorSeek(&cursor, "l", 2));
+    artCursorFree(&cursor);
+    freeART(tree);
+}
+
+void test_frontCache(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetFrontCache(tree, 100));
+    TEST_ASSERT_EQUAL_UINT(127, tree->frontCache->mask);
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "hot:%d", i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+
+    // Found leaves are remembered, and a new value is read through them
+    TEST_ASSERT_EQUAL_INT(7, *(int *)artSearch(tree, "hot:7", 6));
+    int cached = 0;
+    for (size_t i = 0; i <= tree->frontCache->mask; i++) {
+        cached += tree->frontCache->slots[i].leaf != NULL;
+    }
+    TEST_ASSERT_EQUAL_INT(1, cached);
+    int value = 70;
+    TEST_ASSERT_TRUE(artInsert(tree, "hot:7", 6, &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_INT(70, *(int *)artSearch(tree, "hot:7", 6));
+
+    // A deleted key leaves the cache with its leaf
+    TEST_ASSERT_TRUE(artDelete(tree, "hot:7", 6));
+    TEST_ASSERT_NULL(artSearch(tree, "hot:7", 6));
+    value = 700;
+    TEST_ASSERT_TRUE(artInsert(tree, "hot:7", 6, &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_INT(700, *(int *)artSearch(tree, "hot:7", 6));
+    for (int i = 0; i < 1000; i += 3) {
+        snprintf(key, sizeof(key), "hot:%d", i);
+        TEST_ASSERT_NOT_NULL(artSearch(tree, key, strlen(key) + 1));
+        TEST_ASSERT_TRUE(artDelete(tree, key, strlen(key) + 1));
+        TEST_ASSERT_NULL(artSearch(tree, key, strlen(key) + 1));
+    }
+
+    TEST_ASSERT_TRUE(artSetFrontCache(tree, 0));
+    TEST_ASSERT_NULL(tree->frontCache);
+    TEST_ASSERT_EQUAL_INT(8, *(int *)artSearch(tree, "hot:8", 6));
+    freeART(tree);
+
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetFrontCache(tree, 16));
+    TEST_ASSERT_FALSE(artSetLeafSuffixes(tree, true));
+    freeART(tree);
+}
+
+void test_jumpTable(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_FALSE(artSetJumpTable(tree, 3));
+    TEST_ASSERT_TRUE(artSetJumpTable(tree, 2));
+    uint8_t key[3] = { 0, 0, 'x' };
+    for (int i = 0; i < 65536; i++) {
+        key[0] = i & 0xFF;
+        key[1] = i >> 8;
+        TEST_ASSERT_TRUE(artInsert(tree, key, 3, &i, sizeof(i)));
+    }
+
+    JumpTable *table = tree->jumpTable;
+    TEST_ASSERT_FALSE(table->stale);
+    TEST_ASSERT_EQUAL_PTR(tree->root, table->parents[0]);
+    TEST_ASSERT_NOT_NULL(table->slots[0x0705]);
+    TEST_ASSERT_EQUAL_UINT(65536, tree->root->subtreeSize);
+    key[0] = 5;
+    key[1] = 7;
+    TEST_ASSERT_EQUAL_INT(0x0705, *(int *)artSearch(tree, key, 3));
+    // Keys shorter than the table take the way from the root
+    TEST_ASSERT_NULL(artSearch(tree, "\x07", 1));
+
+    // Emptying a subtree frees its Node256, and the table is rebuilt
+    key[0] = 7;
+    for (int i = 0; i < 250; i++) {
+        key[1] = i;
+        TEST_ASSERT_TRUE(artDelete(tree, key, 3));
+    }
+    TEST_ASSERT_FALSE(table->stale);
+    TEST_ASSERT_NULL(table->parents[1 + 7]);
+    TEST_ASSERT_NULL(table->slots[0x0700]);
+    key[1] = 251;
+    TEST_ASSERT_NOT_NULL(artSearch(tree, key, 3));
+    key[1] = 1;
+    TEST_ASSERT_NULL(artSearch(tree, key, 3));
+    TEST_ASSERT_EQUAL_UINT(65536 - 250, tree->size);
+    TEST_ASSERT_EQUAL_UINT(65536 - 250, tree->root->subtreeSize);
+
+    TEST_ASSERT_TRUE(artSetJumpTable(tree, 0));
+    TEST_ASSERT_NULL(tree->jumpTable);
+    freeART(tree);
+}
+
+void test_nodePromotion(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetNodePromotion(tree, sizeof(Node256)));
+    char key[4] = "k0";
+    for (int i = 0; i < 10; i++) {
+        key[1] = '0' + i;
+        TEST_ASSERT_TRUE(artInsert(tree, key, 3, &i, sizeof(i)));
+    }
+    TEST_ASSERT_EQUAL_INT(NODE16, tree->root->type);
+
+    // 200 lookups, one in NODE_HEAT_SAMPLE heats the root
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 10; i++) {
+            key[1] = '0' + i;
+            TEST_ASSERT_EQUAL_INT(i, *(int *)artSearch(tree, key, 3));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT(200 / NODE_HEAT_SAMPLE, tree->root->heat);
+    TEST_ASSERT_EQUAL_UINT(1, artAdaptNodes(tree));
+    TEST_ASSERT_EQUAL_INT(NODE256, tree->root->type);
+    TEST_ASSERT_TRUE(tree->root->promoted);
+    TEST_ASSERT_EQUAL_UINT(1, tree->promotion->promoted);
+    TEST_ASSERT_EQUAL_UINT(10, tree->root->subtreeSize);
+
+    // Deletes leave a promoted node alone, cooling down takes it back
+    TEST_ASSERT_TRUE(artDelete(tree, "k9", 3));
+    TEST_ASSERT_EQUAL_INT(NODE256, tree->root->type);
+    TEST_ASSERT_EQUAL_INT(4, *(int *)artSearch(tree, "k4", 3));
+    TEST_ASSERT_EQUAL_UINT(1, artAdaptNodes(tree));
+    TEST_ASSERT_EQUAL_INT(NODE16, tree->root->type);
+    TEST_ASSERT_EQUAL_UINT(0, tree->promotion->promoted);
+    TEST_ASSERT_EQUAL_INT(4, *(int *)artSearch(tree, "k4", 3));
+
+    TEST_ASSERT_TRUE(artSetNodePromotion(tree, 0));
+    TEST_ASSERT_NULL(tree->promotion);
+    freeART(tree);
+}
+
+typedef struct {
+    char keys[2000][24];
+    int nextKey;
+    void *results[2000];
+    int completed;
+} LookupFeed;
+
+static bool nextLookup(void *data, const void **key, size_t *keyLength, void **context) {
+    LookupFeed *feed = data;
+    if (feed->nextKey == 2000) {
+        return false;
+    }
+    *key = feed->keys[feed->nextKey];
+    *keyLength = strlen(feed->keys[feed->nextKey]) + 1;
+    *context = &feed->results[feed->nextKey++];
+    return true;
+}
+
+static void lookupDone(void *data, void *context, void *value) {
+    ((LookupFeed *)data)->completed++;
+    *(void **)context = value;
+}
+
+void test_artLookupInterleaved(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    LookupFeed *feed = calloc(1, sizeof(LookupFeed));
+    for (int i = 0; i < 2000; i++) {
+        snprintf(feed->keys[i], sizeof(feed->keys[i]), "user:%d", i * 7);
+        if (i % 2 == 0) {
+            TEST_ASSERT_TRUE(artInsert(tree, feed->keys[i], strlen(feed->keys[i]) + 1, &i, sizeof(i)));
+        }
+    }
+
+    // A single lookup driven by hand
+    ArtLookup lookup;
+    int steps = 1;
+    artLookupStart(tree, &lookup, feed->keys[10], strlen(feed->keys[10]) + 1);
+    while (!artLookupStep(tree, &lookup)) {
+        steps++;
+    }
+    TEST_ASSERT_TRUE(steps > 1);
+    TEST_ASSERT_EQUAL_INT(10, *(int *)artLookupValue(tree, &lookup));
+
+    TEST_ASSERT_EQUAL_UINT(1000, artLookupInterleaved(tree, 24, nextLookup, lookupDone, feed));
+    TEST_ASSERT_EQUAL_INT(2000, feed->completed);
+    for (int i = 0; i < 2000; i++) {
+        if (i % 2 == 0) {
+            TEST_ASSERT_NOT_NULL(feed->results[i]);
+            TEST_ASSERT_EQUAL_INT(i, *(int *)feed->results[i]);
+        } else {
+            TEST_ASSERT_NULL(feed->results[i]);
+        }
+    }
+
+    free(feed);
+    freeART(tree);
+}
+
+static int valuesDestroyed;
+static int bulkCalls;
+
+static void destroyValue(void *value) {
+    valuesDestroyed++;
+    free(value);
+}
+
+static void destroyValues(void *data, void **values, size_t count) {
+    (*(int *)data)++;
+    for (size_t i = 0; i < count; i++) {
+        destroyValue(values[i]);
+    }
+}
+
+void test_valuePolicies(void) {
+    char key[32];
+    valuesDestroyed = 0;
+
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_OWN, destroyValue));
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "owned:%d", i);
+        int *value = malloc(sizeof(int));
+        *value = i;
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, value, sizeof(int)));
+    }
+    TEST_ASSERT_FALSE(artSetValuePolicy(tree, ART_VALUE_COPY, NULL));
+
+    // The tree hands back the pointer it was given
+    int *stored = artSearch(tree, "owned:5", strlen("owned:5") + 1);
+    TEST_ASSERT_EQUAL_INT(5, *stored);
+    TEST_ASSERT_TRUE(artInsert(tree, "owned:5", strlen("owned:5") + 1, stored, sizeof(int)));
+    TEST_ASSERT_EQUAL_INT(0, valuesDestroyed);
+
+    TEST_ASSERT_TRUE(artInsert(tree, "owned:5", strlen("owned:5") + 1, malloc(sizeof(int)), sizeof(int)));
+    TEST_ASSERT_EQUAL_INT(1, valuesDestroyed);
+    TEST_ASSERT_TRUE(artDelete(tree, "owned:6", strlen("owned:6") + 1));
+    TEST_ASSERT_EQUAL_INT(2, valuesDestroyed);
+    TEST_ASSERT_EQUAL_UINT(111, artDeletePrefix(tree, "owned:1", strlen("owned:1")));
+    TEST_ASSERT_EQUAL_INT(113, valuesDestroyed);
+
+    // What is left goes to the bulk destructor in batches
+    bulkCalls = 0;
+    artSetBulkFree(tree, destroyValues, &bulkCalls);
+    freeART(tree);
+    TEST_ASSERT_EQUAL_INT(1001, valuesDestroyed);
+    TEST_ASSERT_EQUAL_INT((888 + ART_FREE_BATCH - 1) / ART_FREE_BATCH, bulkCalls);
+
+    // Borrowed values are never freed by the tree
+    static int borrowed[100];
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_BORROW, NULL));
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "borrowed:%d", i);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &borrowed[i], sizeof(int)));
+    }
+    TEST_ASSERT_EQUAL_PTR(&borrowed[42], artSearch(tree, "borrowed:42", strlen("borrowed:42") + 1));
+    TEST_ASSERT_TRUE(artDelete(tree, "borrowed:42", strlen("borrowed:42") + 1));
+    freeART(tree);
+}
+
+// Tracks the bytes a tree holds through the size hints it passes
+typedef struct {
+    ArtAllocator allocator;
+    long liveBytes;
+    long liveBlocks;
+    long blockLimit; // Allocations fail at this many live blocks, 0 for never
+} CountingAllocator;
+
+static void *countingAlloc(ArtAllocator *allocator, size_t size) {
+    CountingAllocator *counting = (CountingAllocator *)allocator;
+    if (counting->blockLimit && counting->liveBlocks >= counting->blockLimit) {
+        return NULL;
+    }
+    counting->liveBytes += size;
+    counting->liveBlocks++;
+    return malloc(size);
+}
+
+static void *countingRealloc(ArtAllocator *allocator, void *ptr, size_t oldSize, size_t newSize) {
+    ((CountingAllocator *)allocator)->liveBytes += (long)newSize - (long)oldSize;
+    return realloc(ptr, newSize);
+}
+
+static void countingFree(ArtAllocator *allocator, void *ptr, size_t size) {
+    CountingAllocator *counting = (CountingAllocator *)allocator;
+    counting->liveBytes -= size;
+    counting->liveBlocks--;
+    free(ptr);
+}
+
+static void checkAllocator(ArtAllocator *allocator) {
+    ART *tree = initializeAdaptiveRadixTreeWithAllocator(allocator);
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, true));
+    insertUrls(tree, 3000);
+    TEST_ASSERT_EQUAL_UINT(3000, tree->size);
+
+    IterateCheck check = { .ordered = true, .keysMatchValues = true };
+    artIterate(tree, checkIteratedKey, &check);
+    TEST_ASSERT_EQUAL_INT(3000, check.visited);
+    TEST_ASSERT_TRUE(check.keysMatchValues);
+
+    TEST_ASSERT_EQUAL_UINT(1000, artDeletePrefix(tree, "https://example.com/catalog/electronics/computers/laptops/item-01",
+                                                 strlen("https://example.com/catalog/electronics/computers/laptops/item-01")));
+    TEST_ASSERT_EQUAL_UINT(2000, tree->size);
+    freeART(tree);
+}
+
+void test_allocators(void) {
+    checkAllocator(NULL);
+    checkAllocator(artMallocAllocator());
+    checkAllocator(artArenaAllocator(4096));
+    checkAllocator(artThreadCacheAllocator());
+    artThreadCacheFlush();
+
+    // Size hints add up: an emptied tree holds no memory
+    CountingAllocator counting = { { countingAlloc, countingRealloc, countingFree, NULL, false }, 0, 0, 0 };
+    ART *tree = initializeAdaptiveRadixTreeWithAllocator(&counting.allocator);
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_BORROW, NULL));
+    TEST_ASSERT_TRUE(artSetLeafBuckets(tree, 8));
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, true));
+    char key[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "%d", i * 7919 % 5000);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, tree, 0));
+    }
+    TEST_ASSERT_TRUE(counting.liveBytes > 0);
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "%d", i);
+        TEST_ASSERT_TRUE(artDelete(tree, key, strlen(key) + 1));
+    }
+    TEST_ASSERT_NULL(tree->root);
+    TEST_ASSERT_EQUAL_INT(0, counting.liveBytes);
+    TEST_ASSERT_EQUAL_INT(0, counting.liveBlocks);
+    freeART(tree);
+}
+
+static uint64_t nextRandom(void *state) {
+    uint64_t *x = state;
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int copyKey(void *data, const uint8_t *key, size_t keyLength, void *value) {
+    (void)value;
+    memcpy(data, key, keyLength);
+    return 0;
+}
+
+void test_samplingAndQuantiles(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    char key[32];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key:%05d", i * 7919 % 10000);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, artApproxQuantile(tree, 0, copyKey, key));
+    TEST_ASSERT_EQUAL_STRING("key:00000", key);
+    TEST_ASSERT_EQUAL_INT(0, artApproxQuantile(tree, 0.25, copyKey, key));
+    TEST_ASSERT_EQUAL_STRING("key:02500", key);
+    TEST_ASSERT_EQUAL_INT(0, artApproxQuantile(tree, 1, copyKey, key));
+    TEST_ASSERT_EQUAL_STRING("key:09999", key);
+    TEST_ASSERT_EQUAL_INT(INVALID, artApproxQuantile(tree, 1.5, copyKey, key));
+
+    // Dropping the lower half moves the median into the upper one
+    TEST_ASSERT_EQUAL_UINT(5000, artDeleteRange(tree, NULL, 0, "key:05000", strlen("key:05000")));
+    TEST_ASSERT_EQUAL_INT(0, artApproxQuantile(tree, 0.5, copyKey, key));
+    TEST_ASSERT_EQUAL_STRING("key:07500", key);
+
+    // Every tenth of the remaining keys gets its share of the samples
+    int deciles[10] = { 0 };
+    uint64_t seed = 42;
+    for (int i = 0; i < 20000; i++) {
+        TEST_ASSERT_EQUAL_INT(0, artSampleRandom(tree, nextRandom, &seed, copyKey, key));
+        deciles[(atoi(key + 4) - 5000) / 500]++;
+    }
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_INT_WITHIN(300, 2000, deciles[i]);
+    }
+
+    freeART(tree);
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_EQUAL_INT(INVALID, artSampleRandom(tree, nextRandom, &seed, copyKey, key));
+    freeART(tree);
+}
+
+void test_exportSorted(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetLeafSuffixes(tree, true));
+    TEST_ASSERT_TRUE(artSetValueLog(tree, 1024, 4 << 20));
+    char key[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key:%05d", i * 7919 % 5000);
+        TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+    // Larger than the export buffer, written without going through it
+    size_t bigLength = ART_EXPORT_BUFFER + 100;
+    uint8_t *big = malloc(bigLength);
+    memset(big, 'b', bigLength);
+    TEST_ASSERT_TRUE(artInsert(tree, "key:02500x", 10, big, bigLength));
+
+    FILE *file = tmpfile();
+    TEST_ASSERT_EQUAL_INT(5001, artExportSorted(tree, fileno(file), ART_EXPORT_BINARY));
+    rewind(file);
+    char previous[32] = "";
+    for (int i = 0; i < 5001; i++) {
+        uint8_t lengths[8];
+        TEST_ASSERT_EQUAL_UINT(8, fread(lengths, 1, 8, file));
+        uint32_t keyLength = lengths[0] | lengths[1] << 8 | lengths[2] << 16 | (uint32_t)lengths[3] << 24;
+        uint32_t valueLength = lengths[4] | lengths[5] << 8 | lengths[6] << 16 | (uint32_t)lengths[7] << 24;
+        TEST_ASSERT_TRUE(keyLength < sizeof(key));
+        TEST_ASSERT_EQUAL_UINT(keyLength, fread(key, 1, keyLength, file));
+        key[keyLength] = '\0';
+        TEST_ASSERT_TRUE(strcmp(previous, key) < 0);
+        strcpy(previous, key);
+
+        uint8_t *value = malloc(valueLength);
+        TEST_ASSERT_EQUAL_UINT(valueLength, fread(value, 1, valueLength, file));
+        if (i == 2501) {
+            TEST_ASSERT_EQUAL_STRING("key:02500x", key);
+            TEST_ASSERT_EQUAL_UINT(bigLength, valueLength);
+            TEST_ASSERT_EQUAL_MEMORY(big, value, bigLength);
+        } else {
+            TEST_ASSERT_EQUAL_UINT(sizeof(int), valueLength);
+            TEST_ASSERT_EQUAL_INT(atoi(key + 4), *(int *)value * 7919 % 5000);
+        }
+        free(value);
+    }
+    TEST_ASSERT_EQUAL_INT(EOF, fgetc(file));
+    fclose(file);
+    free(big);
+    freeART(tree);
+
+    // Separators and non printable bytes are escaped in text exports
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artInsert(tree, "b", 1, "two\tthree", 9));
+    TEST_ASSERT_TRUE(artInsert(tree, "a\\", 2, "one", 4));
+    file = tmpfile();
+    TEST_ASSERT_EQUAL_INT(2, artExportSorted(tree, fileno(file), ART_EXPORT_TEXT));
+    rewind(file);
+    char text[64] = { 0 };
+    TEST_ASSERT_TRUE(fread(text, 1, sizeof(text) - 1, file) > 0);
+    TEST_ASSERT_EQUAL_STRING("a\\x5c\tone\\x00\nb\ttwo\\x09three\n", text);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(INVALID, artExportSorted(tree, -1, ART_EXPORT_TEXT));
+    freeART(tree);
+}
+
+static uint64_t fakeMillis;
+
+static uint64_t fakeClock(void) {
+    return fakeMillis;
+}
+
+void test_expiry(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    fakeMillis = 1000000;
+    artSetClock(tree, fakeClock);
+
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "session:%d", i);
+        // Half the keys expire after (i + 1) seconds, the others never
+        if (i % 2) {
+            TEST_ASSERT_TRUE(artInsert(tree, key, strlen(key) + 1, &i, sizeof(i)));
+        } else {
+            TEST_ASSERT_TRUE(artInsertWithTTL(tree, key, strlen(key) + 1, &i, sizeof(i), (i + 1) * 1000));
+        }
+    }
+    TEST_ASSERT_FALSE(artExpire(tree, "session:1000", strlen("session:1000") + 1, 1000));
+
+    // Renewing a TTL or overwriting the value outlives the first timer
+    TEST_ASSERT_TRUE(artExpire(tree, "session:0", strlen("session:0") + 1, 600 * 1000));
+    int value = -1;
+    TEST_ASSERT_TRUE(artInsert(tree, "session:2", strlen("session:2") + 1, &value, sizeof(value)));
+
+    // Lookups drop expired keys on the spot
+    fakeMillis += 5500;
+    TEST_ASSERT_NULL(artSearch(tree, "session:4", strlen("session:4") + 1));
+    TEST_ASSERT_NOT_NULL(artSearch(tree, "session:6", strlen("session:6") + 1));
+    TEST_ASSERT_EQUAL_UINT(999, tree->size);
+
+    int visited = 0;
+    artIterate(tree, countKeys, &visited);
+    TEST_ASSERT_EQUAL_INT(999, visited);
+
+    // session:0 now expires too, only session:2 has lost its TTL
+
+    // Active expiry works through fired timers a budget at a time
+    fakeMillis += 1000 * 1000;
+    size_t expired = 0;
+    size_t step;
+    while ((step = artExpireStep(tree, 64)) > 0) {
+        TEST_ASSERT_TRUE(step <= 64);
+        expired += step;
+    }
+    TEST_ASSERT_EQUAL_UINT(500 - 2, expired);
+    TEST_ASSERT_EQUAL_UINT(501, tree->size);
+    TEST_ASSERT_NULL(tree->timers->due);
+    TEST_ASSERT_EQUAL_INT(-1, *(int *)artSearch(tree, "session:2", strlen("session:2") + 1));
+
+    freeART(tree);
+}
+
+typedef struct {
+    ArtLock base;
+    int exclusive;
+    int shared;
+    int held;
+} CountingLock;
+
+static void countingLock(ArtLock *lock, bool exclusive) {
+    CountingLock *counting = (CountingLock *)lock;
+    TEST_ASSERT_EQUAL_INT(0, counting->held++);
+    counting->exclusive += exclusive;
+    counting->shared += !exclusive;
+}
+
+static void countingUnlock(ArtLock *lock, bool exclusive) {
+    (void)exclusive;
+    ((CountingLock *)lock)->held--;
+}
+
+void test_writeBuffer(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    fakeMillis = 1000;
+    artSetClock(tree, fakeClock);
+    CountingLock lock = { { countingLock, countingUnlock }, 0, 0, 0 };
+    ArtWriteBuffer buffer;
+    TEST_ASSERT_TRUE(artWriteBufferInit(&buffer, tree, 4, 10, &lock.base));
+
+    // Pending inserts are seen through the buffer only
+    char key[16];
+    for (int i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "w:%d", 3 - i);
+        TEST_ASSERT_TRUE(artBufferedInsert(&buffer, key, strlen(key) + 1, &i, sizeof(i)));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, tree->size);
+    TEST_ASSERT_EQUAL_STRING("w:0", buffer.keys[0]);
+    TEST_ASSERT_EQUAL_INT(3, *(int *)artBufferedSearch(&buffer, "w:0", 4));
+    TEST_ASSERT_NULL(artSearch(tree, "w:0", 4));
+    TEST_ASSERT_EQUAL_INT(0, lock.exclusive);
+
+    // A fifth key does not fit, the four go in as one batch
+    int value = 4;
+    TEST_ASSERT_TRUE(artBufferedInsert(&buffer, "w:4", 4, &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_UINT(4, tree->size);
+    TEST_ASSERT_EQUAL_UINT(1, buffer.count);
+    TEST_ASSERT_EQUAL_INT(1, lock.exclusive);
+    TEST_ASSERT_EQUAL_INT(3, *(int *)artSearch(tree, "w:0", 4));
+
+    // Tree keys are read under the shared lock, the delay bounds the rest
+    TEST_ASSERT_EQUAL_INT(2, *(int *)artBufferedSearch(&buffer, "w:1", 4));
+    TEST_ASSERT_EQUAL_INT(1, lock.shared);
+    fakeMillis += 10;
+    TEST_ASSERT_NULL(artBufferedSearch(&buffer, "w:9", 4));
+    TEST_ASSERT_EQUAL_UINT(5, tree->size);
+    TEST_ASSERT_EQUAL_UINT(0, buffer.count);
+
+    // Deletes reach pending inserts and the tree alike
+    value = 40;
+    TEST_ASSERT_TRUE(artBufferedInsert(&buffer, "w:4", 4, &value, sizeof(value)));
+    TEST_ASSERT_EQUAL_INT(40, *(int *)artBufferedSearch(&buffer, "w:4", 4));
+    TEST_ASSERT_TRUE(artBufferedDelete(&buffer, "w:4", 4));
+    TEST_ASSERT_NULL(artBufferedSearch(&buffer, "w:4", 4));
+    TEST_ASSERT_FALSE(artBufferedDelete(&buffer, "w:4", 4));
+
+    TEST_ASSERT_TRUE(artBufferedInsert(&buffer, "w:5", 4, &value, sizeof(value)));
+    artWriteBufferFree(&buffer);
+    TEST_ASSERT_EQUAL_UINT(5, tree->size);
+    TEST_ASSERT_EQUAL_INT(40, *(int *)artSearch(tree, "w:5", 4));
+    TEST_ASSERT_EQUAL_INT(0, lock.held);
+    freeART(tree);
+}
+
+// Posts an operation the way another thread would, for the next combining
+// pass to pick up
+static void postCombined(ArtCombiner *combiner, size_t thread, ArtCombineOp op, const char *key, const void *value) {
+    ArtCombineSlot *slot = &combiner->slots[thread];
+    slot->op = op;
+    slot->key = key;
+    slot->keyLength = strlen(key) + 1;
+    slot->value = value;
+    slot->valueLength = sizeof(int);
+    atomic_store(&slot->state, 1);
+}
+
+void test_flatCombining(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    artSetValuePolicy(tree, ART_VALUE_OWN, NULL);
+    CountingLock lock = { { countingLock, countingUnlock }, 0, 0, 0 };
+    ArtCombiner combiner;
+    TEST_ASSERT_TRUE(artCombinerInit(&combiner, tree, 4, &lock.base));
+
+    // Alone, a thread combines its own operations one by one
+    int *value = malloc(sizeof(int));
+    *value = 1;
+    TEST_ASSERT_TRUE(artCombinedInsert(&combiner, 0, "c:a", 4, value, sizeof(int)));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artCombinedSearch(&combiner, 0, "c:a", 4));
+    TEST_ASSERT_NULL(artCombinedSearch(&combiner, 0, "c:b", 4));
+    TEST_ASSERT_FALSE(artCombinedInsert(&combiner, 4, "c:b", 4, value, sizeof(int)));
+    TEST_ASSERT_EQUAL_size_t(3, combiner.passes);
+
+    // The next combiner applies whatever the others posted in one pass, the
+    // later of two inserts of one key replacing the earlier
+    int *first = malloc(sizeof(int));
+    int *second = malloc(sizeof(int));
+    *first = 2;
+    *second = 3;
+    postCombined(&combiner, 1, ART_COMBINE_INSERT, "c:b", first);
+    postCombined(&combiner, 2, ART_COMBINE_DELETE, "c:a", NULL);
+    postCombined(&combiner, 3, ART_COMBINE_INSERT, "c:b", second);
+    TEST_ASSERT_EQUAL_INT(3, *(int *)artCombinedSearch(&combiner, 0, "c:b", 4));
+    TEST_ASSERT_EQUAL_size_t(4, combiner.passes);
+    TEST_ASSERT_EQUAL_size_t(7, combiner.applied);
+    for (int i = 1; i < 4; i++) {
+        TEST_ASSERT_EQUAL_INT(2, atomic_load(&combiner.slots[i].state));
+        TEST_ASSERT_TRUE(combiner.slots[i].ok);
+    }
+    TEST_ASSERT_EQUAL_UINT(1, tree->size);
+    TEST_ASSERT_NULL(artSearch(tree, "c:a", 4));
+
+    TEST_ASSERT_TRUE(artCombinedDelete(&combiner, 0, "c:b", 4));
+    TEST_ASSERT_FALSE(artCombinedDelete(&combiner, 0, "c:b", 4));
+    TEST_ASSERT_EQUAL_INT(6, lock.exclusive);
+    TEST_ASSERT_EQUAL_INT(0, lock.held);
+    artCombinerFree(&combiner);
+    freeART(tree);
+}
+
+typedef struct {
+    int attempts;
+    int value;
+} TransferRun;
+
+// Moves value from t:a to t:b; the first attempt meets a write of another
+// thread to t:a between its read and its commit
+static bool transfer(ArtTxn *txn, void *data) {
+    TransferRun *run = data;
+    int *from = artTxnGet(txn, "t:a", 4);
+    if (from == NULL) {
+        return false;
+    }
+    int left = *from - run->value;
+    if (run->attempts++ == 0) {
+        int other = 100;
+        artInsert(txn->tree, "t:a", 4, &other, sizeof(other));
+    }
+    return artTxnPut(txn, "t:a", 4, &left, sizeof(left)) && artTxnPut(txn, "t:b", 4, &run->value, sizeof(run->value));
+}
+
+void test_transactions(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    ArtTxn txn;
+    TEST_ASSERT_FALSE(artTxnBegin(&txn, tree, NULL));
+    TEST_ASSERT_TRUE(artSetTransactions(tree, 64));
+    int values[] = { 1, 2, 10, 20 };
+    artInsert(tree, "t:a", 4, &values[0], sizeof(int));
+    artInsert(tree, "t:b", 4, &values[1], sizeof(int));
+
+    // A primary key and an index entry change together
+    CountingLock lock = { { countingLock, countingUnlock }, 0, 0, 0 };
+    TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, &lock.base));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artTxnGet(&txn, "t:a", 4));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "t:a", 4, &values[2], sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "t:i", 4, &values[0], sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnDelete(&txn, "t:b", 4));
+    TEST_ASSERT_EQUAL_INT(10, *(int *)artTxnGet(&txn, "t:a", 4));
+    TEST_ASSERT_NULL(artTxnGet(&txn, "t:b", 4));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artSearch(tree, "t:a", 4));
+    TEST_ASSERT_TRUE(artTxnCommit(&txn));
+    TEST_ASSERT_EQUAL_INT(10, *(int *)artSearch(tree, "t:a", 4));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artSearch(tree, "t:i", 4));
+    TEST_ASSERT_NULL(artSearch(tree, "t:b", 4));
+    TEST_ASSERT_EQUAL_INT(1, lock.shared);
+    TEST_ASSERT_EQUAL_INT(1, lock.exclusive);
+
+    // A key read changed, so none of the writes go in
+    TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, NULL));
+    TEST_ASSERT_NULL(artTxnGet(&txn, "t:b", 4));
+    artInsert(tree, "t:b", 4, &values[1], sizeof(int));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "t:c", 4, &values[3], sizeof(int)));
+    TEST_ASSERT_FALSE(artTxnCommit(&txn));
+    TEST_ASSERT_NULL(artSearch(tree, "t:c", 4));
+
+    // Nor do they when the tree refuses one of them
+    TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, NULL));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "t:c", 4, &values[3], sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "t:a", 3, &values[3], sizeof(int)));
+    TEST_ASSERT_FALSE(artTxnCommit(&txn));
+    TEST_ASSERT_NULL(artSearch(tree, "t:c", 4));
+    TEST_ASSERT_EQUAL_UINT(3, tree->size);
+
+    // artTxnRun() starts over after the conflict
+    TransferRun run = { 0, 4 };
+    TEST_ASSERT_TRUE(artTxnRun(tree, NULL, transfer, &run, 3));
+    TEST_ASSERT_EQUAL_INT(2, run.attempts);
+    TEST_ASSERT_EQUAL_INT(96, *(int *)artSearch(tree, "t:a", 4));
+    TEST_ASSERT_EQUAL_INT(4, *(int *)artSearch(tree, "t:b", 4));
+    freeART(tree);
+
+    // Running out of memory for a copied value or a new leaf leaves every
+    // key as it was, however far the commit got
+    CountingAllocator counting = { { countingAlloc, countingRealloc, countingFree, NULL, false }, 0, 0, 0 };
+    tree = initializeAdaptiveRadixTreeWithAllocator(&counting.allocator);
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_COPY, NULL));
+    TEST_ASSERT_TRUE(artSetTransactions(tree, 64));
+    TEST_ASSERT_TRUE(artInsert(tree, "t:a", 4, &values[0], sizeof(int)));
+    long blocks = counting.liveBlocks;
+    for (long spare = 0; spare < 2; spare++) {
+        TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, NULL));
+        TEST_ASSERT_TRUE(artTxnPut(&txn, "t:n", 4, &values[3], sizeof(int)));
+        TEST_ASSERT_TRUE(artTxnPut(&txn, "t:a", 4, &values[2], sizeof(int)));
+        counting.blockLimit = blocks + spare;
+        TEST_ASSERT_FALSE(artTxnCommit(&txn));
+        counting.blockLimit = 0;
+        TEST_ASSERT_EQUAL_INT(1, *(int *)artSearch(tree, "t:a", 4));
+        TEST_ASSERT_NULL(artSearch(tree, "t:n", 4));
+        TEST_ASSERT_EQUAL_UINT(1, tree->size);
+        TEST_ASSERT_EQUAL_INT(blocks, counting.liveBlocks);
+    }
+    freeART(tree);
+}
+
+void test_versioning(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    ArtSnapshot snapshot;
+    TEST_ASSERT_FALSE(artSnapshotBegin(&snapshot, tree, NULL));
+    TEST_ASSERT_TRUE(artSetVersioning(tree, true));
+    int values[] = { 1, 2, 3, 10 };
+    artInsert(tree, "v:a", 4, &values[0], sizeof(int));
+    artInsert(tree, "v:b", 4, &values[1], sizeof(int));
+
+    // With no snapshot open nothing is kept
+    artInsert(tree, "v:b", 4, &values[1], sizeof(int));
+    TEST_ASSERT_EQUAL_size_t(0, tree->history->chains);
+
+    // The snapshot keeps seeing what writes replace, delete or add after it
+    CountingLock lock = { { countingLock, countingUnlock }, 0, 0, 0 };
+    TEST_ASSERT_TRUE(artSnapshotBegin(&snapshot, tree, &lock.base));
+    artInsert(tree, "v:a", 4, &values[3], sizeof(int));
+    artDelete(tree, "v:b", 4);
+    artInsert(tree, "v:c", 4, &values[2], sizeof(int));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artSnapshotGet(&snapshot, "v:a", 4));
+    TEST_ASSERT_EQUAL_INT(2, *(int *)artSnapshotGet(&snapshot, "v:b", 4));
+    TEST_ASSERT_NULL(artSnapshotGet(&snapshot, "v:c", 4));
+    TEST_ASSERT_EQUAL_INT(10, *(int *)artSearch(tree, "v:a", 4));
+    TEST_ASSERT_NULL(artSearch(tree, "v:b", 4));
+    TEST_ASSERT_EQUAL_INT(3, *(int *)artSearchAsOf(tree, "v:c", 4, tree->history->clock));
+    TEST_ASSERT_EQUAL_INT(3, lock.shared);
+
+    // A batch goes in under one stamp
+    uint64_t before = tree->history->clock;
+    const void *keys[] = { "v:d", "v:e" };
+    size_t keyLengths[] = { 4, 4 };
+    const void *batchValues[] = { &values[0], &values[1] };
+    size_t valueLengths[] = { sizeof(int), sizeof(int) };
+    TEST_ASSERT_EQUAL_size_t(2, artInsertBatch(tree, keys, keyLengths, batchValues, valueLengths, 2));
+    TEST_ASSERT_NULL(artSearchAsOf(tree, "v:d", 4, before));
+    TEST_ASSERT_NULL(artSearchAsOf(tree, "v:e", 4, before));
+    TEST_ASSERT_EQUAL_INT(1, *(int *)artSearchAsOf(tree, "v:d", 4, before + 1));
+    TEST_ASSERT_EQUAL_INT(2, *(int *)artSearchAsOf(tree, "v:e", 4, before + 1));
+
+    // Once it ends, its versions can go
+    TEST_ASSERT_FALSE(artSetVersioning(tree, false));
+    artSnapshotEnd(&snapshot);
+    TEST_ASSERT_EQUAL_INT(2, lock.exclusive);
+    TEST_ASSERT_TRUE(artTrimVersions(tree) > 0);
+    TEST_ASSERT_EQUAL_size_t(0, tree->history->chains);
+    TEST_ASSERT_EQUAL_INT(10, *(int *)artSearchAsOf(tree, "v:a", 4, tree->history->clock));
+    freeART(tree);
+
+    // A full node grows before the leaf of a new key is made, so that a
+    // version, once kept, always has its leaf in the tree. Memory for one
+    // more block is then enough.
+    CountingAllocator counting = { { countingAlloc, countingRealloc, countingFree, NULL, false }, 0, 0, 0 };
+    tree = initializeAdaptiveRadixTreeWithAllocator(&counting.allocator);
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_OWN, NULL));
+    TEST_ASSERT_TRUE(artSetVersioning(tree, true));
+    char key[] = "v:0";
+    for (int i = 0; i < 4; i++) {
+        key[2] = '0' + i;
+        TEST_ASSERT_TRUE(artInsert(tree, key, sizeof(key), malloc(sizeof(int)), sizeof(int)));
+    }
+    TEST_ASSERT_TRUE(artSnapshotBegin(&snapshot, tree, NULL));
+    counting.blockLimit = counting.liveBlocks + 1;
+    TEST_ASSERT_TRUE(artInsert(tree, "v:4", sizeof(key), malloc(sizeof(int)), sizeof(int)));
+    counting.blockLimit = 0;
+    TEST_ASSERT_EQUAL_INT(NODE16, tree->root->type);
+    TEST_ASSERT_NULL(artSnapshotGet(&snapshot, "v:4", sizeof(key)));
+    artSnapshotEnd(&snapshot);
+    artTrimVersions(tree);
+    freeART(tree);
+}
+
+typedef struct {
+    int events;
+    ArtWatchEvent last;
+    char key[16];
+    int value;
+} WatchLog;
+
+static void logWatch(void *data, ArtWatchEvent event, const uint8_t *key, size_t keyLength, void *value) {
+    WatchLog *log = data;
+    log->events++;
+    log->last = event;
+    memcpy(log->key, key, MIN(keyLength, sizeof(log->key)));
+    log->value = value ? *(int *)value : 0;
+}
+
+void test_watchPrefix(void) {
+    ART *tree = initializeAdaptiveRadixTree();
+    WatchLog config = { 0 };
+    WatchLog all = { 0 };
+    ArtWatch *watch = artWatchPrefix(tree, "cfg/", 4, logWatch, &config);
+    TEST_ASSERT_NOT_NULL(watch);
+    ArtWatch *everything = artWatchPrefix(tree, NULL, 0, logWatch, &all);
+    TEST_ASSERT_NOT_NULL(everything);
+
+    int values[] = { 1, 2 };
+    artInsert(tree, "cfg/a", 6, &values[0], sizeof(int));
+    TEST_ASSERT_EQUAL_INT(1, config.events);
+    TEST_ASSERT_EQUAL_INT(ART_WATCH_INSERT, config.last);
+    TEST_ASSERT_EQUAL_STRING("cfg/a", config.key);
+    artInsert(tree, "cfg/a", 6, &values[1], sizeof(int));
+    TEST_ASSERT_EQUAL_INT(ART_WATCH_UPDATE, config.last);
+    TEST_ASSERT_EQUAL_INT(2, config.value);
+
+    // Keys outside the prefix only reach the watch of everything
+    artInsert(tree, "cfh/a", 6, &values[0], sizeof(int));
+    artInsert(tree, "cfg", 4, &values[0], sizeof(int));
+    TEST_ASSERT_EQUAL_INT(2, config.events);
+    TEST_ASSERT_EQUAL_INT(4, all.events);
+
+    // Deletes carry the value the key held
+    artInsert(tree, "cfg/b", 6, &values[0], sizeof(int));
+    TEST_ASSERT_EQUAL_size_t(2, artDeletePrefix(tree, "cfg/", 4));
+    TEST_ASSERT_EQUAL_INT(5, config.events);
+    TEST_ASSERT_EQUAL_INT(ART_WATCH_DELETE, config.last);
+    TEST_ASSERT_TRUE(config.value == 1 || config.value == 2);
+
+    TEST_ASSERT_TRUE(artUnwatch(tree, watch));
+    artInsert(tree, "cfg/c", 6, &values[0], sizeof(int));
+    TEST_ASSERT_EQUAL_INT(5, config.events);
+    TEST_ASSERT_EQUAL_INT(8, all.events);
+    TEST_ASSERT_TRUE(artUnwatch(tree, everything));
+    TEST_ASSERT_NULL(tree->watches);
+    freeART(tree);
+
+    // A committed transaction adds an owned value in one event
+    tree = initializeAdaptiveRadixTree();
+    TEST_ASSERT_TRUE(artSetValuePolicy(tree, ART_VALUE_OWN, NULL));
+    TEST_ASSERT_TRUE(artSetTransactions(tree, 16));
+    WatchLog added = { 0 };
+    TEST_ASSERT_NOT_NULL(artWatchPrefix(tree, NULL, 0, logWatch, &added));
+    int *owned = malloc(sizeof(int));
+    *owned = 7;
+    ArtTxn txn;
+    TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, NULL));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "cfg/t", 6, owned, sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnCommit(&txn));
+    TEST_ASSERT_EQUAL_INT(1, added.events);
+    TEST_ASSERT_EQUAL_INT(ART_WATCH_INSERT, added.last);
+    TEST_ASSERT_EQUAL_INT(7, added.value);
+    TEST_ASSERT_EQUAL_PTR(owned, artSearch(tree, "cfg/t", 6));
+
+    // A refused commit reaches no watch and moves no key version, and its
+    // owned values go back to it
+    int *stored = malloc(sizeof(int));
+    TEST_ASSERT_TRUE(artInsert(tree, "abc", 3, stored, sizeof(int)));
+    uint64_t writes = 0;
+    for (size_t i = 0; i <= tree->versions->mask; i++) {
+        writes += tree->versions->versions[i];
+    }
+    TEST_ASSERT_TRUE(artTxnBegin(&txn, tree, NULL));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "k1", 2, malloc(sizeof(int)), sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "cfg/t", 6, malloc(sizeof(int)), sizeof(int)));
+    TEST_ASSERT_TRUE(artTxnPut(&txn, "ab", 2, malloc(sizeof(int)), sizeof(int)));
+    TEST_ASSERT_FALSE(artTxnCommit(&txn));
+    TEST_ASSERT_EQUAL_INT(2, added.events);
+    for (size_t i = 0; i <= tree->versions->mask; i++) {
+        writes -= tree->versions->versions[i];
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, writes);
+    TEST_ASSERT_NULL(artSearch(tree, "k1", 2));
+    TEST_ASSERT_EQUAL_PTR(owned, artSearch(tree, "cfg/t", 6));
+    freeART(tree);
+}
+
 /*** MAIN ***/
 
 int main(void){
@@ -150,6 +1633,34 @@ int main(void){
     RUN_TEST(test_insertAndFindInt);
     RUN_TEST(test_integratedART);
     RUN_TEST(test_integratedARTExpansion);
+    RUN_TEST(test_artInsertAndSearch);
+    RUN_TEST(test_leafBuckets);
+    RUN_TEST(test_leafSuffixes);
+    RUN_TEST(test_leafSuffixesWithBuckets);
+    RUN_TEST(test_valueLog);
+    RUN_TEST(test_artDelete);
+    RUN_TEST(test_artDeleteRangeAndPrefix);
+    RUN_TEST(test_expiry);
+    RUN_TEST(test_artIterateRangeAndPrefix);
+    RUN_TEST(test_artSearchBatch);
+    RUN_TEST(test_hashIndex);
+    RUN_TEST(test_subtreeFilters);
+    RUN_TEST(test_insertBatch);
+    RUN_TEST(test_appendPath);
+    RUN_TEST(test_cursorSeek);
+    RUN_TEST(test_frontCache);
+    RUN_TEST(test_jumpTable);
+    RUN_TEST(test_nodePromotion);
+    RUN_TEST(test_writeBuffer);
+    RUN_TEST(test_flatCombining);
+    RUN_TEST(test_transactions);
+    RUN_TEST(test_versioning);
+    RUN_TEST(test_watchPrefix);
+    RUN_TEST(test_artLookupInterleaved);
+    RUN_TEST(test_valuePolicies);
+    RUN_TEST(test_allocators);
+    RUN_TEST(test_samplingAndQuantiles);
+    RUN_TEST(test_exportSorted);
 
     return UNITY_END();
 }
\ No newline at end of file